@@ -0,0 +1,247 @@
+/*
+Benchmarks for startup, evaluation, messaging, snapshotting and density.
+
+Run with `npm run bench`. Results are printed and written as JSON (by default
+to bench-results.json). Pass `--baseline=<file>` with the results of an earlier
+run to fail if any result has regressed by more than `--tolerance` (default
+0.2, i.e. 20%).
+
+Options:
+
+  --out=<file>         Where to write the JSON results
+  --baseline=<file>    Results to compare against
+  --tolerance=<ratio>  Allowed regression before failing
+  --densities=<list>   Sandbox counts for the density benchmarks (default
+                       10,100,1000)
+  --only=<prefix>      Only run benchmarks whose names start with this
+*/
+import XSSandbox from '..';
+import { writeFileSync, readFileSync } from 'fs';
+
+interface BenchResult {
+  name: string;
+  value: number;
+  unit: string;
+  // Whether a lower value is an improvement (e.g. latency) or a higher one
+  // (e.g. throughput)
+  better: 'lower' | 'higher';
+}
+
+interface BenchReport {
+  timestamp: string;
+  node: string;
+  platform: string;
+  results: BenchResult[];
+}
+
+const args = Object.fromEntries(process.argv.slice(2).map(arg => {
+  const [key, value] = arg.replace(/^--/, '').split('=');
+  return [key, value ?? ''];
+}));
+
+const outFile = args.out || 'bench-results.json';
+const tolerance = Number(args.tolerance ?? 0.2);
+const densities = (args.densities || '10,100,1000').split(',').map(Number);
+
+const results: BenchResult[] = [];
+
+function record(name: string, value: number, unit: string, better: 'lower' | 'higher') {
+  results.push({ name, value, unit, better });
+  console.log(`${name.padEnd(48)} ${formatNumber(value).padStart(12)} ${unit}`);
+}
+
+function formatNumber(value: number) {
+  return value >= 100 ? Math.round(value).toString() : value.toPrecision(3);
+}
+
+function selected(name: string) {
+  return !args.only || name.startsWith(args.only);
+}
+
+function now() {
+  return Number(process.hrtime.bigint()) / 1e6;
+}
+
+function median(values: number[]) {
+  const sorted = [...values].sort((a, b) => a - b);
+  return sorted[Math.floor(sorted.length / 2)];
+}
+
+// Median milliseconds per call of `fn` over `iterations` calls, after warming
+// up
+async function timeEach(iterations: number, fn: () => unknown) {
+  for (let i = 0; i < Math.min(iterations, 5); i++) {
+    await fn();
+  }
+  const times: number[] = [];
+  for (let i = 0; i < iterations; i++) {
+    const start = now();
+    await fn();
+    times.push(now() - start);
+  }
+  return median(times);
+}
+
+// Calls per second of `fn`, run in a tight loop for about `durationMs`
+function throughput(durationMs: number, fn: () => unknown) {
+  for (let i = 0; i < 10; i++) {
+    fn();
+  }
+  let count = 0;
+  const start = now();
+  let elapsed = 0;
+  while (elapsed < durationMs) {
+    for (let i = 0; i < 10; i++) {
+      fn();
+    }
+    count += 10;
+    elapsed = now() - start;
+  }
+  return count / elapsed * 1000;
+}
+
+function collectGarbage() {
+  // Only available with --expose-gc, which `npm run bench` passes
+  (globalThis as any).gc?.();
+}
+
+function rss() {
+  collectGarbage();
+  return process.memoryUsage().rss;
+}
+
+async function benchStartup() {
+  await XSSandbox.precompile();
+  if (selected('create')) {
+    record('create (new instance)', await timeEach(20, async () => (await XSSandbox.create()).dispose()), 'ms', 'lower');
+    const instance = await XSSandbox.createInstance();
+    record('create (shared instance)', await timeEach(50, () => instance.create().dispose()), 'ms', 'lower');
+  }
+  if (selected('restore')) {
+    const snapshot = (await XSSandbox.create()).snapshot()!;
+    record('restore (new instance)', await timeEach(20, async () => (await XSSandbox.restore(snapshot)).dispose()), 'ms', 'lower');
+    const instance = await XSSandbox.createInstance();
+    record('restore (shared instance)', await timeEach(50, () => instance.restore(snapshot).dispose()), 'ms', 'lower');
+  }
+}
+
+async function benchEvaluate() {
+  if (!selected('evaluate')) return;
+  const sandbox = await XSSandbox.create();
+  record('evaluate small script', throughput(1000, () => sandbox.evaluate('1 + 1')), 'ops/s', 'higher');
+
+  // About 100 KB of source, mostly function declarations
+  let large = '';
+  for (let i = 0; i < 1000; i++) {
+    large += `function f${i}(a, b) { const c = [a, b, ${i}]; return c.map(x => x * 2).reduce((s, x) => s + x, 0); }\n`;
+  }
+  large += 'f999(1, 2)';
+  record('evaluate large script', throughput(2000, () => sandbox.evaluate(large)), 'ops/s', 'higher');
+  sandbox.dispose();
+}
+
+async function benchMessaging() {
+  if (!selected('sendMessage')) return;
+  const sandbox = await XSSandbox.create();
+  sandbox.evaluate('globalThis.receiveMessage = message => message');
+  for (const size of [16, 1024, 64 * 1024]) {
+    const message = { data: 'x'.repeat(size) };
+    record(`sendMessage round trip (${size} B)`, await timeEach(200, () => sandbox.sendMessage(message)), 'ms', 'lower');
+    const rate = throughput(1000, () => sandbox.sendMessage(message));
+    record(`sendMessage throughput (${size} B)`, rate, 'msg/s', 'higher');
+    record(`sendMessage bandwidth (${size} B)`, rate * size / (1024 * 1024), 'MB/s', 'higher');
+  }
+  sandbox.dispose();
+}
+
+async function benchSnapshot() {
+  if (!selected('snapshot')) return;
+  for (const objects of [0, 10_000, 100_000]) {
+    const sandbox = await XSSandbox.create();
+    sandbox.evaluate(`globalThis.data = Array.from({ length: ${objects} }, (_, i) => ({ i, s: 'item' + i }))`);
+    const heapBytes = sandbox.memoryStats().heapBytes;
+    const snapshot = sandbox.snapshot()!;
+    const label = `${objects} objects`;
+    record(`snapshot heap (${label})`, heapBytes / 1024, 'KB', 'lower');
+    record(`snapshot size (${label})`, snapshot.length / 1024, 'KB', 'lower');
+    record(`snapshot time (${label})`, await timeEach(10, () => sandbox.snapshot()), 'ms', 'lower');
+    const instance = await XSSandbox.createInstance();
+    record(`snapshot restore time (${label})`, await timeEach(10, () => instance.restore(snapshot).dispose()), 'ms', 'lower');
+    sandbox.dispose();
+  }
+}
+
+async function benchDensity() {
+  if (!selected('density')) return;
+  for (const count of densities) {
+    const before = rss();
+    const sandboxes: { dispose(): void }[] = [];
+    for (let i = 0; i < count; i++) {
+      sandboxes.push(await XSSandbox.create());
+    }
+    record(`density RSS per sandbox, own instance (${count})`, (rss() - before) / count / 1024, 'KB', 'lower');
+    sandboxes.forEach(sandbox => sandbox.dispose());
+    sandboxes.length = 0;
+
+    const beforeShared = rss();
+    const instance = await XSSandbox.createInstance();
+    for (let i = 0; i < count; i++) {
+      sandboxes.push(instance.create());
+    }
+    record(`density RSS per sandbox, shared instance (${count})`, (rss() - beforeShared) / count / 1024, 'KB', 'lower');
+    sandboxes.forEach(sandbox => sandbox.dispose());
+  }
+}
+
+// Results in `report` that are worse than in `baseline` by more than the
+// tolerance
+function findRegressions(report: BenchReport, baseline: BenchReport) {
+  const regressions: string[] = [];
+  for (const result of report.results) {
+    const base = baseline.results.find(r => r.name === result.name);
+    if (!base || base.value === 0) continue;
+    const change = (result.value - base.value) / base.value;
+    const worse = result.better === 'lower' ? change : -change;
+    if (worse > tolerance) {
+      regressions.push(`${result.name}: ${formatNumber(base.value)} -> ${formatNumber(result.value)} ${result.unit} (${(worse * 100).toFixed(0)}% worse)`);
+    }
+  }
+  return regressions;
+}
+
+async function main() {
+  if (!(globalThis as any).gc) {
+    console.warn('Run with --expose-gc for stable RSS measurements');
+  }
+  await benchStartup();
+  await benchEvaluate();
+  await benchMessaging();
+  await benchSnapshot();
+  await benchDensity();
+
+  const report: BenchReport = {
+    timestamp: new Date().toISOString(),
+    node: process.version,
+    platform: `${process.platform}-${process.arch}`,
+    results,
+  };
+  writeFileSync(outFile, JSON.stringify(report, null, 2) + '\n');
+  console.log(`Results written to ${outFile}`);
+
+  if (args.baseline) {
+    const baseline: BenchReport = JSON.parse(readFileSync(args.baseline, 'utf8'));
+    const regressions = findRegressions(report, baseline);
+    if (regressions.length) {
+      console.error(`Regressions against ${args.baseline}:`);
+      regressions.forEach(r => console.error(`  ${r}`));
+      process.exitCode = 1;
+    } else {
+      console.log(`No regressions against ${args.baseline}`);
+    }
+  }
+}
+
+main().catch(e => {
+  console.error(e);
+  process.exitCode = 1;
+});
@@ -2,7 +2,11 @@ import typescript from '@rollup/plugin-typescript';
 import terser from '@rollup/plugin-terser';
 import pkg from './package.json' assert { type: "json" };
 
-export default {
+// The worker of an AsyncSandboxPool imports the library itself, from beside it
+// in dist, rather than bundling another copy
+const isLibrary = id => /(^|[\\/])index\.mjs$/.test(id);
+
+export default [{
   input: 'src/index.mts',
   output: [{
     file: pkg.main,
@@ -29,4 +33,19 @@ export default {
     }),
     // terser(),
   ]
-};
\ No newline at end of file
+}, {
+  input: 'src/async-pool-worker.mts',
+  output: {
+    file: 'dist/async-pool-worker.mjs',
+    format: 'es',
+    sourcemap: true,
+    paths: id => isLibrary(id) ? './index.mjs' : id,
+  },
+  external: isLibrary,
+  plugins: [
+    typescript({
+      tsconfig: './tsconfig.json',
+      compilerOptions: { declaration: false },
+    }),
+  ]
+}];
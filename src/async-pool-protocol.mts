@@ -0,0 +1,70 @@
+/*
+What an AsyncSandboxPool and its workers share.
+
+The control block is an Int32Array of a SharedArrayBuffer: a lock for the job
+queue, then a few words per worker (see the WORKER_* offsets). Each worker has
+its own request and response rings. Requests for sandboxes that a worker owns
+go to its request ring, and new or stateless jobs go to the job queue, which
+is shared by all workers and taken from by whichever is free. Requests and
+responses are objects encoded with the binary message codec.
+*/
+import type { XSSandboxOptions } from './index.mjs';
+
+export const CONTROL_JOB_LOCK = 0;
+export const CONTROL_WORKERS = 1;
+export const CONTROL_WORDS_PER_WORKER = 3;
+// Incremented by the host to wake the worker
+export const WORKER_SIGNAL = 0;
+// 1 while the worker is waiting for work, cleared by the host when it wakes
+// the worker to take a job
+export const WORKER_IDLE = 1;
+// Number of jobs the worker has taken from the job queue
+export const WORKER_JOBS_TAKEN = 2;
+
+export function controlIndex(worker: number, word: number) {
+  return CONTROL_WORKERS + worker * CONTROL_WORDS_PER_WORKER + word;
+}
+
+export function controlWords(workerCount: number) {
+  return CONTROL_WORKERS + workerCount * CONTROL_WORDS_PER_WORKER;
+}
+
+/**
+ * Options of sandboxes in an `AsyncSandboxPool`. These must be passed to a
+ * worker, so module registries aren't supported.
+ */
+export type AsyncSandboxOptions = Omit<XSSandboxOptions, 'modules'>;
+
+// Sent with postMessage to start a worker
+export interface WorkerSetup {
+  index: number;
+  control: SharedArrayBuffer;
+  requests: SharedArrayBuffer;
+  responses: SharedArrayBuffer;
+  jobs: SharedArrayBuffer;
+  module: WebAssembly.Module;
+}
+
+export type Request =
+  // Jobs, which any worker can take. The worker that takes a create or restore
+  // owns the new sandbox.
+  | { op: 'create', id: number, sandbox: number, opts?: AsyncSandboxOptions }
+  | { op: 'restore', id: number, sandbox: number, snapshot: Uint8Array, opts?: AsyncSandboxOptions }
+  | { op: 'evaluateOnce', id: number, script: string, snapshot?: Uint8Array, opts?: AsyncSandboxOptions }
+  // Requests for the owner of a sandbox
+  | { op: 'evaluate', id: number, sandbox: number, script: string }
+  | { op: 'sendMessage', id: number, sandbox: number, message: any }
+  | { op: 'sendMessages', id: number, sandbox: number, messages: any[], drainEach: boolean }
+  | { op: 'run', id: number, sandbox: number, bytecode: Uint8Array }
+  | { op: 'snapshot', id: number, sandbox: number, compress: boolean }
+  | { op: 'dispose', id: number, sandbox: number }
+  // The host's reply to a callback
+  | { op: 'callbackResult', id: number, value?: any, error?: Error };
+
+export type Response =
+  | { id: number, value?: any, error?: Error }
+  // The worker took a job from the queue. Sent before it starts the job, so
+  // that the host knows which calls to fail if the worker dies.
+  | { taken: number }
+  // The guest of a sandbox called sendMessage. The worker waits for the reply.
+  | { callback: number, sandbox: number, message: any };
@@ -0,0 +1,196 @@
+/*
+Entry point of the worker threads of an AsyncSandboxPool. A worker blocks until
+there is a request in its own ring or a job in the shared queue, and handles
+them one at a time. The worker's sandboxes share one WASM instance and run
+synchronously. A guest's sendMessage blocks the worker until the host replies,
+but it keeps handling requests and jobs meanwhile.
+*/
+import Sandbox, { XSSandbox, CompiledScript } from './index.mjs';
+import { SharedRing, FrameReader, FrameWriter, RING_READ } from './shared-ring.mjs';
+import { encodeMessage, decodeMessage } from './message-codec.mjs';
+import {
+  Request, Response, WorkerSetup, controlIndex, CONTROL_JOB_LOCK,
+  WORKER_SIGNAL, WORKER_IDLE, WORKER_JOBS_TAKEN,
+} from './async-pool-protocol.mjs';
+
+async function receiveSetup(): Promise<WorkerSetup> {
+  if (typeof process === 'object' && process.versions?.node) {
+    const { parentPort } = await import('worker_threads');
+    return new Promise(resolve => parentPort!.once('message', resolve));
+  }
+  return new Promise(resolve => {
+    self.onmessage = event => resolve(event.data);
+  });
+}
+
+const setup = await receiveSetup();
+const instance = await Sandbox.fromModule(setup.module).createInstance();
+const control = new Int32Array(setup.control);
+const requests = new FrameReader(new SharedRing(setup.requests));
+const responses = new FrameWriter(new SharedRing(setup.responses));
+const jobs = new SharedRing(setup.jobs);
+const signalIndex = controlIndex(setup.index, WORKER_SIGNAL);
+const idleIndex = controlIndex(setup.index, WORKER_IDLE);
+
+const sandboxes = new Map<number, XSSandbox>();
+// Replies to callbacks which arrived while waiting for another
+const callbackResults = new Map<number, Extract<Request, { op: 'callbackResult' }>>();
+let nextCallback = 1;
+
+function respond(response: Response) {
+  const ring = responses.ring;
+  const frame = encodeMessage(response);
+  responses.send(frame);
+  for (;;) {
+    const read = Atomics.load(ring.header, RING_READ);
+    if (responses.flush()) {
+      return;
+    }
+    // Wait for the host to make space
+    Atomics.wait(ring.header, RING_READ, read);
+  }
+}
+
+// Wait until the host signals, either with a request or to take a job
+function waitForSignal() {
+  const signal = Atomics.load(control, signalIndex);
+  Atomics.store(control, idleIndex, 1);
+  // Check again, in case work arrived before the host could see this worker was
+  // idle
+  if (requests.ring.used > 0 || jobs.used > 0) {
+    Atomics.store(control, idleIndex, 0);
+    return;
+  }
+  Atomics.wait(control, signalIndex, signal);
+  Atomics.store(control, idleIndex, 0);
+}
+
+function takeJob(): Uint8Array | undefined {
+  if (jobs.used === 0) {
+    return undefined;
+  }
+  while (Atomics.compareExchange(control, CONTROL_JOB_LOCK, 0, 1) !== 0) {
+    Atomics.wait(control, CONTROL_JOB_LOCK, 1);
+  }
+  try {
+    const job = jobs.readFrame();
+    if (job) {
+      Atomics.add(control, controlIndex(setup.index, WORKER_JOBS_TAKEN), 1);
+    }
+    return job;
+  } finally {
+    Atomics.store(control, CONTROL_JOB_LOCK, 0);
+    Atomics.notify(control, CONTROL_JOB_LOCK, 1);
+  }
+}
+
+function getSandbox(id: number) {
+  const sandbox = sandboxes.get(id);
+  if (!sandbox) {
+    throw new Error(`No sandbox ${id} in this worker`);
+  }
+  return sandbox;
+}
+
+// Forward the guest's messages to the host, and block until it replies.
+// Requests and jobs that arrive meanwhile are handled straight away, since the
+// host may be waiting on them to reply (e.g. a reentrant call to the same
+// sandbox, or a new sandbox when no other worker is free).
+function forwardMessages(sandbox: XSSandbox, id: number) {
+  sandbox.receiveMessage = message => {
+    const callback = nextCallback++;
+    respond({ callback, sandbox: id, message });
+    for (;;) {
+      const result = callbackResults.get(callback);
+      if (result) {
+        callbackResults.delete(callback);
+        if (result.error) {
+          throw result.error;
+        }
+        return result.value;
+      }
+      const frame = requests.next();
+      if (frame) {
+        handle(decodeMessage(frame));
+        continue;
+      }
+      const job = takeJob();
+      if (job) {
+        handleJob(job);
+        continue;
+      }
+      waitForSignal();
+    }
+  };
+}
+
+function perform(request: Exclude<Request, { op: 'callbackResult' }>) {
+  switch (request.op) {
+    case 'create':
+    case 'restore': {
+      const sandbox = request.op === 'restore'
+        ? instance.restore(request.snapshot, request.opts)
+        : instance.create(request.opts);
+      forwardMessages(sandbox, request.sandbox);
+      sandboxes.set(request.sandbox, sandbox);
+      return undefined;
+    }
+    case 'evaluateOnce': {
+      const sandbox = request.snapshot ? instance.restore(request.snapshot, request.opts) : instance.create(request.opts);
+      try {
+        return sandbox.evaluate(request.script);
+      } finally {
+        sandbox.dispose();
+      }
+    }
+  }
+  const sandbox = getSandbox(request.sandbox);
+  switch (request.op) {
+    case 'evaluate': return sandbox.evaluate(request.script);
+    case 'sendMessage': return sandbox.sendMessage(request.message);
+    case 'sendMessages': return sandbox.sendMessages(request.messages, { drain: request.drainEach ? 'each' : 'end' });
+    case 'run': return sandbox.run(CompiledScript.deserialize(request.bytecode));
+    case 'snapshot': return sandbox.snapshot({ compress: request.compress });
+    case 'dispose':
+      sandbox.dispose();
+      sandboxes.delete(request.sandbox);
+      return undefined;
+  }
+}
+
+function handle(request: Request) {
+  if (request.op === 'callbackResult') {
+    callbackResults.set(request.id, request);
+    return;
+  }
+  try {
+    respond({ id: request.id, value: perform(request) });
+  } catch (error) {
+    respond({ id: request.id, error: toError(error) });
+  }
+}
+
+function handleJob(job: Uint8Array) {
+  const request: Request = decodeMessage(job);
+  respond({ taken: request.id });
+  handle(request);
+}
+
+function toError(error: unknown) {
+  return error instanceof Error ? error : new Error(String(error));
+}
+
+// Requests for owned sandboxes first, so that they aren't held up by new work
+for (;;) {
+  const frame = requests.next();
+  if (frame) {
+    handle(decodeMessage(frame));
+    continue;
+  }
+  const job = takeJob();
+  if (job) {
+    handleJob(job);
+    continue;
+  }
+  waitForSignal();
+}
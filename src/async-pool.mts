@@ -0,0 +1,448 @@
+import { precompile, CompiledScript, MessageResult, SendMessagesOptions } from './index.mjs';
+import { encodeMessage, decodeMessage } from './message-codec.mjs';
+import { SharedRing, FrameReader, FrameWriter, RING_WRITE } from './shared-ring.mjs';
+import {
+  AsyncSandboxOptions, Request, Response, WorkerSetup, controlIndex, controlWords,
+  WORKER_SIGNAL, WORKER_IDLE, WORKER_JOBS_TAKEN,
+} from './async-pool-protocol.mjs';
+
+export type { AsyncSandboxOptions };
+
+export interface AsyncSandboxPoolOptions {
+  /**
+   * The number of worker threads. The default is the number of CPUs.
+   */
+  workers?: number;
+
+  /**
+   * The size in bytes of the ring buffers that carry requests and responses
+   * between threads. Larger messages still work, but are passed a piece at a
+   * time. The default is 1 MB.
+   */
+  ringSize?: number;
+}
+
+export interface AsyncSandboxPoolStats {
+  workers: {
+    /** Number of sandboxes owned by the worker */
+    sandboxes: number;
+    /** Number of jobs (creates, restores and `evaluateOnce`) it has taken */
+    jobsTaken: number;
+  }[];
+  /** Number of calls waiting for a response */
+  pending: number;
+}
+
+/** @internal */
+export interface PoolWorker {
+  index: number;
+  thread: { terminate(): unknown };
+  requests: FrameWriter;
+  responses: FrameReader;
+  sandboxes: number;
+  listening: boolean;
+  // Why the worker's thread died, after which it's replaced
+  failure?: Error;
+}
+
+interface PendingCall {
+  resolve: (value: any, worker: PoolWorker) => void;
+  reject: (error: Error) => void;
+  // The worker handling the call, once known
+  worker?: PoolWorker;
+}
+
+/**
+ * A sandbox in a worker thread of an `AsyncSandboxPool`. It has the same
+ * methods as `XSSandbox`, but they return promises.
+ */
+export class AsyncSandbox {
+  /**
+   * Receives the guest's messages, like `XSSandbox.receiveMessage`. The guest
+   * waits for the result, which may be a promise.
+   */
+  receiveMessage?: (message: any) => any;
+
+  /** @internal */
+  constructor(private pool: AsyncSandboxPool, readonly id: number, /** @internal */ readonly worker: PoolWorker) {
+  }
+
+  evaluate(script: string): Promise<any> {
+    return this.pool.call(this.worker, { op: 'evaluate', id: 0, sandbox: this.id, script });
+  }
+
+  sendMessage(message: any): Promise<any> {
+    return this.pool.call(this.worker, { op: 'sendMessage', id: 0, sandbox: this.id, message });
+  }
+
+  sendMessages(messages: any[], opts?: SendMessagesOptions): Promise<MessageResult[]> {
+    return this.pool.call(this.worker, { op: 'sendMessages', id: 0, sandbox: this.id, messages, drainEach: opts?.drain === 'each' });
+  }
+
+  run(script: CompiledScript): Promise<any> {
+    return this.pool.call(this.worker, { op: 'run', id: 0, sandbox: this.id, bytecode: script.bytecode });
+  }
+
+  snapshot(opts?: { compress?: boolean }): Promise<Uint8Array> {
+    return this.pool.call(this.worker, { op: 'snapshot', id: 0, sandbox: this.id, compress: opts?.compress ?? false });
+  }
+
+  async dispose() {
+    await this.pool.call(this.worker, { op: 'dispose', id: 0, sandbox: this.id });
+    this.pool.removeSandbox(this);
+  }
+}
+
+/**
+ * Runs sandboxes on a pool of worker threads, so that they can use every core.
+ *
+ * Each sandbox belongs to the worker that created it, and its calls are queued
+ * to that worker in order. New sandboxes and `evaluateOnce` jobs go to a queue
+ * shared by all workers, and are taken by the first worker to be free. Calls
+ * and results are passed through ring buffers in shared memory rather than with
+ * `postMessage`.
+ *
+ * Requires `SharedArrayBuffer` (in browsers, the page must be cross-origin
+ * isolated).
+ */
+export class AsyncSandboxPool {
+  private pending = new Map<number, PendingCall>();
+  private sandboxes = new Map<number, AsyncSandbox>();
+  // Jobs that didn't fit in the job queue, in order
+  private jobBacklog: Uint8Array[] = [];
+  private nextId = 1;
+  private closed = false;
+
+  private workers: PoolWorker[] = [];
+
+  private constructor(private control: Int32Array, private jobs: SharedRing, private module: WebAssembly.Module, private ringSize: number) {
+  }
+
+  static async create(opts?: AsyncSandboxPoolOptions) {
+    const module = await precompile();
+    const workerCount = opts?.workers ?? await defaultWorkerCount();
+    const ringSize = opts?.ringSize ?? 1024 * 1024;
+    const control = new SharedArrayBuffer(controlWords(workerCount) * 4);
+    const jobs = SharedRing.allocate(ringSize);
+    const pool = new AsyncSandboxPool(new Int32Array(control), jobs, module, ringSize);
+    for (let index = 0; index < workerCount; index++) {
+      await pool.startWorker(index);
+    }
+    return pool;
+  }
+
+  // Start the worker with the given index, or a replacement for it
+  private async startWorker(index: number) {
+    const requests = SharedRing.allocate(this.ringSize);
+    const responses = SharedRing.allocate(this.ringSize);
+    const setup: WorkerSetup = {
+      index,
+      control: this.control.buffer as SharedArrayBuffer,
+      requests: requests.buffer,
+      responses: responses.buffer,
+      jobs: this.jobs.buffer,
+      module: this.module,
+    };
+    const worker: PoolWorker = {
+      index,
+      thread: undefined!,
+      requests: new FrameWriter(requests),
+      responses: new FrameReader(responses),
+      sandboxes: 0,
+      listening: false,
+    };
+    worker.thread = await spawnWorker(setup, error => this.workerFailed(worker, error));
+    if (this.closed) {
+      await worker.thread.terminate();
+      return;
+    }
+    this.workers[index] = worker;
+    // It may have work already, e.g. jobs queued while it was starting
+    if (this.pending.size > 0) {
+      this.listen();
+    }
+  }
+
+  /**
+   * Create a sandbox on the first free worker
+   */
+  create(opts?: AsyncSandboxOptions): Promise<AsyncSandbox> {
+    return this.newSandbox(id => ({ op: 'create', id: 0, sandbox: id, opts }));
+  }
+
+  /**
+   * Restore a snapshot into a new sandbox on the first free worker
+   */
+  restore(snapshot: Uint8Array, opts?: AsyncSandboxOptions): Promise<AsyncSandbox> {
+    return this.newSandbox(id => ({ op: 'restore', id: 0, sandbox: id, snapshot, opts }));
+  }
+
+  /**
+   * Evaluate a script in a new sandbox (or one restored from `opts.snapshot`)
+   * on the first free worker, and dispose the sandbox afterwards. Useful for
+   * stateless work.
+   */
+  evaluateOnce(script: string, opts?: AsyncSandboxOptions & { snapshot?: Uint8Array }): Promise<any> {
+    const { snapshot, ...sandboxOpts } = opts ?? {};
+    return this.call(undefined, { op: 'evaluateOnce', id: 0, script, snapshot, opts: sandboxOpts });
+  }
+
+  get stats(): AsyncSandboxPoolStats {
+    return {
+      workers: this.workers.map(worker => ({
+        sandboxes: worker.sandboxes,
+        jobsTaken: Atomics.load(this.control, controlIndex(worker.index, WORKER_JOBS_TAKEN)),
+      })),
+      pending: this.pending.size,
+    };
+  }
+
+  /**
+   * Terminate the workers. Calls that haven't completed are rejected.
+   */
+  async close() {
+    if (this.closed) {
+      return;
+    }
+    this.fail(new Error('Sandbox pool is closed'));
+    this.closed = true;
+    await Promise.all(this.workers.map(worker => worker.thread.terminate()));
+  }
+
+  private async newSandbox(request: (id: number) => Request): Promise<AsyncSandbox> {
+    const id = this.nextId++;
+    let owner!: PoolWorker;
+    await this.call(undefined, request(id), worker => owner = worker);
+    const sandbox = new AsyncSandbox(this, id, owner);
+    owner.sandboxes++;
+    this.sandboxes.set(id, sandbox);
+    return sandbox;
+  }
+
+  /** @internal */
+  removeSandbox(sandbox: AsyncSandbox) {
+    this.sandboxes.delete(sandbox.id);
+    sandbox.worker.sandboxes--;
+  }
+
+  /**
+   * Send a request to a worker, or to the job queue if `worker` is undefined.
+   * `onWorker` is called with the worker that handled it.
+   * @internal
+   */
+  call(worker: PoolWorker | undefined, request: Request, onWorker?: (worker: PoolWorker) => void): Promise<any> {
+    if (this.closed) {
+      return Promise.reject(new Error('Sandbox pool is closed'));
+    }
+    if (worker?.failure) {
+      return Promise.reject(worker.failure);
+    }
+    const id = this.nextId++;
+    request.id = id;
+    const frame = encodeMessage(request);
+    if (!worker && frame.length + 4 > this.jobs.capacity) {
+      // Too big for the job queue, so give it to the live worker with the
+      // fewest sandboxes instead
+      worker = this.workers.filter(worker => !worker.failure).reduce((a, b) => b.sandboxes < a.sandboxes ? b : a);
+    }
+    const result = new Promise((resolve, reject) => {
+      this.pending.set(id, {
+        resolve: (value, worker) => {
+          onWorker?.(worker);
+          resolve(value);
+        },
+        reject,
+        worker,
+      });
+    });
+    if (worker) {
+      this.send(worker, frame);
+    } else {
+      this.jobBacklog.push(frame);
+      this.flushJobs();
+    }
+    this.listen();
+    return result;
+  }
+
+  private send(worker: PoolWorker, frame: Uint8Array) {
+    if (worker.failure) {
+      return;
+    }
+    worker.requests.send(frame);
+    this.signal(worker);
+  }
+
+  private signal(worker: PoolWorker) {
+    const index = controlIndex(worker.index, WORKER_SIGNAL);
+    Atomics.add(this.control, index, 1);
+    Atomics.notify(this.control, index);
+  }
+
+  private flushJobs() {
+    while (this.jobBacklog.length && this.jobs.writeFrame(this.jobBacklog[0])) {
+      this.jobBacklog.shift();
+      // Wake a worker that is waiting for work, if there is one. Otherwise the
+      // job is taken by the first worker to finish what it's doing.
+      const idle = this.workers.find(worker =>
+        Atomics.compareExchange(this.control, controlIndex(worker.index, WORKER_IDLE), 1, 0) === 1);
+      if (idle) {
+        this.signal(idle);
+      }
+    }
+  }
+
+  // Write what is left of requests that didn't fit in the rings
+  private flushWrites() {
+    for (const worker of this.workers) {
+      if (!worker.requests.idle && !worker.failure) {
+        worker.requests.flush();
+        this.signal(worker);
+      }
+    }
+    this.flushJobs();
+  }
+
+  private get hasBacklog() {
+    return this.jobBacklog.length > 0 || this.workers.some(worker => !worker.requests.idle && !worker.failure);
+  }
+
+  // Responses can come from any worker (whichever takes a job), so listen to
+  // all of them while any call is pending
+  private listen() {
+    for (const worker of this.workers) {
+      if (!worker.listening && !worker.failure) {
+        this.listenTo(worker);
+      }
+    }
+  }
+
+  private async listenTo(worker: PoolWorker) {
+    worker.listening = true;
+    const header = worker.responses.ring.header;
+    try {
+      while (!this.closed && !worker.failure && this.pending.size > 0) {
+        const seen = Atomics.load(header, RING_WRITE);
+        this.receive(worker);
+        this.flushWrites();
+        if (this.closed || this.pending.size === 0) {
+          break;
+        }
+        // Poll while requests are waiting for space in a ring, since space
+        // is made by the workers reading, which doesn't notify this thread
+        await waitForChange(header, RING_WRITE, seen, this.hasBacklog ? 1 : Infinity);
+      }
+    } finally {
+      worker.listening = false;
+    }
+  }
+
+  private receive(worker: PoolWorker) {
+    for (let frame = worker.responses.next(); frame; frame = worker.responses.next()) {
+      const response: Response = decodeMessage(frame);
+      if ('callback' in response) {
+        this.replyToCallback(worker, response);
+        continue;
+      }
+      if ('taken' in response) {
+        const call = this.pending.get(response.taken);
+        if (call) {
+          call.worker = worker;
+        }
+        continue;
+      }
+      const call = this.pending.get(response.id);
+      this.pending.delete(response.id);
+      if (response.error) {
+        call?.reject(response.error);
+      } else {
+        call?.resolve(response.value, worker);
+      }
+    }
+  }
+
+  private async replyToCallback(worker: PoolWorker, { callback, sandbox, message }: Extract<Response, { callback: number }>) {
+    let reply: Request;
+    try {
+      const value = await this.sandboxes.get(sandbox)?.receiveMessage?.(message);
+      reply = { op: 'callbackResult', id: callback, value };
+    } catch (e) {
+      reply = { op: 'callbackResult', id: callback, error: e instanceof Error ? e : new Error(String(e)) };
+    }
+    if (!this.closed) {
+      this.send(worker, encodeMessage(reply));
+    }
+  }
+
+  // Reject the calls of a worker whose thread died, forget its sandboxes, and
+  // start another worker in its place. Jobs it hadn't taken are left for the
+  // others.
+  private workerFailed(worker: PoolWorker, error: Error) {
+    if (this.closed || worker.failure) {
+      return;
+    }
+    worker.failure = error;
+    Atomics.store(this.control, controlIndex(worker.index, WORKER_IDLE), 0);
+    // Responses it wrote before it died, including which jobs it took
+    this.receive(worker);
+    for (const [id, call] of this.pending) {
+      if (call.worker === worker) {
+        this.pending.delete(id);
+        call.reject(error);
+      }
+    }
+    for (const sandbox of this.sandboxes.values()) {
+      if (sandbox.worker === worker) {
+        this.sandboxes.delete(sandbox.id);
+      }
+    }
+    Atomics.notify(worker.responses.ring.header, RING_WRITE);
+    this.startWorker(worker.index).catch(error => this.fail(error));
+  }
+
+  // Reject all pending calls, e.g. if a worker fails
+  private fail(error: Error) {
+    const pending = [...this.pending.values()];
+    this.pending.clear();
+    for (const call of pending) {
+      call.reject(error);
+    }
+    // Wake the listeners so they can stop
+    for (const worker of this.workers) {
+      Atomics.notify(worker.responses.ring.header, RING_WRITE);
+    }
+  }
+}
+
+async function defaultWorkerCount(): Promise<number> {
+  if (typeof process === 'object' && process.versions?.node) {
+    const os = await import('os');
+    return os.cpus().length;
+  }
+  return navigator.hardwareConcurrency || 4;
+}
+
+async function spawnWorker(setup: WorkerSetup, onError: (error: Error) => void) {
+  const url = new URL('./async-pool-worker.mjs', import.meta.url);
+  if (typeof process === 'object' && process.versions?.node) {
+    const { Worker } = await import('worker_threads');
+    const worker = new Worker(url);
+    worker.on('error', onError);
+    worker.postMessage(setup);
+    return worker;
+  }
+  const worker = new Worker(url, { type: 'module' });
+  worker.onerror = event => onError(new Error(event.message));
+  worker.postMessage(setup);
+  return worker;
+}
+
+function waitForChange(array: Int32Array, index: number, value: number, timeout: number): Promise<unknown> {
+  const waitAsync = (Atomics as any).waitAsync;
+  if (waitAsync) {
+    const result = waitAsync(array, index, value, timeout);
+    return result.async ? result.value : Promise.resolve();
+  }
+  // Without Atomics.waitAsync (e.g. older Firefox), poll
+  return new Promise(resolve => setTimeout(resolve, 1));
+}
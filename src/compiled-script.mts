@@ -0,0 +1,115 @@
+/**
+ * A script compiled to XS bytecode by `sandbox.compile`. It can be run any
+ * number of times, in any sandbox, with `sandbox.run`, without being parsed
+ * again.
+ */
+export class CompiledScript {
+  /** @internal */
+  constructor(readonly bytecode: Uint8Array) {
+  }
+
+  /**
+   * The bytecode of the script, e.g. to store it or send it to another thread.
+   * Load it with `CompiledScript.deserialize`. Bytecode can only be run by the
+   * same version of this library that compiled it.
+   */
+  serialize(): Uint8Array {
+    return this.bytecode.slice();
+  }
+
+  static deserialize(bytes: Uint8Array) {
+    return new CompiledScript(bytes.slice());
+  }
+}
+
+export interface CompileOptions {
+  /**
+   * The file name reported in stack traces. Scripts compiled with a file name
+   * also carry line numbers.
+   */
+  filename?: string;
+
+  /**
+   * Compile the source as a module rather than a script. Compiled modules can
+   * be put in a `ModuleRegistry`. The default is false.
+   */
+  module?: boolean;
+
+  /**
+   * Whether to look up and store the script in the script cache. The default
+   * is true.
+   */
+  cache?: boolean;
+}
+
+export interface ScriptCacheStats {
+  /** Number of `compile` calls served from the cache */
+  hits: number;
+  /** Number of `compile` calls that had to compile */
+  misses: number;
+  /** Number of scripts currently in the cache */
+  size: number;
+}
+
+// The least recently used scripts are evicted beyond this
+const MAX_CACHED_SCRIPTS = 256;
+
+/**
+ * Cache of compiled scripts, keyed by source, file name and kind. Bytecode
+ * doesn't depend on the sandbox or instance that compiled it, so there is one
+ * cache shared by all of them.
+ */
+class ScriptCache {
+  // Map iteration order is insertion order, so the first entry is the least
+  // recently used
+  private scripts = new Map<string, CompiledScript>();
+  private hits = 0;
+  private misses = 0;
+
+  get(source: string, opts: CompileOptions) {
+    const key = cacheKey(source, opts);
+    const script = this.scripts.get(key);
+    if (script) {
+      this.hits++;
+      this.scripts.delete(key);
+      this.scripts.set(key, script);
+    } else {
+      this.misses++;
+    }
+    return script;
+  }
+
+  set(source: string, opts: CompileOptions, script: CompiledScript) {
+    this.scripts.set(cacheKey(source, opts), script);
+    if (this.scripts.size > MAX_CACHED_SCRIPTS) {
+      this.scripts.delete(this.scripts.keys().next().value!);
+    }
+  }
+
+  get stats(): ScriptCacheStats {
+    return { hits: this.hits, misses: this.misses, size: this.scripts.size };
+  }
+
+  clear() {
+    this.scripts.clear();
+    this.hits = 0;
+    this.misses = 0;
+  }
+}
+
+function cacheKey(source: string, opts: CompileOptions) {
+  return (opts.module ? 'module:' : 'script:') + (opts.filename ?? '') + '\0' + source;
+}
+
+export const scriptCache = new ScriptCache();
+
+export function scriptCacheStats(): ScriptCacheStats {
+  return scriptCache.stats;
+}
+
+/**
+ * Empty the script cache and reset its stats
+ */
+export function clearScriptCache() {
+  scriptCache.clear();
+}
@@ -1,9 +1,61 @@
 import wasmWrapper from './wasm-wrapper.mjs';
+import { SandboxPool, SandboxPoolOptions } from './sandbox-pool.mjs';
+import { AsyncSandboxPool, AsyncSandbox, AsyncSandboxPoolOptions } from './async-pool.mjs';
+import { encodeMessage, decodeMessage } from './message-codec.mjs';
+import { CompiledScript, CompileOptions, scriptCache, scriptCacheStats, clearScriptCache } from './compiled-script.mjs';
+import { ModuleRegistry } from './module-registry.mjs';
+import { MachineSizing, MachineSizingPreset, machineSizingPresets, encodeMachineSizing } from './machine-sizing.mjs';
+import { Profile, ProfilingOptions } from './profiler.mjs';
+import { CallTiming, StatsCollector, SandboxStats, newCallTiming, enginePhases } from './stats.mjs';
+import { SourceReader, SourceChunk } from './source-stream.mjs';
+import { MemoryImage, isMemoryImage, encodeMemoryImage, decodeMemoryImage } from './memory-image.mjs';
+import { JournalReader, JournalRecord, RECORD_BATCH, RECORD_REPLY, encodeInputRecord, encodeBatchRecord, encodeReplyRecord } from './journal.mjs';
+
+export { SandboxPool, AsyncSandboxPool, AsyncSandbox, CompiledScript, scriptCacheStats, clearScriptCache, ModuleRegistry, machineSizingPresets };
+export type { MachineSizing, MachineSizingPreset } from './machine-sizing.mjs';
+export { Profile };
+export type { ProfilingOptions, ProfileFrame, ProfileSample, CpuProfile, CpuProfileNode } from './profiler.mjs';
+export type { CallPhase, CallTiming, TimeStats, SandboxStats } from './stats.mjs';
+export type { CompileOptions, ScriptCacheStats } from './compiled-script.mjs';
+export type { ModuleSource, ModuleRegistryStats } from './module-registry.mjs';
+export type { SourceChunk } from './source-stream.mjs';
+export type { SandboxPoolOptions, SandboxPoolRefillPolicy, SandboxPoolStats } from './sandbox-pool.mjs';
+export type { AsyncSandboxPoolOptions, AsyncSandboxPoolStats, AsyncSandboxOptions } from './async-pool.mjs';
 
 const EC_OK_VALUE = 0; // Ok with return value
 const EC_OK_UNDEFINED = 1; // Ok with return undefined
 const EC_EXCEPTION = 2; // Returned exception message (string)
 const EC_METERING_LIMIT_REACHED = 3; // Hit metering limit
+const EC_MEMORY_LIMIT_REACHED = 4; // Hit memory limit
+const EC_SUSPENDED = 5; // Stopped at the end of a time slice with promise jobs left
+const EC_INTERRUPTED = 6; // Suspended partway through guest code until resumed
+
+// Number of values written by getMemoryStats
+const MEMORY_STATS_COUNT = 9;
+// Number of values written by getCallStats
+const CALL_STATS_COUNT = 7;
+
+const MESSAGE_FORMAT_JSON = 0;
+const MESSAGE_FORMAT_BINARY = 1;
+
+// Results of loadModule
+const MODULE_NOT_FOUND = 0;
+const MODULE_SOURCE = 1;
+const MODULE_BYTECODE = 2;
+const MODULE_ERROR = 3;
+
+const textEncoder = new TextEncoder();
+const textDecoder = new TextDecoder();
+
+/**
+ * How values are encoded when they cross between the host and the guest.
+ *
+ * - `'json'`: passed through `JSON.stringify` and `JSON.parse`.
+ * - `'binary'`: a compact binary encoding, which is faster than JSON and also
+ *   supports `undefined`, `BigInt`, `Date`, `Map`, `Set`, `ArrayBuffer`, typed
+ *   arrays, `Error`, and shared or cyclic references.
+ */
+export type MessageFormat = 'json' | 'binary';
 
 export interface XSSandboxOptions {
   /**
@@ -17,6 +69,232 @@ export interface XSSandboxOptions {
    * sandbox will halt. The default is none.
    */
   meteringLimit?: number;
+
+  /**
+   * Enables time slicing: once the metering counter passes this value during a
+   * call, the guest's remaining promise jobs are left queued until `resume` is
+   * called. With a build that can interrupt calls (see
+   * `XSSandboxInstance.canInterrupt`), the sandbox is instead suspended where
+   * it is, even partway through synchronous guest code, and the call returns
+   * until `resume` is called. See `XSSandbox.resume`. The default is none.
+   */
+  timeSlice?: number;
+
+  /**
+   * The most memory (in bytes) that the sandbox's heap can use. Once this is
+   * reached, the sandbox halts. The default is 256 MB.
+   */
+  memoryLimit?: number;
+
+  /**
+   * The encoding of messages and `evaluate` results. The default is `'json'`.
+   */
+  messageFormat?: MessageFormat;
+
+  /**
+   * The modules that the guest can import. See `ModuleRegistry`. The default
+   * is none.
+   */
+  modules?: ModuleRegistry;
+
+  /**
+   * The memory sizing of the sandbox's machine: a preset name (see
+   * `MachineSizingPreset`), or individual values, where any that are missing
+   * come from the `'default'` preset. The default is `'default'`.
+   *
+   * This only applies to `create`. A restored sandbox keeps the sizing of the
+   * sandbox that its snapshot was taken from.
+   */
+  sizing?: MachineSizingPreset | Partial<MachineSizing>;
+
+  /**
+   * Make the guest deterministic, so that a journal of its inputs can rebuild
+   * its state (see `XSSandbox.journal`). `Math.random` is replaced with a
+   * generator seeded by `randomSeed`, and `Date` gives the time at which the
+   * host made the current call into the sandbox, which is recorded in the
+   * journal. The default is false.
+   *
+   * With `create`, this installs the replacements in the new sandbox. With
+   * `restore`, the snapshot must be of a deterministic sandbox.
+   */
+  deterministic?: boolean;
+
+  /**
+   * The seed of `Math.random` in a deterministic sandbox. The default is 0.
+   */
+  randomSeed?: number;
+}
+
+/**
+ * Destination for a streamed snapshot: a function which is called with each
+ * chunk as it's produced, and must be done with it before returning (e.g. with
+ * `fs.writeSync`). The snapshot is produced synchronously, so a sink that only
+ * queues the chunks, like a Node `Writable`, would hold the whole snapshot in
+ * memory anyway.
+ *
+ * Chunks are views into the sandbox memory which are only valid until the
+ * function returns, so copy them if you need to keep them.
+ */
+export type SnapshotSink = (chunk: Uint8Array) => void;
+
+export interface SnapshotOptions {
+  /**
+   * If provided, the snapshot is encoded as a delta against this earlier
+   * snapshot, which is typically much smaller than a full snapshot when most of
+   * the heap is unchanged. The same base must be passed to `restore`.
+   */
+  base?: Uint8Array;
+
+  /**
+   * Compress the snapshot. Compressed snapshots are detected automatically by
+   * `restore`. The default is false.
+   */
+  compress?: boolean;
+
+  /**
+   * If provided, the snapshot is written to the sink chunk-by-chunk as it is
+   * produced, rather than being returned as a single buffer.
+   */
+  sink?: SnapshotSink;
+
+  /**
+   * The maximum chunk size when writing to a sink. The default is 64kB.
+   */
+  chunkSize?: number;
+}
+
+export interface RestoreOptions extends XSSandboxOptions {
+  /**
+   * The base snapshot, if the snapshot being restored is a delta
+   */
+  base?: Uint8Array;
+
+  /**
+   * A portable snapshot of the same state, restored instead if the snapshot is
+   * a memory image that can't be loaded here (see `XSSandbox.memoryImage`)
+   */
+  fallback?: Uint8Array;
+}
+
+export interface SendMessagesOptions {
+  /**
+   * When to run promise jobs queued by the guest: once after the last message
+   * (`'end'`), or after each message (`'each'`). The default is `'end'`.
+   */
+  drain?: 'end' | 'each';
+}
+
+export interface EvaluateStreamOptions {
+  /**
+   * The file name reported in stack traces. Scripts with a file name also
+   * carry line numbers.
+   */
+  filename?: string;
+
+  /**
+   * The size in bytes of the parser's buffer, which limits the size of the
+   * largest string literal or template in the source. The default is the
+   * sandbox's `parserBufferSize` (see `MachineSizing`). It doesn't limit the
+   * size of the source as a whole.
+   */
+  parserBufferSize?: number;
+}
+
+/**
+ * The outcome of one message sent with `sendMessages`
+ */
+export type MessageResult =
+  | { status: 'fulfilled', value: any }
+  | { status: 'rejected', reason: XSSandboxError };
+
+/**
+ * Memory used by a sandbox. See `XSSandbox.memoryStats`.
+ */
+export interface MemoryStats {
+  /** Number of slots (16 bytes each) holding live or not yet collected values */
+  slotsInUse: number;
+  /** Number of slots allocated */
+  slotsAllocated: number;
+  /** Bytes of chunks (strings, arrays, bytecode, etc.) in use */
+  chunkBytesInUse: number;
+  /** Bytes of chunks allocated */
+  chunkBytesAllocated: number;
+  /** Number of keys (property names and symbols) in use */
+  keys: number;
+  /**
+   * Number of garbage collections. Only available if the engine is built with
+   * instrumentation (mxInstrument).
+   */
+  gcCount?: number;
+  /** Bytes allocated for the heap, which is what `memoryLimit` applies to */
+  heapBytes: number;
+  /**
+   * Bytes reserved by the sandbox's arena, from which the heap is allocated.
+   * The difference from `heapBytes` is free space between heap blocks.
+   */
+  arenaBytes: number;
+  /** The most bytes the arena has reserved at once */
+  arenaPeakBytes: number;
+  /**
+   * Bytes of WASM linear memory. This is shared by all the sandboxes in the
+   * same instance.
+   */
+  wasmMemoryBytes: number;
+}
+
+/**
+ * The kinds of value in a heap summary:
+ *
+ * - `objects`: ordinary objects, and any not covered by another kind
+ * - `functions`: function objects, including their bytecode
+ * - `closures`: the environments holding variables captured by functions
+ * - `arrays`: arrays, including their items
+ * - `strings`: string values, wherever they are (a string referred to from
+ *   several places is counted once)
+ * - `asyncFrames`: generators and async functions, including the stack saved
+ *   while they're suspended
+ * - `promises`: promise objects
+ * - `keys`: property names and symbols
+ * - `other`: engine bookkeeping, such as the entries of maps and sets
+ */
+export type HeapKind = 'objects' | 'functions' | 'closures' | 'arrays' | 'strings' | 'asyncFrames' | 'promises' | 'keys' | 'other';
+
+/**
+ * What a sandbox's heap is made of. See `XSSandbox.heapSummary`.
+ */
+export interface HeapSummary {
+  /**
+   * The number of values of each kind, and their bytes. An object's bytes are
+   * its slots and what they own (item storage, bytecode, saved stacks), except
+   * strings, which are counted as strings.
+   */
+  kinds: Record<HeapKind, { count: number, bytes: number }>;
+  /** The largest objects, largest first */
+  largest: HeapObject[];
+}
+
+export interface HeapObject {
+  kind: HeapKind;
+  bytes: number;
+  /**
+   * Number of properties, array items and captured variables that refer to
+   * the object. References from the engine's internals (e.g. the stack) aren't
+   * counted.
+   */
+  retainerCount: number;
+  /** The first few of those retainers */
+  retainers: HeapRetainer[];
+}
+
+/**
+ * A reference to an object: a property (`key`), an array item (`index`), or a
+ * captured variable (`key`, with `kind: 'closures'`). Neither is present for
+ * an internal property of the retaining object.
+ */
+export interface HeapRetainer {
+  kind: HeapKind;
+  key?: string;
+  index?: number;
 }
 
 export class XSSandboxError extends Error {
@@ -25,122 +303,899 @@ export class XSSandboxError extends Error {
   }
 }
 
+// The compiled engine, shared by every instance created with the default module
+let compiledModule: Promise<WebAssembly.Module> | undefined;
+
 export async function create(opts?: XSSandboxOptions) {
-  const [wasm, sandbox] = await createWasmSandbox(opts ?? {});
-  wasm.ccall('initMachine', null, [], []);
+  const instance = await createInstance();
+  return instance.create(opts);
+}
+
+export async function restore(snapshot: Uint8Array, opts?: RestoreOptions) {
+  const instance = await createInstance();
+  return instance.restore(snapshot, opts);
+}
+
+/**
+ * Restore a snapshot of a deterministic sandbox, and bring it up to date by
+ * replaying a journal recorded since the snapshot was taken. See
+ * `XSSandbox.journal`.
+ */
+export async function replay(snapshot: Uint8Array, journal: Uint8Array | Iterable<Uint8Array>, opts?: RestoreOptions) {
+  const sandbox = await restore(snapshot, { ...opts, deterministic: true });
+  sandbox.replay(journal);
   return sandbox;
 }
 
-export async function restore(snapshot: Uint8Array, opts?: XSSandboxOptions) {
-  const [wasm, sandbox] = await createWasmSandbox(opts ?? {});
+/**
+ * Summarize the heap of a snapshot (or memory image), without keeping a
+ * sandbox for it. The snapshot is restored into a scratch instance, so this
+ * takes as long as `restore`.
+ */
+export async function analyzeSnapshot(snapshot: Uint8Array, opts?: RestoreOptions): Promise<HeapSummary> {
+  const sandbox = await restore(snapshot, opts);
+  try {
+    return sandbox.heapSummary();
+  } finally {
+    sandbox.dispose();
+  }
+}
+
+/**
+ * Fetch and compile the WASM engine, if it isn't already compiled. The result
+ * is cached, so this only does any work the first time it's called.
+ *
+ * Calling this is optional (`create` and `restore` do it implicitly) but it
+ * lets you move the compile cost out of the latency of the first sandbox.
+ */
+export function precompile(): Promise<WebAssembly.Module> {
+  if (!compiledModule) {
+    compiledModule = compileEngine();
+    // Don't cache failures, so that a later call can retry
+    compiledModule.catch(() => compiledModule = undefined);
+  }
+  return compiledModule;
+}
+
+/**
+ * Use an already-compiled engine. This is useful where the module was compiled
+ * elsewhere, e.g. received from another thread with `postMessage`.
+ */
+export function fromModule(module: WebAssembly.Module) {
+  return {
+    create: async (opts?: XSSandboxOptions) => (await createInstance(module)).create(opts),
+    restore: async (snapshot: Uint8Array, opts?: RestoreOptions) => (await createInstance(module)).restore(snapshot, opts),
+    createInstance: () => createInstance(module),
+  };
+}
+
+async function compileEngine(): Promise<WebAssembly.Module> {
+  const url = new URL('./wasm-wrapper.wasm', import.meta.url);
+  if (typeof process === 'object' && process.versions?.node) {
+    const { readFile } = await import('fs/promises');
+    const { fileURLToPath } = await import('url');
+    return WebAssembly.compile(await readFile(fileURLToPath(url)));
+  } else {
+    return WebAssembly.compileStreaming(fetch(url));
+  }
+}
+
+/**
+ * Create a new WASM instance which can host any number of sandboxes.
+ *
+ * `Sandbox.create()` and `Sandbox.restore()` each use a fresh instance, which
+ * is simplest but costs a few MB per sandbox. Use this if you want to pack many
+ * sandboxes into the same instance.
+ *
+ * @param module The compiled engine to instantiate. Defaults to the cached
+ * result of `precompile()`.
+ */
+export async function createInstance(module?: WebAssembly.Module): Promise<XSSandboxInstance> {
+  module ??= await precompile();
+  // Emscripten isn't told if instantiating fails, so its promise would never
+  // settle
+  let instantiateFailed!: (error: unknown) => void;
+  const instantiation = new Promise<never>((_, reject) => instantiateFailed = reject);
+  const wasm = await Promise.race([instantiation, wasmWrapper({
+    // Instantiate the already-compiled module rather than letting Emscripten
+    // fetch and compile it again
+    instantiateWasm: (imports: WebAssembly.Imports, receiveInstance: (instance: WebAssembly.Instance, module: WebAssembly.Module) => void) => {
+      WebAssembly.instantiate(module!, imports)
+        .then(instance => receiveInstance(instance, module!))
+        .catch(instantiateFailed);
+      return {};
+    },
+    sendMessage: (handle: number, ptr: number, len: number, outputPtrPtr: number, outputSizePtr: number) => {
+      wasm.HEAPU32[outputPtrPtr / 4] = 0;
+      wasm.HEAPU32[outputSizePtr / 4] = 0;
+      let reply: HostReply;
+      try {
+        const sandbox = instance.sandbox(handle);
+        reply = sandbox.hostReply(() => {
+          const binary = sandbox.messageFormat === 'binary';
+          const bytes = new Uint8Array(wasm.HEAPU8.buffer, ptr, len);
+          const message = binary ? decodeMessage(bytes) : JSON.parse(textDecoder.decode(bytes));
+
+          const result = sandbox.receiveMessage?.(message);
+
+          return result === undefined
+            ? [EC_OK_UNDEFINED]
+            : [EC_OK_VALUE, binary ? encodeMessage(result) : JSON.stringify(result ?? null)];
+        });
+      } catch (e) {
+        reply = errorReply(e);
+      }
+      return writeHostReply(wasm, handle, reply, outputPtrPtr, outputSizePtr);
+    },
+    sendMessageAsync: (handle: number, id: number, ptr: number, len: number, outputPtrPtr: number, outputSizePtr: number) => {
+      wasm.HEAPU32[outputPtrPtr / 4] = 0;
+      wasm.HEAPU32[outputSizePtr / 4] = 0;
+      let reply: HostReply;
+      try {
+        const sandbox = instance.sandbox(handle);
+        // An error rejects the guest's promise
+        reply = sandbox.hostReply(() => {
+          const bytes = new Uint8Array(wasm.HEAPU8.buffer, ptr, len);
+          const message = sandbox.messageFormat === 'binary' ? decodeMessage(bytes) : JSON.parse(textDecoder.decode(bytes));
+          if (!sandbox.receiveMessageAsync) {
+            throw new Error('Host does not accept asynchronous messages');
+          }
+          sandbox.receiveMessageAsync(message, id);
+          return [EC_OK_UNDEFINED];
+        });
+      } catch (e) {
+        reply = errorReply(e);
+      }
+      return writeHostReply(wasm, handle, reply, outputPtrPtr, outputSizePtr);
+    },
+    snapshotOutput: (handle: number, ptr: number, len: number) => {
+      const chunk = new Uint8Array(wasm.HEAPU8.buffer, ptr, len);
+      return instance.sandbox(handle).writeSnapshotChunk(chunk) ? 0 : 1;
+    },
+    readSource: (handle: number, ptr: number, len: number) => {
+      return instance.sandbox(handle).readSourceChunk(new Uint8Array(wasm.HEAPU8.buffer, ptr, len));
+    },
+    loadModule: (handle: number, idPtr: number, idLength: number, outputPtrPtr: number, outputSizePtr: number) => {
+      wasm.HEAPU32[outputPtrPtr / 4] = 0;
+      wasm.HEAPU32[outputSizePtr / 4] = 0;
+      const sandbox = instance.sandbox(handle);
+      // Exceptions can't be thrown through the machine here, so the message of
+      // an error from the registry is passed back for the import to throw
+      const [code, reply] = sandbox.hostReply(() => {
+        const id = textDecoder.decode(new Uint8Array(wasm.HEAPU8.buffer, idPtr, idLength));
+        const module = sandbox.modules?.load(id);
+        if (module === undefined) {
+          return [MODULE_NOT_FOUND];
+        }
+        return typeof module === 'string'
+          ? [MODULE_SOURCE, textEncoder.encode(module)]
+          : [MODULE_BYTECODE, module.bytecode];
+      }, e => [MODULE_ERROR, errorMessage(e)]);
+      if (reply !== undefined) {
+        const bytes = typeof reply === 'string' ? textEncoder.encode(reply) : reply;
+        try {
+          wasm.HEAPU32[outputPtrPtr / 4] = copyToWasm(wasm, bytes);
+        } catch {
+          // With no buffer, the import fails with "out of memory"
+          return MODULE_ERROR;
+        }
+        wasm.HEAPU32[outputSizePtr / 4] = bytes.length;
+      }
+      return code;
+    },
+    moduleCompiled: (handle: number, idPtr: number, idLength: number, ptr: number, len: number) => {
+      const id = textDecoder.decode(new Uint8Array(wasm.HEAPU8.buffer, idPtr, idLength));
+      const bytecode = wasm.HEAPU8.slice(ptr, ptr + len);
+      instance.sandbox(handle).modules?.compiled(id, new CompiledScript(bytecode));
+    },
+    hostNow: () => performance.now(),
+    suspendGuest: (handle: number, wakeUp: () => void) => {
+      instance.sandbox(handle).interrupted(wakeUp);
+    },
+    consoleLog: (handle: number, argsPtr: number, argsSize: number, level: number) => {
+      // The output was already seen when the journal was recorded
+      if (instance.sandbox(handle).replaying) {
+        return;
+      }
+      const bytes = new Uint8Array(wasm.HEAPU8.buffer, argsPtr, argsSize);
+      const str = textDecoder.decode(bytes);
+      const args = JSON.parse(str);
+      switch (level) {
+        case 0: console.log(...args); break;
+        case 1: console.warn(...args); break;
+        case 2: console.error(...args); break;
+      }
+    }
+  })]);
+  const instance = new XSSandboxInstance(wasm, module);
+  return instance;
+}
+
+/**
+ * A WASM instance hosting one or more sandboxes. Sandboxes in the same instance
+ * share its linear memory and runtime but each has its own XS machine, so they
+ * are isolated from each other at the JavaScript level. Note that they do share
+ * fate at the WASM level: if the instance traps or runs out of memory, all of
+ * its sandboxes are affected.
+ */
+export class XSSandboxInstance {
+  private sandboxes = new Map<number, XSSandbox>();
+
+  /** @internal */
+  constructor(readonly wasm: any, private module: WebAssembly.Module) {
+  }
+
+  /**
+   * Create a new sandbox in this instance
+   */
+  create(opts?: XSSandboxOptions) {
+    const sizingPtr = opts?.sizing ? copyToWasm(this.wasm, encodeMachineSizing(opts.sizing)) : 0;
+    let handle: number;
+    try {
+      handle = this.wasm.ccall('initMachine', 'number', ['number'], [sizingPtr]);
+    } finally {
+      this.wasm._free(sizingPtr);
+    }
+    if (handle < 0) {
+      throw new Error('Error creating machine');
+    }
+    const sandbox = this.attach(handle, opts ?? {});
+    if (opts?.deterministic) {
+      this.wasm.ccall('installClock', null, ['number'], [handle]);
+      // Without the time slice, so that the prelude runs to the end
+      sandbox.timeSlice = undefined;
+      sandbox.evaluate(deterministicPrelude(opts.randomSeed ?? 0));
+      sandbox.timeSlice = opts.timeSlice;
+    }
+    return sandbox;
+  }
+
+  /**
+   * Restore a snapshot into a new sandbox in this instance. The snapshot can
+   * also be a memory image, if this instance has no sandboxes and is running
+   * the same build of the engine, or else `opts.fallback` is restored instead.
+   */
+  restore(snapshot: Uint8Array, opts?: RestoreOptions): XSSandbox {
+    if (isMemoryImage(snapshot)) {
+      const image = decodeMemoryImage(snapshot);
+      const sameBuild = image.buildHash === this.buildHash;
+      if (sameBuild && this.sandboxes.size === 0) {
+        return this.load(image, opts ?? {});
+      }
+      if (!opts?.fallback) {
+        throw new Error(sameBuild
+          ? 'A memory image can only be restored into an instance with no sandboxes'
+          : 'Memory image is from a different build of the engine');
+      }
+      snapshot = opts.fallback;
+    }
+    // The limit applies while the snapshot is read, as well as after
+    const memoryLimit = checkMemoryLimit(opts?.memoryLimit) ?? 0;
+    const snapshotPtr = copyToWasm(this.wasm, snapshot);
+    let basePtr = 0;
+    let handle: number;
+    try {
+      basePtr = opts?.base ? copyToWasm(this.wasm, opts.base) : 0;
+      handle = this.wasm.ccall('restoreSnapshot', 'number', ['number', 'number', 'number', 'number', 'number'], [snapshotPtr, snapshot.length, basePtr, opts?.base?.length ?? 0, memoryLimit]);
+    } finally {
+      this.wasm._free(snapshotPtr);
+      this.wasm._free(basePtr);
+    }
+    if (handle < 0) {
+      throw new Error('Error restoring snapshot');
+    }
+    return this.attach(handle, opts ?? {});
+  }
+
+  /**
+   * The number of live sandboxes in this instance
+   */
+  get sandboxCount() {
+    return this.sandboxes.size;
+  }
+
+  /** @internal */
+  sandbox(handle: number) {
+    const sandbox = this.sandboxes.get(handle);
+    if (!sandbox) {
+      throw new Error(`No sandbox with handle ${handle}`);
+    }
+    return sandbox;
+  }
+
+  /**
+   * Whether this build of the engine can suspend a call partway through guest
+   * code at the end of a time slice (see `timeSlice`). Only the build made with
+   * `make ASYNCIFY=1` can.
+   */
+  get canInterrupt(): boolean {
+    return this.wasm._canInterrupt() !== 0;
+  }
+
+  /**
+   * Identifies the build of the engine, which must match for a memory image to
+   * be restored
+   */
+  get buildHash(): string {
+    return this.wasm.ccall('getBuildHash', 'string', [], []);
+  }
+
+  /**
+   * Copy a sandbox of this instance into a new instance. The linear memory is
+   * the whole state of an instance, so copying it to a fresh instance of the
+   * same module clones every machine in place, without the heap walk of a
+   * snapshot or the relocation of a restore.
+   * @internal
+   */
+  async fork(handle: number, opts: XSSandboxOptions): Promise<XSSandbox> {
+    // Copied now, so that the fork has the state at the time of the call
+    const image = this.capture(handle);
+    image.memory = image.memory.slice();
+    const instance = await createInstance(this.module);
+    return instance.load(image, opts);
+  }
+
+  /**
+   * The memory of this instance, as an image of one of its sandboxes. The
+   * memory is a view which is only valid until the next call into the
+   * instance.
+   * @internal
+   */
+  capture(handle: number): MemoryImage {
+    for (const sandbox of this.sandboxes.values()) {
+      if (sandbox.active) {
+        throw new Error('Cannot copy memory while a sandbox in the instance is active');
+      }
+    }
+    return {
+      buildHash: this.buildHash,
+      handle,
+      others: [...this.sandboxes.keys()].filter(other => other !== handle),
+      memory: this.wasm.HEAPU8.subarray(0, this.wasm._getHeapEnd()),
+    };
+  }
+
+  // Replace the memory of this instance, which has no sandboxes, with an image
+  // from the same build, and delete the copies of the other sandboxes in it
+  private load(image: MemoryImage, opts: XSSandboxOptions) {
+    const wasm = this.wasm;
+    if (!wasm._reserveHeap(image.memory.length)) {
+      throw new Error('Out of memory');
+    }
+    wasm.HEAPU8.set(image.memory);
+    wasm.HEAPU8.fill(0, image.memory.length);
+    for (const other of image.others) {
+      wasm.ccall('destroyMachine', null, ['number'], [other]);
+    }
+    return this.attach(image.handle, opts);
+  }
+
+  /** @internal */
+  destroy(handle: number) {
+    this.wasm.ccall('destroyMachine', null, ['number'], [handle]);
+    this.sandboxes.delete(handle);
+  }
+
+  private attach(handle: number, opts: XSSandboxOptions) {
+    const sandbox = new XSSandbox(this, handle, opts);
+    this.sandboxes.set(handle, sandbox);
+    return sandbox;
+  }
+}
+
+export class XSSandbox {
+  /**
+   * A client of the library should set this to receive messages from the sandbox.
+   */
+  receiveMessage?: (message: any) => void;
+
+  /**
+   * Set this to receive messages from the guest's `sendMessageAsync`. The
+   * guest gets a promise straight away, which the host settles later by
+   * calling `resolve` or `reject` with the same `id`. If this throws, or isn't
+   * set, the guest's promise is rejected.
+   */
+  receiveMessageAsync?: (message: any, id: number) => void;
+
+  /**
+   * Set this to record every call into the sandbox, with the host's answers to
+   * the guest's calls, so that its state can be rebuilt from an earlier
+   * snapshot with `replay`. Each record is passed to the sink as it's made, as
+   * a few bytes to append to the journal, e.g. in a file. This is much cheaper
+   * than a snapshot after every call.
+   *
+   * Replays are only exact for deterministic sandboxes (see
+   * `XSSandboxOptions.deterministic`), with the same settings.
+   */
+  journal?: (record: Uint8Array) => void;
+
+  /**
+   * Whether the sandbox is deterministic. See `XSSandboxOptions.deterministic`.
+   */
+  readonly deterministic: boolean;
+
+  /**
+   * The encoding of messages and `evaluate` results. See `MessageFormat`.
+   */
+  readonly messageFormat: MessageFormat;
+
+  /**
+   * The modules that the guest can import. Modules are loaded from the registry
+   * when first imported, so changing this only affects later imports.
+   */
+  modules?: ModuleRegistry;
+
+  private disposed = false;
+  private statsCollector?: StatsCollector;
+  // Whether a call is being timed, so that reentrant calls aren't
+  private timingCall = false;
+  private snapshotSink?: SnapshotSink;
+  private snapshotSinkError?: { error: unknown };
+  private sourceReader?: SourceReader;
+  private sourceReadError?: { error: unknown };
+  private replayReader?: JournalReader;
+  // Continues the call that's suspended partway through guest code, if any
+  private wakeUp?: () => void;
+  // Where the engine finds the clock of a deterministic sandbox
+  private clock: number;
+  // Where the engine puts the address and size of each call's output
+  private ioResult: number;
+
+  /** @internal */
+  constructor(readonly instance: XSSandboxInstance, private handle: number, opts: XSSandboxOptions) {
+    this.meteringInterval = opts.meteringInterval ?? 1000;
+    this.meteringLimit = opts.meteringLimit;
+    this.memoryLimit = opts.memoryLimit;
+    this.timeSlice = opts.timeSlice;
+    this.messageFormat = opts.messageFormat ?? 'json';
+    this.modules = opts.modules;
+    this.deterministic = opts.deterministic ?? false;
+    this.ioResult = this.wasm.ccall('getIOResult', 'number', ['number'], [this.handle]);
+    this.clock = this.wasm.ccall('getClock', 'number', ['number'], [this.handle]);
+    const format = this.messageFormat === 'binary' ? MESSAGE_FORMAT_BINARY : MESSAGE_FORMAT_JSON;
+    this.wasm.ccall('setMessageFormat', null, ['number', 'number'], [this.handle, format]);
+  }
+
+  private get wasm() {
+    if (this.disposed) {
+      throw new Error('Sandbox has been disposed');
+    }
+    return this.instance.wasm;
+  }
+
+  /**
+   * Evaluate a script in the sandbox.
+   * @param script ECMAScript source text to evaluate
+   * @returns The result of the script, encoded according to `messageFormat`
+   */
+  evaluate(script: string) {
+    return this.input('evaluate', () => script, 0);
+  }
+
+  /**
+   * Evaluate a script whose source is given in chunks, such as the lines of a
+   * file as they are read. The chunks are parsed as they arrive, so a
+   * multi-megabyte script is never copied into the sandbox as a whole. This
+   * behaves like `evaluate` of the chunks joined together.
+   *
+   * Chunks can be strings, or UTF-8 bytes, which may split characters.
+   * @returns The result of the script, encoded according to `messageFormat`
+   * @throws A SyntaxError as for `compile` if the script has a syntax error, or
+   * whatever reading the chunks throws
+   */
+  evaluateStream(chunks: Iterable<SourceChunk>, opts?: EvaluateStreamOptions) {
+    const previous = [this.sourceReader, this.sourceReadError] as const;
+    this.sourceReader = new SourceReader(chunks);
+    this.sourceReadError = undefined;
+    try {
+      return this.input('evaluate', () => encodeStreamHeader(opts), 5);
+    } catch (error) {
+      throw this.sourceReadError ? this.sourceReadError.error : error;
+    } finally {
+      [this.sourceReader, this.sourceReadError] = previous;
+    }
+  }
+
+  /**
+   * Send a message to the sandbox. The message is encoded according to
+   * `messageFormat`. This invokes the globalThis.receiveMessage of the script,
+   * it defined (if not defined then this has no effect).
+   *
+   * @param message The message to send to the sandbox
+   * @returns The result returned by receiveMessage
+   */
+  sendMessage(message: any) {
+    return this.input('sendMessage', () => this.encodeMessage(message), 1);
+  }
+
+  /**
+   * Send a batch of messages to the sandbox in a single call, which is much
+   * cheaper than calling `sendMessage` for each when there are many small
+   * messages. Each message is passed to globalThis.receiveMessage in order.
+   *
+   * Promise jobs queued by the guest are run once after the last message, or
+   * after every message if `opts.drain` is `'each'`. When called from a host
+   * function during another call, the jobs are left for that call to run, so
+   * `'each'` isn't allowed.
+   *
+   * @returns The outcome of each message, in the same shape as
+   * `Promise.allSettled`: either its result, or the error it threw.
+   */
+  sendMessages(messages: any[], opts?: SendMessagesOptions): MessageResult[] {
+    this.checkNotInterrupted();
+    const drainEach = opts?.drain === 'each';
+    if (drainEach && this.active) {
+      throw new Error("Cannot drain after each message (drain: 'each') during another call");
+    }
+    const encode = () => messages.map(message => this.encodeMessage(message));
+    const call = (payloads: Payload[], timing?: CallTiming) => {
+      this.beginCall(time => encodeBatchRecord(drainEach, time, payloads));
+      return sandboxInputBatch(this.wasm, this.handle, this.ioResult, payloads, drainEach, this.messageFormat, timing);
+    };
+    return this.statsCollector && !this.timingCall
+      ? this.timed('sendMessages', encode, call)
+      : call(encode());
+  }
+
+  /**
+   * Compile a script without running it. The result can be run any number of
+   * times with `run`, in this or any other sandbox, skipping the parse that
+   * `evaluate` does each time.
+   *
+   * Compiled scripts are cached by source and file name, so compiling the same
+   * script again (in any sandbox) returns the cached result. See
+   * `scriptCacheStats`.
+   *
+   * With `opts.module`, the source is compiled as a module instead, which can
+   * be put in a `ModuleRegistry` but not run directly.
+   *
+   * @throws A SyntaxError with the parser's first error, as "file:line:
+   * message", if the script has a syntax error
+   */
+  compile(source: string, opts?: CompileOptions): CompiledScript {
+    this.checkNotInterrupted();
+    opts ??= {};
+    const useCache = opts.cache ?? true;
+    if (useCache) {
+      const cached = scriptCache.get(source, opts);
+      if (cached) {
+        return cached;
+      }
+    }
+    const script = new CompiledScript(compileScript(this.wasm, this.handle, source, opts.filename, opts.module ?? false));
+    if (useCache) {
+      scriptCache.set(source, opts, script);
+    }
+    return script;
+  }
+
+  /**
+   * Run a compiled script in the sandbox. This behaves like `evaluate` of the
+   * source the script was compiled from.
+   * @returns The result of the script, encoded according to `messageFormat`
+   */
+  run(script: CompiledScript) {
+    return this.input('run', () => script.bytecode, 2);
+  }
+
+  /**
+   * Resolve the promise returned by the guest's `sendMessageAsync` with the
+   * given `id` (see `receiveMessageAsync`), and run the promise jobs that this
+   * queues. The value is encoded according to `messageFormat`.
+   *
+   * Pending calls are part of the guest's state, so they survive snapshots: a
+   * call made before a snapshot can be settled in a sandbox restored from it.
+   *
+   * @throws If there is no pending call with this `id`
+   */
+  resolve(id: number, value?: any) {
+    this.input('settle', () => this.encodeSettlement(id, false, value), 3);
+  }
+
+  /**
+   * Reject the promise returned by the guest's `sendMessageAsync` with the
+   * given `id`. The guest receives an `Error` with the same message.
+   */
+  reject(id: number, error: unknown) {
+    this.input('settle', () => this.encodeSettlement(id, true, error), 3);
+  }
+
+  // The payload of a settlement: the ID, whether it's rejected, then the value
+  // or the JSON error
+  private encodeSettlement(id: number, rejected: boolean, value: any) {
+    const message = rejected
+      ? JSON.stringify({ message: value instanceof Error ? value.message : String(value) })
+      : this.encodeMessage(value);
+    const encoded = typeof message === 'string' ? textEncoder.encode(message) : message;
+    const payload = new Uint8Array(5 + encoded.length);
+    new DataView(payload.buffer).setUint32(0, id, true);
+    payload[4] = rejected ? 1 : 0;
+    payload.set(encoded, 5);
+    return payload;
+  }
+
+  /**
+   * Continue a call that was suspended at the end of its time slice (see
+   * `timeSlice`), for up to another time slice. If the call was suspended
+   * partway through guest code, it carries on from exactly where it stopped,
+   * and once it finishes, its result is in `resumedResult`, or its error is
+   * thrown here. Otherwise, this runs the promise jobs it left.
+   *
+   * @returns Whether the sandbox is still suspended, i.e. there's more to run
+   * with another call to `resume`
+   */
+  resume(): boolean {
+    if (this.wakeUp) {
+      this.continueCall();
+      return this.suspended;
+    }
+    if (this.active) {
+      throw new Error('Cannot resume sandbox while active');
+    }
+    this.input('resume', () => '', 4);
+    return this.suspended;
+  }
+
+  /**
+   * The result of the last call that was suspended partway through guest code,
+   * once `resume` has finished it
+   */
+  resumedResult: any;
+
+  /**
+   * Whether the last call into the sandbox was suspended at the end of its time
+   * slice. If it was suspended partway through guest code, only `resume` can be
+   * called until it finishes. Otherwise it has promise jobs left to run: any
+   * call into the sandbox continues running them, but only `resume` does
+   * nothing else.
+   */
+  get suspended() {
+    return this.wakeUp !== undefined
+      || this.wasm.ccall('getSuspended', 'number', ['number'], [this.handle]) !== 0;
+  }
+
+  /** @internal */
+  interrupted(wakeUp: () => void) {
+    this.wakeUp = wakeUp;
+  }
+
+  // Continue the call that's suspended partway through guest code, which
+  // rewinds its C stack and runs it until it finishes or is suspended again
+  private continueCall() {
+    // Rewinding can't be done from inside another call into the instance
+    if (this.wasm._getEntryDepth() !== 1) {
+      throw new Error('Cannot resume a suspended call while another call into the instance is in progress');
+    }
+    const wakeUp = this.wakeUp!;
+    this.wakeUp = undefined;
+    this.resumedResult = undefined;
+    this.beginCall(time => encodeInputRecord(4, time, ''));
+    wakeUp();
+    const code = this.wasm.HEAPU32[this.ioResult / 4 + 3];
+    if (code !== EC_INTERRUPTED) {
+      this.resumedResult = decodeOutput(this.wasm, this.ioResult, code, this.messageFormat);
+    }
+  }
+
+  private checkNotInterrupted() {
+    if (this.wakeUp) {
+      throw new Error('Sandbox is suspended partway through a call, which must be resumed first');
+    }
+  }
+
+  // Shared by evaluate, evaluateStream, sendMessage, run, settlements and resume
+  private input(kind: CallTiming['kind'], encode: () => Payload, action: InputAction) {
+    this.checkNotInterrupted();
+    const call = (payload: Payload, timing?: CallTiming) => {
+      this.beginCall(time => encodeInputRecord(action, time, payload));
+      const code = sandboxInput(this.wasm, this.handle, this.ioResult, payload, action);
+      // The result of a call suspended partway comes from `resume` instead
+      return code === EC_INTERRUPTED
+        ? undefined
+        : decodeOutput(this.wasm, this.ioResult, code, this.messageFormat, timing);
+    };
+    return this.statsCollector && !this.timingCall
+      ? this.timed(kind, encode, call)
+      : call(encode());
+  }
+
+  // Set the clock of a deterministic sandbox for a call, and journal the call
+  private beginCall(record: (time: number) => Uint8Array) {
+    if (!this.deterministic && !this.journal) {
+      return;
+    }
+    const time = Date.now();
+    if (this.deterministic) {
+      this.wasm.HEAPF64[this.clock / 8] = time;
+    }
+    this.journal?.(record(time));
+  }
+
+  /**
+   * Answer a call from the guest to the host, or replay the answer from the
+   * journal. If `answer` throws, `failure` gives the answer for the error.
+   * @internal
+   */
+  hostReply(answer: () => HostReply, failure: (e: unknown) => HostReply = errorReply): HostReply {
+    if (this.replayReader) {
+      return this.replayedReply();
+    }
+    let reply: HostReply;
+    try {
+      reply = answer();
+    } catch (e) {
+      reply = failure(e);
+    }
+    this.journal?.(encodeReplyRecord(reply[0], reply[1]));
+    return reply;
+  }
 
-  const result = wasm.ccall('restoreSnapshot', null, ['array', 'number'], [snapshot, snapshot.length]);
+  /** @internal */
+  get replaying() {
+    return this.replayReader !== undefined;
+  }
 
-  if (result === 0) {
-    return sandbox;
-  } else {
-    throw new Error('Error restoring snapshot');
+  /**
+   * Rebuild the state of the sandbox by repeating the calls recorded in a
+   * journal (see `journal`), which must start from the state the sandbox is
+   * in, e.g. right after restoring the snapshot taken when the journal was
+   * started. The host's handlers aren't called: the guest gets the answers
+   * they gave when the journal was recorded. Errors thrown by the guest are
+   * ignored, since it threw them when the journal was recorded too.
+   *
+   * The journal can be one buffer, or a sequence of buffers of whole records
+   * such as those passed to the journal sink. If it ends partway through a
+   * call, e.g. because the host crashed during it, the guest's remaining calls
+   * to the host during it fail.
+   */
+  replay(journal: Uint8Array | Iterable<Uint8Array>) {
+    if (this.active) {
+      throw new Error('Cannot replay while sandbox is active');
+    }
+    this.replayReader = new JournalReader(journal);
+    try {
+      for (let record = this.replayReader.next(); record; record = this.replayReader.next()) {
+        this.replayCall(record);
+      }
+    } finally {
+      this.replayReader = undefined;
+    }
   }
-}
 
-async function createWasmSandbox(opts: XSSandboxOptions): Promise<[any, XSSandbox]> {
-  const wasm = await wasmWrapper({
-    sendMessage: (ptr: number, len: number, outputPtrPtr: number, outputSizePtr: number) => {
-      wasm.HEAPU32[outputPtrPtr / 4] = 0;
-      wasm.HEAPU32[outputSizePtr / 4] = 0;
-      try {
-        const bytes = new Uint8Array(wasm.HEAPU8.buffer, ptr, len);
-        const str = new TextDecoder().decode(bytes);
-        const message = JSON.parse(str);
-
-        const result = sandbox.receiveMessage?.(message);
-
-        if (result === undefined) {
-          return EC_OK_UNDEFINED;
-        } else {
-          const strResult = JSON.stringify(result ?? null);
-          const bytesResult = new TextEncoder().encode(strResult + '\0');
-          const outputPtr = wasm._malloc(bytesResult.length);
-          wasm.HEAPU8.set(bytesResult, outputPtr);
-          wasm.HEAPU32[outputPtrPtr / 4] = outputPtr;
-          wasm.HEAPU32[outputSizePtr / 4] = bytesResult.length - 1;
-          return EC_OK_VALUE;
+  private replayCall(record: JournalRecord) {
+    if (record.kind === RECORD_REPLY) {
+      throw new Error('Corrupt journal: reply outside of a call');
+    }
+    this.wasm.HEAPF64[this.clock / 8] = record.time;
+    try {
+      if (record.kind === RECORD_BATCH) {
+        sandboxInputBatch(this.wasm, this.handle, this.ioResult, record.payloads, record.drainEach, this.messageFormat);
+      } else if (this.wakeUp && record.action === 4) {
+        this.continueCall();
+      } else {
+        const code = sandboxInput(this.wasm, this.handle, this.ioResult, record.payload, record.action as InputAction);
+        if (code !== EC_INTERRUPTED) {
+          decodeOutput(this.wasm, this.ioResult, code, this.messageFormat);
         }
-      } catch (e) {
-        const errStr = e instanceof Error ? { message: e.message } : { message: e.toString() };
-        const strResult = JSON.stringify(errStr);
-        const bytesResult = new TextEncoder().encode(strResult + '\0');
-        const outputPtr = wasm._malloc(bytesResult.length);
-        wasm.HEAPU8.set(bytesResult, outputPtr);
-        wasm.HEAPU32[outputPtrPtr / 4] = outputPtr;
-        wasm.HEAPU32[outputSizePtr / 4] = bytesResult.length - 1;
-        return EC_EXCEPTION;
       }
-    },
-    consoleLog: (argsPtr: number, argsSize: number, level: number) => {
-      const bytes = new Uint8Array(wasm.HEAPU8.buffer, argsPtr, argsSize);
-      const str = new TextDecoder().decode(bytes);
-      const args = JSON.parse(str);
-      switch (level) {
-        case 0: console.log(...args); break;
-        case 1: console.warn(...args); break;
-        case 2: console.error(...args); break;
+    } catch (e) {
+      // The guest threw the same error when the journal was recorded
+      if (!(e instanceof XSSandboxError)) {
+        throw e;
       }
     }
-  });
-  const sandbox = new XSSandbox(wasm, opts);
-  return [wasm, sandbox];
-}
+  }
+
+  // The next answer in the journal, repeating any calls the host made into the
+  // sandbox before it
+  private replayedReply(): HostReply {
+    const reader = this.replayReader!;
+    for (;;) {
+      const record = reader.next();
+      if (!record) {
+        return errorReply(new Error('Journal ends during this call'));
+      }
+      if (record.kind === RECORD_REPLY) {
+        return [record.code, record.bytes.length ? record.bytes : undefined];
+      }
+      this.replayCall(record);
+    }
+  }
 
+  // Make a call while collecting stats
+  private timed<P, T>(kind: CallTiming['kind'], encode: () => P, call: (payload: P, timing: CallTiming) => T): T {
+    const collector = this.statsCollector!;
+    const timing = newCallTiming(kind);
+    const start = performance.now();
+    const payload = encode();
+    timing.phases.hostEncode = performance.now() - start;
+    this.timingCall = true;
+    try {
+      return call(payload, timing);
+    } finally {
+      this.timingCall = false;
+      timing.total = performance.now() - start;
+      const statsPtr = this.wasm._malloc(CALL_STATS_COUNT * 8);
+      try {
+        this.wasm.ccall('getCallStats', null, ['number', 'number'], [this.handle, statsPtr]);
+        const stats = this.wasm.HEAPF64.slice(statsPtr / 8, statsPtr / 8 + CALL_STATS_COUNT);
+        enginePhases.forEach((phase, i) => timing.phases[phase] = stats[i]);
+        timing.hostCallbacks = stats[enginePhases.length];
+        const gcCount = stats[enginePhases.length + 1];
+        timing.gcCount = gcCount < 0 ? undefined : gcCount;
+      } finally {
+        this.wasm._free(statsPtr);
+      }
+      collector.record(timing);
+    }
+  }
 
-class XSSandbox {
   /**
-   * A client of the library should set this to receive messages from the sandbox.
+   * Start collecting stats about calls into the sandbox (`evaluate`,
+   * `sendMessage`, `sendMessages`, `run`, `resolve`, `reject` and `resume`),
+   * breaking down where the time of each call went. See `stats` and
+   * `CallPhase`. Collecting stats has no cost while it's disabled.
+   *
+   * @param onCall Called after each call with its timing
    */
-  receiveMessage?: (message: any) => void;
+  enableStats(onCall?: (timing: CallTiming) => void) {
+    this.statsCollector = new StatsCollector(onCall);
+    this.wasm.ccall('setCollectingStats', null, ['number', 'number'], [this.handle, 1]);
+  }
 
-  constructor(private wasm: any, opts: XSSandboxOptions) {
-    this.meteringInterval = opts.meteringInterval ?? 1000;
-    this.meteringLimit = opts.meteringLimit;
+  disableStats() {
+    this.statsCollector = undefined;
+    this.wasm.ccall('setCollectingStats', null, ['number', 'number'], [this.handle, 0]);
   }
 
   /**
-   * Evaluate a script in the sandbox.
-   * @param script ECMAScript source text to evaluate
-   * @returns The result of the script, passed through JSON.stringify
+   * The cumulative stats of calls since `enableStats`, or undefined if stats
+   * aren't enabled. Call `enableStats` again to reset them.
    */
-  evaluate(script: string) {
-    return sandboxInput(this.wasm, script, 0);
+  stats(): SandboxStats | undefined {
+    return this.statsCollector?.stats;
   }
 
-  /**
-   * Send a message to the sandbox. The message is passed through
-   * JSON.stringify. This invokes the globalThis.receiveMessage of the script,
-   * it defined (if not defined then this has no effect).
-   *
-   * @param message The message to send to the sandbox
-   * @returns The result returned by receiveMessage, passed through JSON.stringify
-   */
-  sendMessage(message: any) {
-    const str = JSON.stringify(message ?? null);
-    return sandboxInput(this.wasm, str, 1);
+  private encodeMessage(message: any): Payload {
+    return this.messageFormat === 'binary'
+      ? encodeMessage(message)
+      : JSON.stringify(message ?? null);
   }
 
   /**
    * Create a snapshot of the current state of the sandbox.
-   * @returns A snapshot of the current state of the sandbox.
+   * @returns A snapshot of the current state of the sandbox, or nothing if the
+   * snapshot was written to `opts.sink`.
    */
-  snapshot() {
+  snapshot(): Uint8Array;
+  snapshot(opts: SnapshotOptions & { sink: SnapshotSink }): void;
+  snapshot(opts?: SnapshotOptions): Uint8Array | void;
+  snapshot(opts?: SnapshotOptions): Uint8Array | void {
     if (this.active) {
       throw new Error('Cannot take snapshot while sandbox is active');
     }
+    const basePtr = opts?.base ? copyToWasm(this.wasm, opts.base) : 0;
+    const baseSize = opts?.base?.length ?? 0;
+    const compress = opts?.compress ? 1 : 0;
+    try {
+      if (opts?.sink) {
+        return this.streamSnapshot(opts.sink, opts.chunkSize ?? 0, basePtr, baseSize, compress);
+      } else {
+        return this.bufferSnapshot(basePtr, baseSize, compress);
+      }
+    } finally {
+      this.wasm._free(basePtr);
+    }
+  }
+
+  private bufferSnapshot(basePtr: number, baseSize: number, compress: number) {
     // Memory slot to receive output size
     const outputSizePtr = this.wasm._malloc(4);
     // Memory slot to receive pointer to output buffer
     const outputPtrPtr = this.wasm._malloc(4);
 
     try {
-      const success = this.wasm.ccall('takeSnapshot', 'number', ['number', 'number'], [outputPtrPtr, outputSizePtr])
+      const success = this.wasm.ccall('takeSnapshot', 'number', ['number', 'number', 'number', 'number', 'number', 'number'], [this.handle, basePtr, baseSize, compress, outputPtrPtr, outputSizePtr])
 
       if (success) {
         const outputPtr = this.wasm.HEAPU32[outputPtrPtr / 4];
@@ -161,12 +1216,120 @@ class XSSandbox {
     }
   }
 
+  private streamSnapshot(sink: SnapshotSink, chunkSize: number, basePtr: number, baseSize: number, compress: number) {
+    this.snapshotSink = sink;
+    try {
+      const success = this.wasm.ccall('streamSnapshot', 'number', ['number', 'number', 'number', 'number', 'number'], [this.handle, chunkSize, basePtr, baseSize, compress]);
+      if (this.snapshotSinkError) {
+        throw this.snapshotSinkError.error;
+      }
+      if (!success) {
+        throw new Error('Error capturing snapshot');
+      }
+    } finally {
+      this.snapshotSink = undefined;
+      this.snapshotSinkError = undefined;
+    }
+  }
+
+  /** @internal */
+  readSourceChunk(target: Uint8Array) {
+    const [count, bytes] = this.hostReply(() => {
+      try {
+        const count = this.sourceReader!.read(target);
+        return [count, target.subarray(0, count)];
+      } catch (error) {
+        // Abort the script. The error is rethrown once we're out of WASM.
+        this.sourceReadError = { error };
+        return [-1];
+      }
+    });
+    if (this.replayReader && bytes) {
+      target.set(bytes as Uint8Array);
+    }
+    return count;
+  }
+
+  /** @internal */
+  writeSnapshotChunk(chunk: Uint8Array) {
+    try {
+      this.snapshotSink!(chunk);
+      return true;
+    } catch (error) {
+      // Abort the snapshot. The error is rethrown once we're out of WASM.
+      this.snapshotSinkError = { error };
+      return false;
+    }
+  }
+
+  /**
+   * Clone the sandbox into a new instance, like restoring a snapshot of it but
+   * much cheaper: the instance's memory is copied as it is. The fork has the
+   * state of the sandbox at the time of the call, including its metering, time
+   * slice and memory limit settings, and the guest's pending calls to
+   * `sendMessageAsync`, which the host must settle in each sandbox separately.
+   * Like a restored sandbox, it doesn't have the `receiveMessage` and
+   * `receiveMessageAsync` handlers of the original.
+   *
+   * The whole instance is copied, so this is cheapest for a sandbox that has
+   * an instance to itself, as from `Sandbox.create` or `Sandbox.restore`.
+   *
+   * @throws If any sandbox in the instance is active
+   */
+  fork(): Promise<XSSandbox> {
+    return this.instance.fork(this.handle, {
+      meteringInterval: this.meteringInterval,
+      meteringLimit: this.meteringLimit,
+      memoryLimit: this.memoryLimit,
+      timeSlice: this.timeSlice,
+      messageFormat: this.messageFormat,
+      modules: this.modules,
+      deterministic: this.deterministic,
+    });
+  }
+
+  /**
+   * Capture a raw image of the sandbox's memory, which restores much faster
+   * than a snapshot: `restore` copies it straight back into a new instance,
+   * without the heap walk and relinking of a snapshot. An image is only valid
+   * for the same build of the engine (see `XSSandboxInstance.buildHash`), and
+   * it's much larger than a snapshot, since it holds the whole memory of the
+   * instance, free space included. Pass a portable snapshot as
+   * `opts.fallback` to `restore` for when the build differs.
+   *
+   * @throws If any sandbox in the instance is active
+   */
+  memoryImage(): Uint8Array {
+    return encodeMemoryImage(this.instance.capture(this.handle));
+  }
+
+  /**
+   * Release the sandbox's machine. The sandbox cannot be used after this. The
+   * memory is returned to the WASM instance so it can be reused by other
+   * sandboxes in the same instance.
+   */
+  dispose() {
+    if (this.disposed) {
+      return;
+    }
+    if (this.wakeUp) {
+      // Let the suspended call finish, stopping straight away
+      this.wasm.ccall('cancelCall', null, ['number'], [this.handle]);
+      this.continueCall();
+    }
+    if (this.active) {
+      throw new Error('Cannot dispose sandbox while active');
+    }
+    this.instance.destroy(this.handle);
+    this.disposed = true;
+  }
+
   get active() {
-    return this.wasm.ccall('getActive', 'number', [], []) !== 0;
+    return this.wasm.ccall('getActive', 'number', ['number'], [this.handle]) !== 0;
   }
 
   get meteringInterval() {
-    return this.wasm.ccall('getMeteringInterval', 'number', [], []);
+    return this.wasm.ccall('getMeteringInterval', 'number', ['number'], [this.handle]);
   }
 
   set meteringInterval(value: number) {
@@ -176,11 +1339,11 @@ class XSSandbox {
     if (value < 1) {
       throw new Error('Metering interval must be at least 1');
     }
-    this.wasm.ccall('setMeteringInterval', null, ['number'], [value]);
+    this.wasm.ccall('setMeteringInterval', null, ['number', 'number'], [this.handle, value]);
   }
 
   get meteringLimit(): number | undefined {
-    const value = this.wasm.ccall('getMeteringLimit', 'number', [], []);
+    const value = this.wasm.ccall('getMeteringLimit', 'number', ['number'], [this.handle]);
     return value ? value : undefined;
   }
 
@@ -188,71 +1351,448 @@ class XSSandbox {
     if (this.active) {
       throw new Error('Cannot set metering limit while active');
     }
-    this.wasm.ccall('setMeteringLimit', null, ['number'], [value ?? 0]);
+    this.wasm.ccall('setMeteringLimit', null, ['number', 'number'], [this.handle, value ?? 0]);
+  }
+
+  get timeSlice(): number | undefined {
+    const value = this.wasm.ccall('getTimeSlice', 'number', ['number'], [this.handle]);
+    return value ? value : undefined;
+  }
+
+  set timeSlice(value: number | undefined) {
+    if (this.active) {
+      throw new Error('Cannot set time slice while active');
+    }
+    this.wasm.ccall('setTimeSlice', null, ['number', 'number'], [this.handle, value ?? 0]);
+  }
+
+  get memoryLimit(): number | undefined {
+    // A uint32, which comes back signed
+    const value = this.wasm.ccall('getMemoryLimit', 'number', ['number'], [this.handle]) >>> 0;
+    return value ? value : undefined;
+  }
+
+  set memoryLimit(value: number | undefined) {
+    if (this.active) {
+      throw new Error('Cannot set memory limit while active');
+    }
+    this.wasm.ccall('setMemoryLimit', null, ['number', 'number'], [this.handle, checkMemoryLimit(value) ?? 0]);
+  }
+
+  /**
+   * The sandbox's current memory use. This is cheap, so it can be called
+   * often (e.g. after every call into the sandbox).
+   */
+  memoryStats(): MemoryStats {
+    const statsPtr = this.wasm._malloc(MEMORY_STATS_COUNT * 4);
+    try {
+      this.wasm.ccall('getMemoryStats', null, ['number', 'number'], [this.handle, statsPtr]);
+      const stats = this.wasm.HEAPU32.slice(statsPtr / 4, statsPtr / 4 + MEMORY_STATS_COUNT);
+      return {
+        slotsInUse: stats[0],
+        slotsAllocated: stats[1],
+        chunkBytesInUse: stats[2],
+        chunkBytesAllocated: stats[3],
+        keys: stats[4],
+        gcCount: stats[5] === 0xFFFFFFFF ? undefined : stats[5],
+        heapBytes: stats[6],
+        arenaBytes: stats[7],
+        arenaPeakBytes: stats[8],
+        wasmMemoryBytes: this.wasm.HEAPU8.buffer.byteLength,
+      };
+    } finally {
+      this.wasm._free(statsPtr);
+    }
+  }
+
+  /**
+   * Break the sandbox's heap down by kind of value, and find the largest
+   * objects and what refers to them. This collects garbage and walks the whole
+   * heap, so it's meant for diagnostics rather than every call. See also
+   * `analyzeSnapshot`.
+   */
+  heapSummary(): HeapSummary {
+    if (this.active) {
+      throw new Error('Cannot summarize heap while active');
+    }
+    // Memory slot to receive output size
+    const outputSizePtr = this.wasm._malloc(4);
+    // Memory slot to receive pointer to output buffer
+    const outputPtrPtr = this.wasm._malloc(4);
+    try {
+      this.wasm.ccall('getHeapSummary', null, ['number', 'number', 'number'], [this.handle, outputPtrPtr, outputSizePtr]);
+      const outputPtr = this.wasm.HEAPU32[outputPtrPtr / 4];
+      if (!outputPtr) {
+        throw new Error('Out of memory');
+      }
+      try {
+        const outputSize = this.wasm.HEAPU32[outputSizePtr / 4];
+        return JSON.parse(textDecoder.decode(new Uint8Array(this.wasm.HEAPU8.buffer, outputPtr, outputSize)));
+      } finally {
+        // Free returned memory
+        this.wasm._free(outputPtr);
+      }
+    } finally {
+      this.wasm._free(outputPtrPtr);
+      this.wasm._free(outputSizePtr);
+    }
+  }
+
+  /**
+   * Start sampling the guest's call stack. Samples are taken as the meter
+   * advances, so only time spent executing guest code is sampled. Profiling
+   * has no cost while it isn't running.
+   */
+  startProfiling(opts?: ProfilingOptions) {
+    const interval = opts?.sampleInterval ?? 1000;
+    if (!(interval >= 1)) {
+      throw new RangeError('Sample interval must be at least 1');
+    }
+    this.wasm.ccall('startProfiling', null, ['number', 'number'], [this.handle, interval]);
+  }
+
+  /**
+   * Stop profiling and return the samples, which can be exported for flame
+   * graph viewers with `toCollapsed` or `toCpuProfile`. Functions have source
+   * locations if they were compiled with a file name (see `compile`).
+   */
+  stopProfiling(): Profile {
+    // Memory slot to receive output size
+    const outputSizePtr = this.wasm._malloc(4);
+    // Memory slot to receive pointer to output buffer
+    const outputPtrPtr = this.wasm._malloc(4);
+    try {
+      const dropped = this.wasm.ccall('stopProfiling', 'number', ['number', 'number', 'number'], [this.handle, outputPtrPtr, outputSizePtr]);
+      const outputPtr = this.wasm.HEAPU32[outputPtrPtr / 4];
+      try {
+        const outputSize = this.wasm.HEAPU32[outputSizePtr / 4];
+        const text = textDecoder.decode(new Uint8Array(this.wasm.HEAPU8.buffer, outputPtr, outputSize));
+        return Profile.parse(text, dropped);
+      } finally {
+        // Free returned memory
+        this.wasm._free(outputPtr);
+      }
+    } finally {
+      this.wasm._free(outputPtrPtr);
+      this.wasm._free(outputSizePtr);
+    }
   }
 
   get meter() {
-    return this.wasm.ccall('getMeteringCount', 'number', [], []);
+    return this.wasm.ccall('getMeteringCount', 'number', ['number'], [this.handle]);
   }
 }
 
-// Shared logic for evaluate and sendMessage
-function sandboxInput(wasm: any, payload: string, action: 0 | 1) {
-  // Memory slot to receive output size
-  const outputSizePtr = wasm._malloc(4);
-  // Memory slot to receive pointer to output buffer
-  const outputPtrPtr = wasm._malloc(4);
+// Write the reply of a host function to the guest into the sandbox's reply
+// buffer, which the guest decodes before anything else can use it. Returns
+// false if there isn't memory for it.
+function writeReply(wasm: any, handle: number, reply: Payload, outputPtrPtr: number, outputSizePtr: number) {
+  const ptr = wasm._reserveReply(handle, maxPayloadSize(reply));
+  if (!ptr) {
+    return false;
+  }
+  const size = writePayload(wasm, ptr, reply);
+  wasm.HEAPU32[outputPtrPtr / 4] = ptr;
+  wasm.HEAPU32[outputSizePtr / 4] = size;
+  return true;
+}
 
-  console.assert(outputPtrPtr !== 0, 'outputPtrPtr should not be null');
-  console.assert(outputSizePtr !== 0, 'outputSizePtr should not be null');
+// Installed in new deterministic sandboxes, with the clock from installClock.
+// Replaces Math.random with a seeded generator (mulberry32), and Date with one
+// that gives the host's time for the current call when it isn't given another.
+function deterministicPrelude(seed: number) {
+  return `(function (clock, seed) {
+  let state = seed | 0;
+  function random() {
+    state = (state + 0x6D2B79F5) | 0;
+    let t = Math.imul(state ^ (state >>> 15), 1 | state);
+    t = (t + Math.imul(t ^ (t >>> 7), 61 | t)) ^ t;
+    return ((t ^ (t >>> 14)) >>> 0) / 4294967296;
+  }
+  Object.defineProperty(Math, 'random', { value: random, writable: true, configurable: true });
 
-  try {
-    const code = wasm.ccall('sandboxInput', 'number', ['string', 'number', 'number', 'number'], [payload, outputPtrPtr, outputSizePtr, action])
+  // Not Date, which is the function declared below
+  const OriginalDate = globalThis.Date;
+  const currentTime = () => {
+    const time = clock();
+    return time === time ? time : OriginalDate.now();
+  };
+  function Date(...args) {
+    if (!new.target) {
+      return new OriginalDate(currentTime()).toString();
+    }
+    return Reflect.construct(OriginalDate, args.length ? args : [currentTime()], new.target);
+  }
+  Object.defineProperty(Date, 'length', { value: 7 });
+  Object.defineProperty(Date, 'prototype', { value: OriginalDate.prototype, writable: false });
+  for (const name of ['parse', 'UTC']) {
+    Object.defineProperty(Date, name, { value: OriginalDate[name], writable: true, configurable: true });
+  }
+  Object.defineProperty(Date, 'now', { value: function now() { return currentTime(); }, writable: true, configurable: true });
+  Object.defineProperty(OriginalDate.prototype, 'constructor', { value: Date, writable: true, configurable: true });
+  Object.defineProperty(globalThis, 'Date', { value: Date, writable: true, configurable: true });
+})(globalThis.__virtualClock, ${seed | 0});
+delete globalThis.__virtualClock;`;
+}
+
+// The host's answer to a call from the guest: an ErrorCode (or for loadModule,
+// a MODULE_* code) and the reply, if any
+type HostReply = [code: number, reply?: Payload];
+
+function errorReply(e: any): HostReply {
+  return [EC_EXCEPTION, JSON.stringify({ message: errorMessage(e) })];
+}
+
+function errorMessage(e: any): string {
+  return e instanceof Error ? e.message : String(e);
+}
+
+function writeHostReply(wasm: any, handle: number, [code, reply]: HostReply, outputPtrPtr: number, outputSizePtr: number) {
+  if (reply !== undefined && !writeReply(wasm, handle, reply, outputPtrPtr, outputSizePtr)) {
+    // The error is small enough that it's likely to fit where the reply didn't
+    const [errorCode, error] = errorReply(new Error('Out of memory'));
+    if (!writeReply(wasm, handle, error!, outputPtrPtr, outputSizePtr)) {
+      wasm.HEAPU32[outputPtrPtr / 4] = 0;
+      wasm.HEAPU32[outputSizePtr / 4] = 0;
+    }
+    return errorCode;
+  }
+  return code;
+}
+
+/**
+ * Bytes to pass into the sandbox. Strings are encoded as UTF-8 straight into
+ * WASM memory, without an intermediate copy.
+ */
+type Payload = Uint8Array | string;
+
+// Enough room for the payload in WASM memory. UTF-8 takes at most 3 bytes per
+// UTF-16 code unit.
+function maxPayloadSize(payload: Payload) {
+  return typeof payload === 'string' ? payload.length * 3 : payload.length;
+}
+
+// Write a payload to WASM memory, which must have room for
+// maxPayloadSize(payload) bytes, and return its size
+function writePayload(wasm: any, ptr: number, payload: Payload): number {
+  if (typeof payload === 'string') {
+    return textEncoder.encodeInto(payload, wasm.HEAPU8.subarray(ptr, ptr + payload.length * 3)).written!;
+  }
+  wasm.HEAPU8.set(payload, ptr);
+  return payload.length;
+}
+
+// Copy the payload of a call into the sandbox's input buffer (see
+// reserveInput), returning its address and size
+function writeInput(wasm: any, handle: number, payload: Payload): [number, number] {
+  const ptr = wasm._reserveInput(handle, maxPayloadSize(payload));
+  if (!ptr) {
+    throw new Error('Out of memory');
+  }
+  return [ptr, writePayload(wasm, ptr, payload)];
+}
+
+// The payload of evaluateStream: the uint32 parser buffer size, then the file
+// name
+function encodeStreamHeader(opts?: EvaluateStreamOptions): Uint8Array {
+  const filename = textEncoder.encode(opts?.filename ?? '');
+  const header = new Uint8Array(4 + filename.length);
+  new DataView(header.buffer).setUint32(0, opts?.parserBufferSize ?? 0, true);
+  header.set(filename, 4);
+  return header;
+}
+
+// Validate an optional memory limit (1 byte to 4 GB) and return it
+function checkMemoryLimit(value: number | undefined) {
+  if (value !== undefined && !(value >= 1 && value <= 0xFFFFFFFF)) {
+    throw new RangeError('Memory limit must be between 1 byte and 4 GB');
+  }
+  return value;
+}
+
+// Copy bytes into a new allocation in WASM memory, which the caller must free
+function copyToWasm(wasm: any, bytes: Uint8Array): number {
+  const ptr = wasm._malloc(bytes.length);
+  if (!ptr) {
+    throw new Error('Out of memory');
+  }
+  wasm.HEAPU8.set(bytes, ptr);
+  return ptr;
+}
 
+// The action of sandboxInput: evaluate, sendMessage, run, settle, resume, or
+// evaluateStream
+type InputAction = 0 | 1 | 2 | 3 | 4 | 5;
+
+// Shared logic for evaluate, evaluateStream, sendMessage, run, settlements and
+// resume. Returns the ErrorCode from ioResult, since a call suspended partway
+// (EC_INTERRUPTED) returns to here without one.
+function sandboxInput(wasm: any, handle: number, ioResult: number, payload: Payload, action: InputAction): number {
+  const [payloadPtr, payloadSize] = writeInput(wasm, handle, payload);
+  wasm._sandboxInput(handle, payloadPtr, payloadSize, action);
+  return wasm.HEAPU32[ioResult / 4 + 3];
+}
+
+// The result of a call made by sandboxInput, once it finishes
+function decodeOutput(wasm: any, ioResult: number, code: number, format: MessageFormat, timing?: CallTiming) {
+  const decodeStart = timing && performance.now();
+  // The output is a view into the sandbox's output buffer, unless this call is
+  // nested in another, in which case it's ours to free
+  const outputPtr = wasm.HEAPU32[ioResult / 4];
+  const outputSize = wasm.HEAPU32[ioResult / 4 + 1];
+  const ownsOutput = wasm.HEAPU32[ioResult / 4 + 2] !== 0;
+  try {
     if (code === EC_OK_VALUE) {
-      const outputPtr = wasm.HEAPU32[outputPtrPtr / 4];
       try {
-        const outputSize = wasm.HEAPU32[outputSizePtr / 4];
-        console.assert(outputSize >= 0, 'outputSize should be non-negative');
-        console.assert(outputPtr !== 0, 'outputPtr should not be null');
         const bytes = new Uint8Array(wasm.HEAPU8.buffer, outputPtr, outputSize);
-        const str = new TextDecoder().decode(bytes);
-        if (str === 'undefined') {
-          return undefined;
-        }
-        return JSON.parse(str);
+        return decodeResult(bytes, format);
       } finally {
-        // Free returned memory
-        wasm._free(outputPtr);
+        if (timing) timing.phases.hostDecode = performance.now() - decodeStart!;
       }
-    } else if (code === EC_OK_UNDEFINED) {
+    } else if (code === EC_OK_UNDEFINED || code === EC_SUSPENDED) {
       return undefined;
     } else if (code === EC_EXCEPTION) {
-      console.assert(outputPtrPtr !== 0, 'outputPtrPtr should not be null');
-      console.assert(outputSizePtr !== 0, 'outputSizePtr should not be null');
-      const outputPtr = wasm.HEAPU32[outputPtrPtr / 4];
-      try {
-        const outputSize = wasm.HEAPU32[outputSizePtr / 4];
-        const bytes = new Uint8Array(wasm.HEAPU8.buffer, outputPtr, outputSize);
-        const str = new TextDecoder().decode(bytes);
-        const value = JSON.parse(str);
-        const error = new XSSandboxError(value.message);
-        error.name = value.name;
-        error.stack = value.stack;
-        throw error;
-      } finally {
-        // Free returned memory
-        wasm._free(outputPtr);
-      }
+      const bytes = new Uint8Array(wasm.HEAPU8.buffer, outputPtr, outputSize);
+      throw decodeError(bytes);
     } else  if (code === EC_METERING_LIMIT_REACHED) {
       throw new Error('Metering limit reached');
+    } else if (code === EC_MEMORY_LIMIT_REACHED) {
+      throw new Error('Memory limit reached');
     } else {
       throw new Error(`Unexpected return code ${code}`);
     }
   } finally {
+    if (ownsOutput) {
+      wasm._free(outputPtr);
+    }
+  }
+}
+
+// Batched counterpart of sandboxInput, for sendMessages
+function sandboxInputBatch(wasm: any, handle: number, ioResult: number, payloads: Payload[], drainEach: boolean, format: MessageFormat, timing?: CallTiming) {
+  // Pack the messages straight into the input buffer, each prefixed by its
+  // length
+  let maxSize = 0;
+  for (const payload of payloads) {
+    maxSize += 4 + maxPayloadSize(payload);
+  }
+  const payloadPtr = wasm._reserveInput(handle, maxSize);
+  if (!payloadPtr) {
+    throw new Error('Out of memory');
+  }
+  const view = new DataView(wasm.HEAPU8.buffer, payloadPtr, maxSize);
+  let offset = 0;
+  for (const payload of payloads) {
+    const size = writePayload(wasm, payloadPtr + offset + 4, payload);
+    view.setUint32(offset, size, true);
+    offset += 4 + size;
+  }
+
+  const code = wasm.ccall('sandboxInputBatch', 'number', ['number', 'number', 'number', 'number', 'number'], [handle, payloadPtr, offset, payloads.length, drainEach ? 1 : 0]);
+  const decodeStart = timing && performance.now();
+  const outputPtr = wasm.HEAPU32[ioResult / 4];
+  const outputSize = wasm.HEAPU32[ioResult / 4 + 1];
+  const ownsOutput = wasm.HEAPU32[ioResult / 4 + 2] !== 0;
+  try {
+    if (code === EC_METERING_LIMIT_REACHED) {
+      throw new Error('Metering limit reached');
+    } else if (code === EC_MEMORY_LIMIT_REACHED) {
+      throw new Error('Memory limit reached');
+    } else if (code !== EC_OK_VALUE) {
+      throw new Error('Error delivering messages');
+    }
+
+    // Unpack an entry per message: code, length, then the result or error
+    const output = new Uint8Array(wasm.HEAPU8.buffer, outputPtr, outputSize);
+    const outputView = new DataView(output.buffer, output.byteOffset, output.byteLength);
+    const results: MessageResult[] = [];
+    let offset = 0;
+    while (offset < outputSize) {
+      const entryCode = output[offset];
+      const length = outputView.getUint32(offset + 1, true);
+      const bytes = output.subarray(offset + 5, offset + 5 + length);
+      offset += 5 + length;
+      if (entryCode === EC_OK_VALUE) {
+        results.push({ status: 'fulfilled', value: decodeResult(bytes, format) });
+      } else if (entryCode === EC_OK_UNDEFINED) {
+        results.push({ status: 'fulfilled', value: undefined });
+      } else {
+        results.push({ status: 'rejected', reason: decodeError(bytes) });
+      }
+    }
+    return results;
+  } finally {
+    if (ownsOutput) {
+      wasm._free(outputPtr);
+    }
+    if (timing) timing.phases.hostDecode = performance.now() - decodeStart!;
+  }
+}
+
+// Compile a script in the given sandbox, returning its bytecode
+function compileScript(wasm: any, handle: number, source: string, filename: string | undefined, module: boolean): Uint8Array {
+  const sourceBytes = textEncoder.encode(source);
+  const sourcePtr = copyToWasm(wasm, sourceBytes);
+  // Memory slot to receive output size
+  const outputSizePtr = wasm._malloc(4);
+  // Memory slot to receive pointer to output buffer
+  const outputPtrPtr = wasm._malloc(4);
+
+  try {
+    const code = wasm.ccall('compileScript', 'number', ['number', 'number', 'number', 'string', 'number', 'number', 'number'], [handle, sourcePtr, sourceBytes.length, filename ?? null, module ? 1 : 0, outputPtrPtr, outputSizePtr]);
+    const outputPtr = wasm.HEAPU32[outputPtrPtr / 4];
+    try {
+      const outputSize = wasm.HEAPU32[outputSizePtr / 4];
+      const bytes = new Uint8Array(wasm.HEAPU8.buffer, outputPtr, outputSize);
+      if (code === EC_MEMORY_LIMIT_REACHED) {
+        throw new Error('Memory limit reached');
+      } else if (code !== EC_OK_VALUE) {
+        throw decodeError(bytes);
+      }
+      return bytes.slice();
+    } finally {
+      // Free returned memory
+      wasm._free(outputPtr);
+    }
+  } finally {
+    wasm._free(sourcePtr);
     wasm._free(outputPtrPtr);
     wasm._free(outputSizePtr);
   }
 }
 
-export default { create, restore }
\ No newline at end of file
+function decodeResult(bytes: Uint8Array, format: MessageFormat) {
+  if (format === 'binary') {
+    return decodeMessage(bytes);
+  }
+  const str = textDecoder.decode(bytes);
+  if (str === 'undefined') {
+    return undefined;
+  }
+  return JSON.parse(str);
+}
+
+function decodeError(bytes: Uint8Array) {
+  const value = JSON.parse(textDecoder.decode(bytes));
+  const error = new XSSandboxError(value.message);
+  error.name = value.name;
+  error.stack = value.stack;
+  return error;
+}
+
+/**
+ * Create a pool of sandboxes restored from a template snapshot. See
+ * `SandboxPool`.
+ */
+export function createPool(opts: SandboxPoolOptions) {
+  return SandboxPool.create(opts, createInstance);
+}
+
+/**
+ * Start a pool of worker threads to run sandboxes on. See `AsyncSandboxPool`.
+ */
+export function createAsyncPool(opts?: AsyncSandboxPoolOptions) {
+  return AsyncSandboxPool.create(opts);
+}
+
+export default { create, restore, replay, analyzeSnapshot, createInstance, precompile, fromModule, createPool, createAsyncPool, CompiledScript, scriptCacheStats, clearScriptCache, ModuleRegistry, machineSizingPresets }
\ No newline at end of file
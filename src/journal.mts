@@ -0,0 +1,138 @@
+/*
+Journals of the inputs to a sandbox, for `XSSandbox.journal` and `replay`.
+
+A journal is a sequence of records, each a uint8 kind, then the uint32 length
+of its body, then the body. Integers are little-endian.
+
+- RECORD_INPUT: a call into the sandbox. The uint8 action of sandboxInput, the
+  float64 time of the call, then its payload.
+- RECORD_BATCH: a call to sendMessages. A uint8 which is 1 to drain promise
+  jobs after each message, the float64 time, then each payload prefixed by its
+  uint32 length.
+- RECORD_REPLY: the host's answer to a call from the guest during the last
+  input: its int32 result code, then its bytes. This covers replies to the
+  guest's `sendMessage` and `sendMessageAsync`, modules loaded for it, and
+  chunks of source read for `evaluateStream`.
+
+Calls the host makes into the sandbox while handling a call from the guest are
+recorded before the reply, so records nest in the same order as the calls.
+*/
+
+export const RECORD_INPUT = 1;
+export const RECORD_BATCH = 2;
+export const RECORD_REPLY = 3;
+
+const RECORD_HEADER_SIZE = 5;
+const textEncoder = new TextEncoder();
+
+export type JournalRecord =
+  | { kind: typeof RECORD_INPUT, action: number, time: number, payload: Uint8Array }
+  | { kind: typeof RECORD_BATCH, drainEach: boolean, time: number, payloads: Uint8Array[] }
+  | { kind: typeof RECORD_REPLY, code: number, bytes: Uint8Array };
+
+function toBytes(payload: Uint8Array | string) {
+  return typeof payload === 'string' ? textEncoder.encode(payload) : payload;
+}
+
+function newRecord(kind: number, bodySize: number): [Uint8Array, DataView] {
+  const record = new Uint8Array(RECORD_HEADER_SIZE + bodySize);
+  const view = new DataView(record.buffer);
+  record[0] = kind;
+  view.setUint32(1, bodySize, true);
+  return [record, view];
+}
+
+export function encodeInputRecord(action: number, time: number, payload: Uint8Array | string): Uint8Array {
+  const bytes = toBytes(payload);
+  const [record, view] = newRecord(RECORD_INPUT, 9 + bytes.length);
+  record[RECORD_HEADER_SIZE] = action;
+  view.setFloat64(RECORD_HEADER_SIZE + 1, time, true);
+  record.set(bytes, RECORD_HEADER_SIZE + 9);
+  return record;
+}
+
+export function encodeBatchRecord(drainEach: boolean, time: number, payloads: (Uint8Array | string)[]): Uint8Array {
+  const bytes = payloads.map(toBytes);
+  const size = bytes.reduce((size, payload) => size + 4 + payload.length, 9);
+  const [record, view] = newRecord(RECORD_BATCH, size);
+  record[RECORD_HEADER_SIZE] = drainEach ? 1 : 0;
+  view.setFloat64(RECORD_HEADER_SIZE + 1, time, true);
+  let offset = RECORD_HEADER_SIZE + 9;
+  for (const payload of bytes) {
+    view.setUint32(offset, payload.length, true);
+    record.set(payload, offset + 4);
+    offset += 4 + payload.length;
+  }
+  return record;
+}
+
+export function encodeReplyRecord(code: number, payload?: Uint8Array | string): Uint8Array {
+  const bytes = payload === undefined ? new Uint8Array(0) : toBytes(payload);
+  const [record, view] = newRecord(RECORD_REPLY, 4 + bytes.length);
+  view.setInt32(RECORD_HEADER_SIZE, code, true);
+  record.set(bytes, RECORD_HEADER_SIZE + 4);
+  return record;
+}
+
+/**
+ * Reads the records of a journal, given as one buffer or as a sequence of
+ * buffers each holding whole records (such as the records passed to a journal
+ * sink)
+ */
+export class JournalReader {
+  private iterator: Iterator<Uint8Array>;
+  private chunk = new Uint8Array(0);
+  private offset = 0;
+
+  constructor(journal: Uint8Array | Iterable<Uint8Array>) {
+    this.iterator = (journal instanceof Uint8Array ? [journal] : journal)[Symbol.iterator]();
+  }
+
+  /** The next record, or undefined at the end of the journal */
+  next(): JournalRecord | undefined {
+    while (this.offset === this.chunk.length) {
+      const next = this.iterator.next();
+      if (next.done) {
+        return undefined;
+      }
+      this.chunk = next.value;
+      this.offset = 0;
+    }
+    const chunk = this.chunk;
+    const view = new DataView(chunk.buffer, chunk.byteOffset, chunk.byteLength);
+    if (this.offset + RECORD_HEADER_SIZE > chunk.length) {
+      throw new Error('Corrupt journal');
+    }
+    const kind = chunk[this.offset];
+    const size = view.getUint32(this.offset + 1, true);
+    const start = this.offset + RECORD_HEADER_SIZE;
+    const end = start + size;
+    if (end > chunk.length) {
+      throw new Error('Corrupt journal');
+    }
+    this.offset = end;
+    switch (kind) {
+      case RECORD_INPUT:
+        return {
+          kind,
+          action: chunk[start],
+          time: view.getFloat64(start + 1, true),
+          payload: chunk.subarray(start + 9, end),
+        };
+      case RECORD_BATCH: {
+        const payloads: Uint8Array[] = [];
+        let offset = start + 9;
+        while (offset < end) {
+          const length = view.getUint32(offset, true);
+          payloads.push(chunk.subarray(offset + 4, offset + 4 + length));
+          offset += 4 + length;
+        }
+        return { kind, drainEach: chunk[start] !== 0, time: view.getFloat64(start + 1, true), payloads };
+      }
+      case RECORD_REPLY:
+        return { kind, code: view.getInt32(start, true), bytes: chunk.subarray(start + 4, end) };
+      default:
+        throw new Error('Corrupt journal');
+    }
+  }
+}
@@ -1,8 +1,34 @@
 addToLibrary({
-  sendMessage: function(ptr, len, outputPtrPtr, outputSizePtr) {
-    return Module.sendMessage(ptr, len, outputPtrPtr, outputSizePtr);
+  sendMessage: function(handle, ptr, len, outputPtrPtr, outputSizePtr) {
+    return Module.sendMessage(handle, ptr, len, outputPtrPtr, outputSizePtr);
   },
-  consoleLog: function(args, len, level) {
-    return Module.consoleLog(args, len, level);
+  sendMessageAsync: function(handle, id, ptr, len, outputPtrPtr, outputSizePtr) {
+    return Module.sendMessageAsync(handle, id, ptr, len, outputPtrPtr, outputSizePtr);
   },
+  consoleLog: function(handle, args, len, level) {
+    return Module.consoleLog(handle, args, len, level);
+  },
+  snapshotOutput: function(handle, ptr, len) {
+    return Module.snapshotOutput(handle, ptr, len);
+  },
+  readSource: function(handle, ptr, len) {
+    return Module.readSource(handle, ptr, len);
+  },
+  loadModule: function(handle, specifier, specifierLength, outputPtrPtr, outputSizePtr) {
+    return Module.loadModule(handle, specifier, specifierLength, outputPtrPtr, outputSizePtr);
+  },
+  moduleCompiled: function(handle, specifier, specifierLength, ptr, len) {
+    return Module.moduleCompiled(handle, specifier, specifierLength, ptr, len);
+  },
+  hostNow: function() {
+    return Module.hostNow();
+  },
+#if ASYNCIFY
+  // Unwinds the C stack, and gives the host a function that rewinds it to
+  // resume the call
+  suspendGuest__deps: ['$Asyncify'],
+  suspendGuest: function(handle) {
+    return Asyncify.handleSleep(wakeUp => Module.suspendGuest(handle, wakeUp));
+  },
+#endif
 });
\ No newline at end of file
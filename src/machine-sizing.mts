@@ -0,0 +1,118 @@
+/**
+ * The memory parameters of a new sandbox's XS machine. Slots are 16 bytes in
+ * the WASM build, and chunks hold strings, bytecode, array storage, etc.
+ */
+export interface MachineSizing {
+  /** Bytes of chunk memory allocated up front */
+  initialChunkSize: number;
+  /** Bytes of chunk memory added each time the chunk heap is full */
+  incrementalChunkSize: number;
+  /** Number of slots allocated up front */
+  initialHeapCount: number;
+  /** Number of slots added each time the slot heap is full */
+  incrementalHeapCount: number;
+  /** Number of slots in the stack, which bounds the recursion depth */
+  stackCount: number;
+  /** Number of keys (property names and symbols) allocated up front */
+  initialKeyCount: number;
+  /** Number of keys added each time the key table is full */
+  incrementalKeyCount: number;
+  /** Number of buckets in the property name hash table */
+  nameModulo: number;
+  /** Number of buckets in the symbol hash table */
+  symbolModulo: number;
+  /** Bytes in each block of memory used while parsing */
+  parserBufferSize: number;
+  /** Number of buckets in the parser's symbol hash table */
+  parserTableModulo: number;
+}
+
+/**
+ * Named sizings for `XSSandboxOptions.sizing`:
+ *
+ * - `'tiny'`: for many small sandboxes running short scripts. The machine
+ *   starts small and grows in small steps, and the stack is shallow.
+ * - `'default'`: suits most uses.
+ * - `'large'`: for sandboxes with large heaps, which would otherwise spend
+ *   time growing in small steps.
+ */
+export type MachineSizingPreset = 'tiny' | 'default' | 'large';
+
+export const machineSizingPresets: Record<MachineSizingPreset, MachineSizing> = {
+  tiny: {
+    initialChunkSize: 32 * 1024,
+    incrementalChunkSize: 32 * 1024,
+    initialHeapCount: 8 * 1024,
+    incrementalHeapCount: 2 * 1024,
+    stackCount: 1024,
+    initialKeyCount: 256,
+    incrementalKeyCount: 256,
+    nameModulo: 127,
+    symbolModulo: 31,
+    parserBufferSize: 64 * 1024,
+    parserTableModulo: 127,
+  },
+  default: {
+    initialChunkSize: 256 * 1024,
+    incrementalChunkSize: 256 * 1024,
+    initialHeapCount: 32 * 1024,
+    incrementalHeapCount: 8 * 1024,
+    stackCount: 4 * 1024,
+    initialKeyCount: 4 * 1024,
+    incrementalKeyCount: 4 * 1024,
+    nameModulo: 1993,
+    symbolModulo: 127,
+    parserBufferSize: 1024 * 1024,
+    parserTableModulo: 1993,
+  },
+  large: {
+    initialChunkSize: 4 * 1024 * 1024,
+    incrementalChunkSize: 1024 * 1024,
+    initialHeapCount: 256 * 1024,
+    incrementalHeapCount: 64 * 1024,
+    stackCount: 16 * 1024,
+    initialKeyCount: 32 * 1024,
+    incrementalKeyCount: 8 * 1024,
+    nameModulo: 8191,
+    symbolModulo: 509,
+    parserBufferSize: 4 * 1024 * 1024,
+    parserTableModulo: 8191,
+  },
+};
+
+// The order of the fields in TsMachineSizing (xs_sandbox.h)
+const MACHINE_SIZING_FIELDS: (keyof MachineSizing)[] = [
+  'initialChunkSize',
+  'incrementalChunkSize',
+  'initialHeapCount',
+  'incrementalHeapCount',
+  'stackCount',
+  'initialKeyCount',
+  'incrementalKeyCount',
+  'nameModulo',
+  'symbolModulo',
+  'parserBufferSize',
+  'parserTableModulo',
+];
+
+/**
+ * Encode a sizing as the TsMachineSizing struct expected by initMachine.
+ * Fields that aren't given come from the default preset.
+ */
+export function encodeMachineSizing(sizing: MachineSizingPreset | Partial<MachineSizing>): Uint8Array {
+  const full = typeof sizing === 'string'
+    ? machineSizingPresets[sizing]
+    : { ...machineSizingPresets.default, ...sizing };
+  if (!full) {
+    throw new Error(`Unknown sizing preset ${sizing}`);
+  }
+  const values = new Int32Array(MACHINE_SIZING_FIELDS.length);
+  MACHINE_SIZING_FIELDS.forEach((field, i) => {
+    const value = full[field];
+    if (!Number.isInteger(value) || value < 1 || value > 0x7FFFFFFF) {
+      throw new RangeError(`Invalid sizing ${field}: ${value}`);
+    }
+    values[i] = value;
+  });
+  return new Uint8Array(values.buffer);
+}
@@ -0,0 +1,93 @@
+/*
+Raw memory images of a sandbox, for `XSSandbox.memoryImage`.
+
+An image is a copy of the linear memory of the sandbox's instance, up to the
+break. Every pointer in it is an address in that memory, including the table of
+sandboxes and their machines, so loading it into a fresh instance of the same
+engine build brings the sandbox back as it was, without the heap walk and
+relinking of a snapshot. The build hash identifies the engine build, since any
+other build lays out memory differently.
+
+The format is the signature, then the build hash (uint8 length, then ASCII),
+then the uint32 handle of the sandbox, the uint32 number of other sandboxes in
+the instance and their handles, and finally the uint32 memory size and the
+memory. Integers are little-endian.
+*/
+
+const SIGNATURE = 'xs-sandbox-image-1';
+const textEncoder = new TextEncoder();
+const textDecoder = new TextDecoder();
+
+export interface MemoryImage {
+  buildHash: string;
+  handle: number;
+  // The other sandboxes in the instance, which are deleted when the image is
+  // loaded
+  others: number[];
+  memory: Uint8Array;
+}
+
+export function isMemoryImage(bytes: Uint8Array) {
+  if (bytes.length < SIGNATURE.length) {
+    return false;
+  }
+  for (let i = 0; i < SIGNATURE.length; i++) {
+    if (bytes[i] !== SIGNATURE.charCodeAt(i)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+export function encodeMemoryImage(image: MemoryImage): Uint8Array {
+  const hash = textEncoder.encode(image.buildHash);
+  const headerSize = SIGNATURE.length + 1 + hash.length + 8 + image.others.length * 4 + 4;
+  const bytes = new Uint8Array(headerSize + image.memory.length);
+  const view = new DataView(bytes.buffer);
+  let offset = textEncoder.encodeInto(SIGNATURE, bytes).written!;
+  bytes[offset++] = hash.length;
+  bytes.set(hash, offset);
+  offset += hash.length;
+  view.setUint32(offset, image.handle, true);
+  view.setUint32(offset + 4, image.others.length, true);
+  offset += 8;
+  for (const other of image.others) {
+    view.setUint32(offset, other, true);
+    offset += 4;
+  }
+  view.setUint32(offset, image.memory.length, true);
+  bytes.set(image.memory, offset + 4);
+  return bytes;
+}
+
+/**
+ * Decode an image. The memory is a view into `bytes`.
+ */
+export function decodeMemoryImage(bytes: Uint8Array): MemoryImage {
+  if (!isMemoryImage(bytes)) {
+    throw new Error('Not a memory image');
+  }
+  const view = new DataView(bytes.buffer, bytes.byteOffset, bytes.byteLength);
+  try {
+    let offset = SIGNATURE.length;
+    const hashLength = bytes[offset++];
+    const buildHash = textDecoder.decode(bytes.subarray(offset, offset + hashLength));
+    offset += hashLength;
+    const handle = view.getUint32(offset, true);
+    const count = view.getUint32(offset + 4, true);
+    offset += 8;
+    const others: number[] = [];
+    for (let i = 0; i < count; i++) {
+      others.push(view.getUint32(offset, true));
+      offset += 4;
+    }
+    const size = view.getUint32(offset, true);
+    offset += 4;
+    if (offset + size > bytes.length) {
+      throw new RangeError();
+    }
+    return { buildHash, handle, others, memory: bytes.subarray(offset, offset + size) };
+  } catch {
+    throw new Error('Corrupt memory image');
+  }
+}
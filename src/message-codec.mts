@@ -0,0 +1,489 @@
+/*
+ * Binary message format, used by sandboxes created with
+ * `messageFormat: 'binary'`. The guest side of the codec is
+ * `xs_sandbox_message.c` and the two must be kept in sync.
+ *
+ * A message is a single value. Each value is a tag byte followed by its
+ * payload. Numbers are little-endian, and lengths and counts are unsigned
+ * LEB128 varints. Strings are a varint byte length then WTF-8: UTF-8, except
+ * that lone surrogates are encoded like other code points, so that any string
+ * survives the trip.
+ *
+ *   0  undefined (also functions and symbols, like JSON.stringify)
+ *   1  null
+ *   2  false
+ *   3  true
+ *   4  int32
+ *   5  float64
+ *   6  string
+ *   7  bigint: decimal string
+ *   8  array: length, then the elements
+ *   9  object: count, then (string key, value) pairs for own enumerable keys
+ *   10 Date: float64 time value
+ *   11 Map: count, then (key, value) pairs
+ *   12 Set: count, then the values
+ *   13 ArrayBuffer: byte length, then the bytes
+ *   14 typed array or DataView: kind byte (index in TYPED_ARRAYS), byte
+ *      length, then the bytes
+ *   15 Error: name (string), then message and stack values
+ *   16 reference: varint index of an object earlier in the message
+ *
+ * Objects (tags 8 to 15) are numbered in the order they are first encountered,
+ * and repeat occurrences are encoded as references, so shared and cyclic
+ * structures survive the trip.
+ */
+
+const TAG_UNDEFINED = 0;
+const TAG_NULL = 1;
+const TAG_FALSE = 2;
+const TAG_TRUE = 3;
+const TAG_INT32 = 4;
+const TAG_FLOAT64 = 5;
+const TAG_STRING = 6;
+const TAG_BIGINT = 7;
+const TAG_ARRAY = 8;
+const TAG_OBJECT = 9;
+const TAG_DATE = 10;
+const TAG_MAP = 11;
+const TAG_SET = 12;
+const TAG_ARRAY_BUFFER = 13;
+const TAG_TYPED_ARRAY = 14;
+const TAG_ERROR = 15;
+const TAG_REFERENCE = 16;
+
+const TYPED_ARRAYS = [
+  'Int8Array',
+  'Uint8Array',
+  'Uint8ClampedArray',
+  'Int16Array',
+  'Uint16Array',
+  'Int32Array',
+  'Uint32Array',
+  'Float32Array',
+  'Float64Array',
+  'BigInt64Array',
+  'BigUint64Array',
+  'DataView',
+];
+
+const ERROR_CONSTRUCTORS = new Map<string, ErrorConstructor>([
+  ['Error', Error],
+  ['EvalError', EvalError],
+  ['RangeError', RangeError],
+  ['ReferenceError', ReferenceError],
+  ['SyntaxError', SyntaxError],
+  ['TypeError', TypeError],
+  ['URIError', URIError],
+]);
+
+const textEncoder = new TextEncoder();
+// Throws on lone surrogates, which need decodeWTF8, and keeps a leading BOM as
+// part of the string
+const textDecoder = new TextDecoder('utf-8', { fatal: true, ignoreBOM: true });
+
+// Whether a string has no lone surrogates, so it can be encoded as UTF-8
+const isWellFormed: (value: string) => boolean = (String.prototype as any).isWellFormed
+  ? value => (value as any).isWellFormed()
+  : value => !/\p{Cs}/u.test(value);
+
+export function encodeMessage(value: unknown): Uint8Array {
+  const writer = new Writer();
+  writer.value(value);
+  return writer.finish();
+}
+
+export function decodeMessage(bytes: Uint8Array): any {
+  const reader = new Reader(bytes);
+  const value = reader.value();
+  if (!reader.atEnd) {
+    throw new Error('Corrupt message');
+  }
+  return value;
+}
+
+class Writer {
+  private bytes = new Uint8Array(256);
+  private view = new DataView(this.bytes.buffer);
+  private length = 0;
+  private objects = new Map<object, number>();
+
+  finish() {
+    return this.bytes.subarray(0, this.length);
+  }
+
+  value(value: unknown) {
+    switch (typeof value) {
+      case 'undefined': this.byte(TAG_UNDEFINED); break;
+      case 'boolean': this.byte(value ? TAG_TRUE : TAG_FALSE); break;
+      case 'number': this.number(value); break;
+      case 'string': this.byte(TAG_STRING); this.string(value); break;
+      case 'bigint': this.byte(TAG_BIGINT); this.string(value.toString()); break;
+      case 'object': value === null ? this.byte(TAG_NULL) : this.object(value); break;
+      default: this.byte(TAG_UNDEFINED); break;
+    }
+  }
+
+  private object(value: object) {
+    const index = this.objects.get(value);
+    if (index !== undefined) {
+      this.byte(TAG_REFERENCE);
+      this.varint(index);
+      return;
+    }
+    this.objects.set(value, this.objects.size);
+
+    if (Array.isArray(value)) {
+      this.byte(TAG_ARRAY);
+      this.varint(value.length);
+      for (let i = 0; i < value.length; i++) {
+        this.value(value[i]);
+      }
+    } else if (value instanceof Date) {
+      this.byte(TAG_DATE);
+      this.float64(value.getTime());
+    } else if (value instanceof Map) {
+      this.byte(TAG_MAP);
+      this.varint(value.size);
+      for (const [k, v] of value) {
+        this.value(k);
+        this.value(v);
+      }
+    } else if (value instanceof Set) {
+      this.byte(TAG_SET);
+      this.varint(value.size);
+      for (const v of value) {
+        this.value(v);
+      }
+    } else if (value instanceof ArrayBuffer) {
+      this.byte(TAG_ARRAY_BUFFER);
+      this.bytesWithLength(new Uint8Array(value));
+    } else if (ArrayBuffer.isView(value)) {
+      // "[object Uint8Array]", etc.
+      const kind = TYPED_ARRAYS.indexOf(Object.prototype.toString.call(value).slice(8, -1));
+      if (kind < 0) {
+        throw new TypeError('Unsupported typed array');
+      }
+      this.byte(TAG_TYPED_ARRAY);
+      this.byte(kind);
+      this.bytesWithLength(new Uint8Array(value.buffer, value.byteOffset, value.byteLength));
+    } else if (value instanceof Error) {
+      this.byte(TAG_ERROR);
+      this.string(String(value.name));
+      this.value(value.message);
+      this.value(value.stack);
+    } else {
+      const keys = Object.keys(value);
+      this.byte(TAG_OBJECT);
+      this.varint(keys.length);
+      for (const key of keys) {
+        this.string(key);
+        this.value((value as any)[key]);
+      }
+    }
+  }
+
+  private number(value: number) {
+    if ((value | 0) === value && !Object.is(value, -0)) {
+      this.byte(TAG_INT32);
+      this.reserve(4);
+      this.view.setInt32(this.length, value, true);
+      this.length += 4;
+    } else {
+      this.byte(TAG_FLOAT64);
+      this.float64(value);
+    }
+  }
+
+  private float64(value: number) {
+    this.reserve(8);
+    this.view.setFloat64(this.length, value, true);
+    this.length += 8;
+  }
+
+  private string(value: string) {
+    // Short strings are encoded in place. A UTF-8 encoding is at most 3 bytes
+    // per UTF-16 unit, so under 128 bytes the length prefix is one byte.
+    if (!isWellFormed(value)) {
+      this.bytesWithLength(encodeWTF8(value));
+    } else if (value.length * 3 < 128) {
+      this.reserve(1 + value.length * 3);
+      const { written } = textEncoder.encodeInto(value, this.bytes.subarray(this.length + 1));
+      this.bytes[this.length] = written!;
+      this.length += 1 + written!;
+    } else {
+      this.bytesWithLength(textEncoder.encode(value));
+    }
+  }
+
+  private bytesWithLength(bytes: Uint8Array) {
+    this.varint(bytes.length);
+    this.reserve(bytes.length);
+    this.bytes.set(bytes, this.length);
+    this.length += bytes.length;
+  }
+
+  private byte(value: number) {
+    this.reserve(1);
+    this.bytes[this.length++] = value;
+  }
+
+  private varint(value: number) {
+    do {
+      const byte = value % 128;
+      value = Math.floor(value / 128);
+      this.byte(value ? byte | 0x80 : byte);
+    } while (value);
+  }
+
+  private reserve(size: number) {
+    if (this.length + size <= this.bytes.length) {
+      return;
+    }
+    let capacity = this.bytes.length * 2;
+    while (capacity < this.length + size) {
+      capacity *= 2;
+    }
+    const bytes = new Uint8Array(capacity);
+    bytes.set(this.bytes.subarray(0, this.length));
+    this.bytes = bytes;
+    this.view = new DataView(bytes.buffer);
+  }
+}
+
+class Reader {
+  private view: DataView;
+  private offset = 0;
+  private objects: object[] = [];
+
+  constructor(private bytes: Uint8Array) {
+    this.view = new DataView(bytes.buffer, bytes.byteOffset, bytes.byteLength);
+  }
+
+  get atEnd() {
+    return this.offset === this.bytes.length;
+  }
+
+  value(): any {
+    const tag = this.byte();
+    switch (tag) {
+      case TAG_UNDEFINED: return undefined;
+      case TAG_NULL: return null;
+      case TAG_FALSE: return false;
+      case TAG_TRUE: return true;
+      case TAG_INT32: {
+        this.check(4);
+        const value = this.view.getInt32(this.offset, true);
+        this.offset += 4;
+        return value;
+      }
+      case TAG_FLOAT64: return this.float64();
+      case TAG_STRING: return this.string();
+      case TAG_BIGINT: return BigInt(this.string());
+      case TAG_REFERENCE: {
+        const index = this.varint();
+        if (index >= this.objects.length) {
+          throw new Error('Corrupt message');
+        }
+        return this.objects[index];
+      }
+      case TAG_ARRAY: {
+        const length = this.count();
+        const array = new Array(length);
+        this.objects.push(array);
+        for (let i = 0; i < length; i++) {
+          array[i] = this.value();
+        }
+        return array;
+      }
+      case TAG_OBJECT: {
+        const count = this.count();
+        const object: any = {};
+        this.objects.push(object);
+        for (let i = 0; i < count; i++) {
+          const key = this.string();
+          const value = this.value();
+          if (key === '__proto__') {
+            Object.defineProperty(object, key, { value, writable: true, enumerable: true, configurable: true });
+          } else {
+            object[key] = value;
+          }
+        }
+        return object;
+      }
+      case TAG_DATE: {
+        const date = new Date(this.float64());
+        this.objects.push(date);
+        return date;
+      }
+      case TAG_MAP: {
+        const size = this.count();
+        const map = new Map();
+        this.objects.push(map);
+        for (let i = 0; i < size; i++) {
+          const key = this.value();
+          map.set(key, this.value());
+        }
+        return map;
+      }
+      case TAG_SET: {
+        const size = this.count();
+        const set = new Set();
+        this.objects.push(set);
+        for (let i = 0; i < size; i++) {
+          set.add(this.value());
+        }
+        return set;
+      }
+      case TAG_ARRAY_BUFFER: {
+        const buffer = this.bytesWithLength().slice().buffer;
+        this.objects.push(buffer);
+        return buffer;
+      }
+      case TAG_TYPED_ARRAY: {
+        const name = TYPED_ARRAYS[this.byte()];
+        if (!name) {
+          throw new Error('Corrupt message');
+        }
+        const buffer = this.bytesWithLength().slice().buffer;
+        const array = new (globalThis as any)[name](buffer);
+        this.objects.push(array);
+        return array;
+      }
+      case TAG_ERROR: {
+        const name = this.string();
+        const constructor = ERROR_CONSTRUCTORS.get(name);
+        const error = constructor ? new constructor() : new Error();
+        if (!constructor) {
+          error.name = name;
+        }
+        this.objects.push(error);
+        error.message = this.value();
+        const stack = this.value();
+        if (stack !== undefined) {
+          error.stack = stack;
+        }
+        return error;
+      }
+      default:
+        throw new Error('Corrupt message');
+    }
+  }
+
+  private float64() {
+    this.check(8);
+    const value = this.view.getFloat64(this.offset, true);
+    this.offset += 8;
+    return value;
+  }
+
+  private string() {
+    const bytes = this.bytesWithLength();
+    try {
+      return textDecoder.decode(bytes);
+    } catch {
+      return decodeWTF8(bytes);
+    }
+  }
+
+  private bytesWithLength() {
+    const length = this.varint();
+    this.check(length);
+    const bytes = this.bytes.subarray(this.offset, this.offset + length);
+    this.offset += length;
+    return bytes;
+  }
+
+  // Every element takes at least one byte, so a count can't be more than
+  // what's left of the message
+  private count() {
+    const count = this.varint();
+    this.check(count);
+    return count;
+  }
+
+  private byte() {
+    this.check(1);
+    return this.bytes[this.offset++];
+  }
+
+  private varint() {
+    let value = 0;
+    let scale = 1;
+    for (;;) {
+      const byte = this.byte();
+      value += (byte & 0x7F) * scale;
+      if (!(byte & 0x80)) {
+        return value;
+      }
+      scale *= 128;
+      if (scale > Number.MAX_SAFE_INTEGER) {
+        throw new Error('Corrupt message');
+      }
+    }
+  }
+
+  private check(size: number) {
+    if (size > this.bytes.length - this.offset) {
+      throw new Error('Corrupt message');
+    }
+  }
+}
+
+// UTF-8, with lone surrogates encoded as if they were characters
+function encodeWTF8(value: string) {
+  const bytes = new Uint8Array(value.length * 3);
+  let length = 0;
+  for (let i = 0; i < value.length; i++) {
+    let c = value.charCodeAt(i);
+    if (c >= 0xD800 && c < 0xDC00 && i + 1 < value.length) {
+      const next = value.charCodeAt(i + 1);
+      if (next >= 0xDC00 && next < 0xE000) {
+        c = 0x10000 + ((c - 0xD800) << 10) + (next - 0xDC00);
+        i++;
+      }
+    }
+    if (c < 0x80) {
+      bytes[length++] = c;
+    } else if (c < 0x800) {
+      bytes[length++] = 0xC0 | (c >> 6);
+      bytes[length++] = 0x80 | (c & 0x3F);
+    } else if (c < 0x10000) {
+      bytes[length++] = 0xE0 | (c >> 12);
+      bytes[length++] = 0x80 | ((c >> 6) & 0x3F);
+      bytes[length++] = 0x80 | (c & 0x3F);
+    } else {
+      bytes[length++] = 0xF0 | (c >> 18);
+      bytes[length++] = 0x80 | ((c >> 12) & 0x3F);
+      bytes[length++] = 0x80 | ((c >> 6) & 0x3F);
+      bytes[length++] = 0x80 | (c & 0x3F);
+    }
+  }
+  return bytes.subarray(0, length);
+}
+
+function decodeWTF8(bytes: Uint8Array) {
+  let result = '';
+  let i = 0;
+  while (i < bytes.length) {
+    const b = bytes[i];
+    let c: number;
+    if (b < 0x80) {
+      c = b;
+      i += 1;
+    } else if (b < 0xE0) {
+      c = ((b & 0x1F) << 6) | (bytes[i + 1] & 0x3F);
+      i += 2;
+    } else if (b < 0xF0) {
+      c = ((b & 0x0F) << 12) | ((bytes[i + 1] & 0x3F) << 6) | (bytes[i + 2] & 0x3F);
+      i += 3;
+    } else {
+      c = ((b & 0x07) << 18) | ((bytes[i + 1] & 0x3F) << 12) | ((bytes[i + 2] & 0x3F) << 6) | (bytes[i + 3] & 0x3F);
+      i += 4;
+    }
+    if (i > bytes.length || c > 0x10FFFF) {
+      throw new Error('Corrupt message');
+    }
+    result += String.fromCodePoint(c);
+  }
+  return result;
+}
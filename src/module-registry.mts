@@ -0,0 +1,120 @@
+import { CompiledScript } from './compiled-script.mjs';
+
+/**
+ * A module in a `ModuleRegistry`: either its source text, or its bytecode from
+ * `sandbox.compile(source, { module: true })`.
+ */
+export type ModuleSource = string | CompiledScript;
+
+export interface ModuleRegistryStats {
+  /** Number of times a sandbox has loaded a module from the registry */
+  loads: number;
+  /** Number of modules compiled from source */
+  compiles: number;
+}
+
+/**
+ * A map of module IDs to modules, from which sandboxes load ES modules when
+ * they are first imported. Modules that are never imported cost nothing but
+ * their source.
+ *
+ * Module IDs are paths separated by "/", like `"lib/math.js"`. Imports of
+ * `"./x.js"` and `"../x.js"` are resolved relative to the ID of the importing
+ * module (or the root, when imported from a script), and any other specifier is
+ * used as the ID.
+ *
+ * A module given as source is compiled the first time a sandbox imports it, and
+ * the compiled module is kept, so any number of sandboxes (in any instance) can
+ * share the registry and only the first to import a module pays to compile it.
+ */
+export class ModuleRegistry {
+  private modules = new Map<string, ModuleSource>();
+  private compiledModules = new Map<string, CompiledScript>();
+  private _stats = { loads: 0, compiles: 0 };
+
+  constructor(modules?: Record<string, ModuleSource>) {
+    for (const [id, module] of Object.entries(modules ?? {})) {
+      this.set(id, module);
+    }
+  }
+
+  /**
+   * Add or replace a module. Sandboxes that have already imported the module
+   * keep the previous one.
+   */
+  set(id: string, module: ModuleSource) {
+    const normalized = normalizeId(id);
+    if (normalized === undefined) {
+      throw new Error(`Invalid module ID: ${JSON.stringify(id)}`);
+    }
+    this.modules.set(normalized, module);
+    this.compiledModules.delete(normalized);
+    return this;
+  }
+
+  get(id: string): ModuleSource | undefined {
+    const normalized = normalizeId(id);
+    return normalized === undefined ? undefined : this.modules.get(normalized);
+  }
+
+  has(id: string) {
+    const normalized = normalizeId(id);
+    return normalized !== undefined && this.modules.has(normalized);
+  }
+
+  delete(id: string) {
+    const normalized = normalizeId(id);
+    if (normalized === undefined) {
+      return false;
+    }
+    this.compiledModules.delete(normalized);
+    return this.modules.delete(normalized);
+  }
+
+  get ids() {
+    return [...this.modules.keys()];
+  }
+
+  get stats(): ModuleRegistryStats {
+    return { ...this._stats };
+  }
+
+  /** @internal */
+  load(id: string): ModuleSource | undefined {
+    const module = this.compiledModules.get(id) ?? this.modules.get(id);
+    if (module !== undefined) {
+      this._stats.loads++;
+    }
+    return module;
+  }
+
+  /** @internal */
+  compiled(id: string, script: CompiledScript) {
+    if (typeof this.modules.get(id) === 'string') {
+      this.compiledModules.set(id, script);
+      this._stats.compiles++;
+    }
+  }
+}
+
+// The same normalization as module IDs resolved by the guest (fxFindModule), so
+// that e.g. "/lib/x.js", "lib/x.js" and "lib/../lib/x.js" are the same module.
+// Returns undefined for an ID that no import can resolve to: one that's empty or
+// goes above the root.
+function normalizeId(id: string): string | undefined {
+  const segments: string[] = [];
+  for (const segment of id.split('/')) {
+    if (segment === '' || segment === '.') {
+      continue;
+    }
+    if (segment === '..') {
+      if (segments.length === 0) {
+        return undefined;
+      }
+      segments.pop();
+    } else {
+      segments.push(segment);
+    }
+  }
+  return segments.length ? segments.join('/') : undefined;
+}
@@ -0,0 +1,172 @@
+export interface ProfilingOptions {
+  /**
+   * The number of meter units between samples of the guest's call stack. The
+   * default is 1000. Smaller intervals give more detail but slow the guest
+   * down more.
+   */
+  sampleInterval?: number;
+}
+
+/**
+ * A frame of a sampled call stack
+ */
+export interface ProfileFrame {
+  functionName: string;
+  /** The file name given when the script was compiled, if any */
+  url?: string;
+  /** 1-based */
+  lineNumber?: number;
+}
+
+export interface ProfileSample {
+  /** Outermost frame first */
+  stack: ProfileFrame[];
+  /** The meter value when the sample was taken */
+  meter: number;
+}
+
+/**
+ * A profile in the Chrome DevTools `.cpuprofile` format. Time is measured in
+ * meter units rather than microseconds.
+ */
+export interface CpuProfile {
+  nodes: CpuProfileNode[];
+  startTime: number;
+  endTime: number;
+  samples: number[];
+  timeDeltas: number[];
+}
+
+export interface CpuProfileNode {
+  id: number;
+  callFrame: {
+    functionName: string;
+    scriptId: string;
+    url: string;
+    lineNumber: number;
+    columnNumber: number;
+  };
+  hitCount: number;
+  children: number[];
+}
+
+/**
+ * The samples taken between `startProfiling` and `stopProfiling`
+ */
+export class Profile {
+  /** @internal */
+  constructor(
+    readonly samples: ProfileSample[],
+    /** Samples that were dropped because the profile grew too large */
+    readonly dropped: number,
+  ) {
+  }
+
+  /** @internal */
+  static parse(text: string, dropped: number) {
+    const samples: ProfileSample[] = [];
+    for (const line of text.split('\n')) {
+      const space = line.indexOf(' ');
+      if (space < 0) {
+        continue;
+      }
+      const stack = line.slice(space + 1);
+      samples.push({
+        meter: Number(line.slice(0, space)),
+        stack: stack ? stack.split(';').map(parseFrame) : [],
+      });
+    }
+    return new Profile(samples, dropped);
+  }
+
+  /**
+   * The profile in the collapsed-stack format used by flame graph tools (e.g.
+   * flamegraph.pl and speedscope): one line per distinct stack, with its frames
+   * separated by ";" followed by the number of samples.
+   */
+  toCollapsed(): string {
+    const counts = new Map<string, number>();
+    for (const sample of this.samples) {
+      const key = sample.stack.map(formatFrame).join(';');
+      counts.set(key, (counts.get(key) ?? 0) + 1);
+    }
+    let result = '';
+    for (const [stack, count] of counts) {
+      result += `${stack || '(idle)'} ${count}\n`;
+    }
+    return result;
+  }
+
+  /**
+   * The profile as a `.cpuprofile`, which can be loaded into Chrome DevTools,
+   * VS Code or speedscope. Serialize it with `JSON.stringify`.
+   */
+  toCpuProfile(): CpuProfile {
+    const root: CpuProfileNode = newNode(1, { functionName: '(root)' });
+    const nodes = [root];
+    // Children of each node by frame, to merge identical paths
+    const childIndex = new Map<CpuProfileNode, Map<string, CpuProfileNode>>();
+    const samples: number[] = [];
+    const timeDeltas: number[] = [];
+    let lastMeter = 0;
+
+    for (const sample of this.samples) {
+      let node = root;
+      for (const frame of sample.stack) {
+        let children = childIndex.get(node);
+        if (!children) {
+          children = new Map();
+          childIndex.set(node, children);
+        }
+        const key = formatFrame(frame);
+        let child = children.get(key);
+        if (!child) {
+          child = newNode(nodes.length + 1, frame);
+          nodes.push(child);
+          children.set(key, child);
+          node.children.push(child.id);
+        }
+        node = child;
+      }
+      node.hitCount++;
+      samples.push(node.id);
+      // The meter restarts with each call into the sandbox
+      timeDeltas.push(sample.meter >= lastMeter ? sample.meter - lastMeter : sample.meter);
+      lastMeter = sample.meter;
+    }
+
+    const endTime = timeDeltas.reduce((a, b) => a + b, 0);
+    return { nodes, startTime: 0, endTime, samples, timeDeltas };
+  }
+}
+
+function newNode(id: number, frame: ProfileFrame): CpuProfileNode {
+  return {
+    id,
+    callFrame: {
+      functionName: frame.functionName,
+      scriptId: '0',
+      url: frame.url ?? '',
+      // 0-based in .cpuprofile
+      lineNumber: frame.lineNumber !== undefined ? frame.lineNumber - 1 : -1,
+      columnNumber: -1,
+    },
+    hitCount: 0,
+    children: [],
+  };
+}
+
+// The inverse of the frame description in fxDescribeStack (wedge.c)
+function parseFrame(text: string): ProfileFrame {
+  const match = /^(.*) \((.*):(\d+)\)$/.exec(text);
+  if (match) {
+    return { functionName: match[1], url: match[2], lineNumber: Number(match[3]) };
+  }
+  return { functionName: text };
+}
+
+function formatFrame(frame: ProfileFrame) {
+  return frame.url !== undefined
+    ? `${frame.functionName} (${frame.url}:${frame.lineNumber})`
+    : frame.functionName;
+}
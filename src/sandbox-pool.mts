@@ -0,0 +1,230 @@
+import type { XSSandbox, XSSandboxInstance, RestoreOptions } from './index.mjs';
+
+/**
+ * When the pool restores replacement sandboxes:
+ *
+ * - `'idle'` (default): one at a time in idle callbacks (`requestIdleCallback`
+ *   in the browser, `setImmediate` in Node), so refilling doesn't hold up
+ *   other work.
+ * - `'immediate'`: as soon as a sandbox is taken.
+ * - `'manual'`: only when `refill()` is called.
+ * - A function, which is called with `refill` whenever the pool drops below its
+ *   target size, and can call it whenever it chooses.
+ */
+export type SandboxPoolRefillPolicy =
+  | 'idle'
+  | 'immediate'
+  | 'manual'
+  | ((refill: () => void) => void);
+
+export interface SandboxPoolOptions extends RestoreOptions {
+  /**
+   * The snapshot that sandboxes in the pool are restored from
+   */
+  template: Uint8Array;
+
+  /**
+   * The number of ready sandboxes to keep in the pool. The default is 4.
+   */
+  size?: number;
+
+  /**
+   * The maximum number of sandboxes to pack into each WASM instance. The
+   * default is 64.
+   */
+  sandboxesPerInstance?: number;
+
+  /**
+   * The default is `'idle'`.
+   */
+  refill?: SandboxPoolRefillPolicy;
+
+  /**
+   * Called when restoring a sandbox to refill the pool in the background
+   * fails. The pool tries again the next time a sandbox is taken. By default
+   * the error is ignored, and `acquire` throws it if it has to restore a
+   * sandbox on demand.
+   */
+  onRefillError?: (error: unknown) => void;
+}
+
+export interface SandboxPoolStats {
+  /** Number of `acquire` calls served from the pool */
+  hits: number;
+  /** Number of `acquire` calls that had to restore a sandbox on demand */
+  misses: number;
+  /** Number of sandboxes currently ready in the pool */
+  ready: number;
+  /** Total number of sandboxes restored by the pool */
+  restored: number;
+}
+
+/**
+ * A pool of sandboxes restored ahead of time from a template snapshot, so that
+ * handing one out doesn't pay for instantiation or snapshot restore.
+ *
+ * Sandboxes handed out by the pool belong to the caller and are never returned
+ * to the pool (they have been modified, so they can't be reused). Call
+ * `dispose` on them when done, so the memory can be reused by the pool.
+ */
+export class SandboxPool {
+  private ready: XSSandbox[] = [];
+  private instances: XSSandboxInstance[] = [];
+  private size: number;
+  private sandboxesPerInstance: number;
+  private refillPolicy: SandboxPoolRefillPolicy;
+  private refillScheduled = false;
+  // The restore in progress to refill the pool, if any. Refills share it, so
+  // that they don't each fill the same gap and overshoot the target size.
+  private restoring?: Promise<void>;
+  private closed = false;
+  private _stats = { hits: 0, misses: 0, restored: 0 };
+
+  private constructor(private opts: SandboxPoolOptions, private createInstance: () => Promise<XSSandboxInstance>) {
+    this.size = opts.size ?? 4;
+    this.sandboxesPerInstance = opts.sandboxesPerInstance ?? 64;
+    this.refillPolicy = opts.refill ?? 'idle';
+  }
+
+  /**
+   * Create a pool and fill it to its target size, with instances from
+   * `createInstance`. See `createPool`.
+   * @internal
+   */
+  static async create(opts: SandboxPoolOptions, createInstance: () => Promise<XSSandboxInstance>) {
+    const pool = new SandboxPool(opts, createInstance);
+    while (pool.ready.length < pool.size) {
+      pool.ready.push(await pool.restoreOne());
+    }
+    return pool;
+  }
+
+  /**
+   * Take a ready sandbox from the pool, or undefined if the pool is empty
+   */
+  tryAcquire(): XSSandbox | undefined {
+    this.checkOpen();
+    const sandbox = this.ready.pop();
+    if (sandbox) {
+      this._stats.hits++;
+      this.scheduleRefill();
+    }
+    return sandbox;
+  }
+
+  /**
+   * Take a ready sandbox from the pool, or restore a new one if the pool is
+   * empty
+   */
+  async acquire(): Promise<XSSandbox> {
+    const sandbox = this.tryAcquire();
+    if (sandbox) {
+      return sandbox;
+    }
+    this._stats.misses++;
+    this.scheduleRefill();
+    return this.restoreOne();
+  }
+
+  /**
+   * Restore sandboxes until the pool is at its target size. This is
+   * synchronous unless a new WASM instance is needed.
+   */
+  async refill() {
+    while (!this.closed && this.ready.length < this.size) {
+      await this.restoreNext();
+    }
+  }
+
+  get stats(): SandboxPoolStats {
+    return { ...this._stats, ready: this.ready.length };
+  }
+
+  /**
+   * Dispose the ready sandboxes and stop refilling. Sandboxes already handed
+   * out are unaffected.
+   */
+  close() {
+    this.closed = true;
+    for (const sandbox of this.ready) {
+      sandbox.dispose();
+    }
+    this.ready = [];
+  }
+
+  private async restoreOne(): Promise<XSSandbox> {
+    let instance = this.instances.find(instance => instance.sandboxCount < this.sandboxesPerInstance);
+    if (!instance) {
+      instance = await this.createInstance();
+      this.instances.push(instance);
+    }
+    this._stats.restored++;
+    return instance.restore(this.opts.template, this.opts);
+  }
+
+  // Restore one sandbox into the pool, or wait for the one already being
+  // restored
+  private restoreNext(): Promise<void> {
+    this.restoring ??= this.restoreOne()
+      .then(sandbox => {
+        if (this.closed) {
+          sandbox.dispose();
+        } else {
+          this.ready.push(sandbox);
+        }
+      })
+      .finally(() => {
+        this.restoring = undefined;
+      });
+    return this.restoring;
+  }
+
+  private refillFailed(error: unknown) {
+    this.opts.onRefillError?.(error);
+  }
+
+  private scheduleRefill() {
+    if (this.refillScheduled || this.closed || this.ready.length >= this.size) {
+      return;
+    }
+    const policy = this.refillPolicy;
+    if (policy === 'manual') {
+      return;
+    }
+    if (policy === 'immediate') {
+      this.refill().catch(error => this.refillFailed(error));
+      return;
+    }
+    this.refillScheduled = true;
+    const step = () => {
+      this.refillScheduled = false;
+      if (this.closed || this.ready.length >= this.size) {
+        return;
+      }
+      this.restoreNext().then(
+        () => this.scheduleRefill(),
+        error => this.refillFailed(error));
+    };
+    if (typeof policy === 'function') {
+      policy(step);
+    } else {
+      scheduleIdle(step);
+    }
+  }
+
+  private checkOpen() {
+    if (this.closed) {
+      throw new Error('Sandbox pool is closed');
+    }
+  }
+}
+
+function scheduleIdle(callback: () => void) {
+  if (typeof requestIdleCallback === 'function') {
+    requestIdleCallback(callback);
+  } else if (typeof setImmediate === 'function') {
+    setImmediate(callback);
+  } else {
+    setTimeout(callback, 0);
+  }
+}
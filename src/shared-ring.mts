@@ -0,0 +1,216 @@
+/*
+Byte ring buffers in a SharedArrayBuffer, used to pass messages between the
+threads of an `AsyncSandboxPool` without the structured clone of `postMessage`.
+
+A ring has one writer and one reader. Its header holds the total number of
+bytes read and written (mod 2^32), so the ring is empty when they are equal.
+Each side notifies its own counter when it advances, so the other side can wait
+on it with `Atomics.wait` or `Atomics.waitAsync`. Messages are framed with a
+uint32 length prefix.
+*/
+
+const HEADER_BYTES = 16;
+// Indexes into the header
+export const RING_READ = 0;
+export const RING_WRITE = 1;
+
+export class SharedRing {
+  readonly header: Int32Array;
+  readonly data: Uint8Array;
+  private readonly mask: number;
+
+  constructor(readonly buffer: SharedArrayBuffer) {
+    this.header = new Int32Array(buffer, 0, 2);
+    this.data = new Uint8Array(buffer, HEADER_BYTES);
+    this.mask = this.data.length - 1;
+  }
+
+  /**
+   * Allocate a ring of at least `capacity` bytes, rounded up to a power of 2
+   */
+  static allocate(capacity: number) {
+    let size = 16;
+    while (size < capacity) {
+      size *= 2;
+    }
+    return new SharedRing(new SharedArrayBuffer(HEADER_BYTES + size));
+  }
+
+  get capacity() {
+    return this.data.length;
+  }
+
+  /** Bytes written but not yet read */
+  get used() {
+    return (Atomics.load(this.header, RING_WRITE) - Atomics.load(this.header, RING_READ)) >>> 0;
+  }
+
+  /**
+   * Write as much of `bytes` as fits, returning the number of bytes written
+   */
+  write(bytes: Uint8Array): number {
+    const write = Atomics.load(this.header, RING_WRITE);
+    const free = this.capacity - ((write - Atomics.load(this.header, RING_READ)) >>> 0);
+    const count = Math.min(free, bytes.length);
+    if (count === 0) {
+      return 0;
+    }
+    this.copyIn(write, bytes.subarray(0, count));
+    Atomics.store(this.header, RING_WRITE, (write + count) | 0);
+    Atomics.notify(this.header, RING_WRITE);
+    return count;
+  }
+
+  /**
+   * Read up to `length` bytes into `target` at `offset`, returning the number
+   * of bytes read
+   */
+  read(target: Uint8Array, offset: number, length: number): number {
+    const read = Atomics.load(this.header, RING_READ);
+    const count = Math.min(length, (Atomics.load(this.header, RING_WRITE) - read) >>> 0);
+    if (count === 0) {
+      return 0;
+    }
+    this.copyOut(read, target.subarray(offset, offset + count));
+    Atomics.store(this.header, RING_READ, (read + count) | 0);
+    Atomics.notify(this.header, RING_READ);
+    return count;
+  }
+
+  /**
+   * Write a whole frame, or nothing if it doesn't fit. For rings with more
+   * than one reader, which can only take whole frames.
+   */
+  writeFrame(frame: Uint8Array): boolean {
+    const write = Atomics.load(this.header, RING_WRITE);
+    const free = this.capacity - ((write - Atomics.load(this.header, RING_READ)) >>> 0);
+    if (free < 4 + frame.length) {
+      return false;
+    }
+    this.copyIn(write, lengthPrefix(frame.length));
+    this.copyIn(write + 4, frame);
+    Atomics.store(this.header, RING_WRITE, (write + 4 + frame.length) | 0);
+    Atomics.notify(this.header, RING_WRITE);
+    return true;
+  }
+
+  /**
+   * Read a whole frame written by `writeFrame`, or undefined if there isn't
+   * one. The caller must hold a lock if there is more than one reader.
+   */
+  readFrame(): Uint8Array | undefined {
+    const read = Atomics.load(this.header, RING_READ);
+    const used = (Atomics.load(this.header, RING_WRITE) - read) >>> 0;
+    if (used < 4) {
+      return undefined;
+    }
+    const prefix = new Uint8Array(4);
+    this.copyOut(read, prefix);
+    const length = new DataView(prefix.buffer).getUint32(0, true);
+    if (used < 4 + length) {
+      return undefined;
+    }
+    const frame = new Uint8Array(length);
+    this.copyOut(read + 4, frame);
+    Atomics.store(this.header, RING_READ, (read + 4 + length) | 0);
+    Atomics.notify(this.header, RING_READ);
+    return frame;
+  }
+
+  private copyIn(position: number, bytes: Uint8Array) {
+    const start = position & this.mask;
+    const first = Math.min(bytes.length, this.capacity - start);
+    this.data.set(bytes.subarray(0, first), start);
+    this.data.set(bytes.subarray(first), 0);
+  }
+
+  private copyOut(position: number, target: Uint8Array) {
+    const start = position & this.mask;
+    const first = Math.min(target.length, this.capacity - start);
+    target.set(this.data.subarray(start, start + first));
+    target.set(this.data.subarray(0, target.length - first), first);
+  }
+}
+
+/**
+ * Writes frames of any size to a ring, a piece at a time as space becomes
+ * available
+ */
+export class FrameWriter {
+  private pending: Uint8Array[] = [];
+  private offset = 0;
+
+  constructor(readonly ring: SharedRing) {
+  }
+
+  /**
+   * Queue a frame and write as much of the queue as fits. Returns true if the
+   * queue was written completely.
+   */
+  send(frame: Uint8Array): boolean {
+    this.pending.push(lengthPrefix(frame.length), frame);
+    return this.flush();
+  }
+
+  /** Whether everything sent has been written */
+  get idle() {
+    return this.pending.length === 0;
+  }
+
+  /**
+   * Write as much of the queue as fits. Returns true if nothing is left.
+   */
+  flush(): boolean {
+    while (this.pending.length) {
+      const chunk = this.pending[0];
+      this.offset += this.ring.write(chunk.subarray(this.offset));
+      if (this.offset < chunk.length) {
+        return false;
+      }
+      this.pending.shift();
+      this.offset = 0;
+    }
+    return true;
+  }
+}
+
+/**
+ * Reads the frames written by a FrameWriter
+ */
+export class FrameReader {
+  private prefix = new Uint8Array(4);
+  private prefixFilled = 0;
+  private frame?: Uint8Array;
+  private filled = 0;
+
+  constructor(readonly ring: SharedRing) {
+  }
+
+  /**
+   * The next frame, or undefined if it hasn't all arrived yet
+   */
+  next(): Uint8Array | undefined {
+    if (!this.frame) {
+      this.prefixFilled += this.ring.read(this.prefix, this.prefixFilled, 4 - this.prefixFilled);
+      if (this.prefixFilled < 4) {
+        return undefined;
+      }
+      this.frame = new Uint8Array(new DataView(this.prefix.buffer).getUint32(0, true));
+      this.prefixFilled = 0;
+      this.filled = 0;
+    }
+    this.filled += this.ring.read(this.frame, this.filled, this.frame.length - this.filled);
+    if (this.filled < this.frame.length) {
+      return undefined;
+    }
+    const frame = this.frame;
+    this.frame = undefined;
+    return frame;
+  }
+}
+
+function lengthPrefix(length: number) {
+  const prefix = new Uint8Array(4);
+  new DataView(prefix.buffer).setUint32(0, length, true);
+  return prefix;
+}
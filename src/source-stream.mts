@@ -0,0 +1,79 @@
+/*
+Reads the chunks of source passed to `XSSandbox.evaluateStream` into the
+buffer that the engine's parser reads from, encoding strings as UTF-8 straight
+into WASM memory.
+*/
+
+const textEncoder = new TextEncoder();
+
+export type SourceChunk = string | Uint8Array;
+
+export class SourceReader {
+  private iterator: Iterator<SourceChunk>;
+  private pending: SourceChunk = '';
+  // A chunk taken from the iterator early, by nextChunk
+  private lookahead?: IteratorResult<SourceChunk>;
+
+  constructor(chunks: Iterable<SourceChunk>) {
+    this.iterator = chunks[Symbol.iterator]();
+  }
+
+  /**
+   * Fill `target` with as much of the source as fits, returning the number of
+   * bytes, which is only 0 at the end of the source
+   */
+  read(target: Uint8Array): number {
+    let written = 0;
+    while (written < target.length) {
+      if (this.pending.length === 0) {
+        const next = this.nextChunk();
+        if (next === undefined) {
+          break;
+        }
+        this.pending = next;
+        continue;
+      }
+      const pending = this.pending;
+      if (typeof pending === 'string') {
+        const { read, written: count } = textEncoder.encodeInto(pending, target.subarray(written));
+        if (read === 0) {
+          // No room for the next character
+          break;
+        }
+        written += count!;
+        this.pending = pending.slice(read);
+      } else {
+        const count = Math.min(pending.length, target.length - written);
+        target.set(pending.subarray(0, count), written);
+        written += count;
+        this.pending = pending.subarray(count);
+      }
+    }
+    return written;
+  }
+
+  // The next chunk, or undefined at the end. A surrogate pair split across
+  // string chunks must be encoded together, so those are joined.
+  private nextChunk(): SourceChunk | undefined {
+    let chunk = this.take();
+    while (typeof chunk === 'string' && endsWithHighSurrogate(chunk)) {
+      this.lookahead = this.iterator.next();
+      if (this.lookahead.done || typeof this.lookahead.value !== 'string') {
+        break;
+      }
+      chunk += this.take();
+    }
+    return chunk;
+  }
+
+  private take(): SourceChunk | undefined {
+    const next = this.lookahead ?? this.iterator.next();
+    this.lookahead = undefined;
+    return next.done ? undefined : next.value;
+  }
+}
+
+function endsWithHighSurrogate(chunk: string) {
+  const code = chunk.charCodeAt(chunk.length - 1);
+  return code >= 0xD800 && code <= 0xDBFF;
+}
@@ -0,0 +1,133 @@
+/**
+ * The phases of a call into the sandbox:
+ *
+ * - `hostEncode`: the host serializing the input (the message or script)
+ * - `decode`: the guest parsing the input, and the results of its calls to the
+ *   host
+ * - `dispatch`: guest code, i.e. the `eval`, `receiveMessage` or compiled
+ *   script
+ * - `encode`: the guest serializing the result, and its messages and console
+ *   output to the host
+ * - `runLoop`: promise jobs run after the call
+ * - `hostCallbacks`: the host's handlers of the guest's `sendMessage` and
+ *   `console` calls, including any calls they make back into the sandbox
+ * - `hostDecode`: the host parsing the result
+ */
+export type CallPhase = 'hostEncode' | 'decode' | 'dispatch' | 'encode' | 'runLoop' | 'hostCallbacks' | 'hostDecode';
+
+export const callPhases: CallPhase[] = ['hostEncode', 'decode', 'dispatch', 'encode', 'runLoop', 'hostCallbacks', 'hostDecode'];
+
+// The order of the phases timed by the engine (CallPhase in xs_sandbox.h)
+export const enginePhases: CallPhase[] = ['decode', 'dispatch', 'encode', 'runLoop', 'hostCallbacks'];
+
+/**
+ * Where the time of one call into the sandbox went. Times are in milliseconds.
+ */
+export interface CallTiming {
+  kind: 'evaluate' | 'sendMessage' | 'sendMessages' | 'run' | 'settle' | 'resume';
+  total: number;
+  phases: Record<CallPhase, number>;
+  /** Number of calls the guest made to the host's `sendMessage` and `console` */
+  hostCallbacks: number;
+  /**
+   * Number of garbage collections during the call. Only available if the
+   * engine is built with instrumentation (mxInstrument).
+   */
+  gcCount?: number;
+}
+
+/**
+ * Distribution of the time taken by calls, or by one phase of them, in
+ * milliseconds.
+ */
+export interface TimeStats {
+  total: number;
+  max: number;
+  /**
+   * Number of calls by duration on a log scale: `histogram[0]` counts those
+   * under 1 µs, and `histogram[i]` those from 2^(i-1) µs up to 2^i µs. The last
+   * bucket also counts anything longer.
+   */
+  histogram: number[];
+}
+
+/**
+ * Cumulative stats of the calls into a sandbox since stats were enabled or
+ * reset. See `XSSandbox.enableStats`.
+ */
+export interface SandboxStats {
+  calls: number;
+  time: TimeStats;
+  phases: Record<CallPhase, TimeStats>;
+  hostCallbacks: number;
+  /** Only available if the engine is built with instrumentation */
+  gcCount?: number;
+}
+
+// Covers up to about 4 seconds
+const HISTOGRAM_BUCKETS = 24;
+
+export function newCallTiming(kind: CallTiming['kind']): CallTiming {
+  const phases = {} as Record<CallPhase, number>;
+  for (const phase of callPhases) {
+    phases[phase] = 0;
+  }
+  return { kind, total: 0, phases, hostCallbacks: 0 };
+}
+
+export class StatsCollector {
+  private calls = 0;
+  private time = newTimeStats();
+  private phases = {} as Record<CallPhase, TimeStats>;
+  private hostCallbacks = 0;
+  private gcCount: number | undefined = 0;
+
+  constructor(readonly onCall?: (timing: CallTiming) => void) {
+    for (const phase of callPhases) {
+      this.phases[phase] = newTimeStats();
+    }
+  }
+
+  record(timing: CallTiming) {
+    this.calls++;
+    addTime(this.time, timing.total);
+    for (const phase of callPhases) {
+      addTime(this.phases[phase], timing.phases[phase]);
+    }
+    this.hostCallbacks += timing.hostCallbacks;
+    this.gcCount = timing.gcCount === undefined || this.gcCount === undefined
+      ? undefined
+      : this.gcCount + timing.gcCount;
+    this.onCall?.(timing);
+  }
+
+  get stats(): SandboxStats {
+    const phases = {} as Record<CallPhase, TimeStats>;
+    for (const phase of callPhases) {
+      phases[phase] = copyTimeStats(this.phases[phase]);
+    }
+    return {
+      calls: this.calls,
+      time: copyTimeStats(this.time),
+      phases,
+      hostCallbacks: this.hostCallbacks,
+      gcCount: this.gcCount,
+    };
+  }
+}
+
+function newTimeStats(): TimeStats {
+  return { total: 0, max: 0, histogram: new Array(HISTOGRAM_BUCKETS).fill(0) };
+}
+
+function copyTimeStats(stats: TimeStats): TimeStats {
+  return { ...stats, histogram: stats.histogram.slice() };
+}
+
+function addTime(stats: TimeStats, ms: number) {
+  stats.total += ms;
+  stats.max = Math.max(stats.max, ms);
+  const micros = ms * 1000;
+  const bucket = micros < 1 ? 0 : Math.floor(Math.log2(micros)) + 1;
+  stats.histogram[Math.min(bucket, HISTOGRAM_BUCKETS - 1)]++;
+}
@@ -11,17 +11,34 @@ declarations are literally inconsistent. `xs.h` is the public interface and
 
 #include "xsAll.h"
 
-void fxRunLoop(txMachine* the)
+txBoolean fxRunLoopUntil(txMachine* the, txUnsigned budget)
 {
-
+	// The flag isn't part of a snapshot, but the jobs are
+	if (mxPendingJobs.value.reference->next)
+		the->promiseJobs = 1;
 	do {
 		while (the->promiseJobs) {
+			if (budget && (the->meterIndex >= budget)) {
+				fxEndJob(the);
+				return 1;
+			}
 			the->promiseJobs = 0;
 			fxRunPromiseJobs(the);
 		}
 		fxEndJob(the);
 	} while (the->promiseJobs);
 	fxCheckUnhandledRejections(the, 1);
+	return 0;
+}
+
+txBoolean fxHasPendingJobs(txMachine* the)
+{
+	return mxPendingJobs.value.reference->next ? 1 : 0;
+}
+
+void fxRunLoop(txMachine* the)
+{
+	fxRunLoopUntil(the, 0);
 }
 
 txUnsigned fxGetCurrentMeter(txMachine* the)
@@ -33,3 +50,616 @@ void fxSetCurrentMeter(txMachine* the, txUnsigned value)
 {
 	the->meterIndex = value;
 }
+
+void* fxToInstance(txMachine* the, txSlot* slot)
+{
+	return (slot->kind == XS_REFERENCE_KIND) ? slot->value.reference : C_NULL;
+}
+
+int fxGetAbortStatus(txMachine* the)
+{
+	return the->abortStatus;
+}
+
+void fxSetAbortStatus(txMachine* the, int status)
+{
+	the->abortStatus = status;
+}
+
+void fxSetAllocationLimit(txMachine* the, size_t limit)
+{
+	the->allocationLimit = limit ? limit : DEFAULT_ALLOCATION_LIMIT;
+}
+
+void fxGetMemoryStats(txMachine* the, txU4* stats)
+{
+	stats[0] = the->currentHeapCount;
+	stats[1] = the->maximumHeapCount;
+	stats[2] = the->currentChunksSize;
+	stats[3] = the->maximumChunksSize;
+	stats[4] = the->keyIndex;
+#ifdef mxInstrument
+	stats[5] = the->garbageCollectionCount;
+#else
+	stats[5] = 0xFFFFFFFF;
+#endif
+	stats[6] = the->allocatedSpace;
+	stats[7] = the->arena.reservedBytes;
+	stats[8] = the->arena.peakReservedBytes;
+}
+
+
+// Scripts and modules have different signatures so that one can't be run as
+// the other
+static const char COMPILED_SCRIPT_SIGNATURE[] = "xs-sandbox-script-1";
+static const char COMPILED_MODULE_SIGNATURE[] = "xs-sandbox-module-1";
+#define COMPILED_SIGNATURE_LENGTH (sizeof(COMPILED_SCRIPT_SIGNATURE) - 1)
+// Signature, version[4], symbolsSize, codeSize
+#define COMPILED_HEADER_SIZE (COMPILED_SIGNATURE_LENGTH + 4 + 4 + 4)
+
+// Where the parser reports its first syntax error, as "path:line: message"
+typedef struct {
+	char* buffer;
+	txSize size;
+	txString path;
+} txSyntaxReport;
+
+static void fxReportSyntaxError(void* console, txString path, txInteger line, txString format, c_va_list arguments)
+{
+	txSyntaxReport* report = console;
+	txSize length;
+	if (!report->size || report->buffer[0])
+		return;
+	length = c_snprintf(report->buffer, report->size, "%s:%d: ", report->path ? report->path : "<anonymous>", (int)line);
+	if ((length >= 0) && (length < report->size))
+		c_vsnprintf(report->buffer + length, report->size - length, format, arguments);
+}
+
+static void fxIgnoreSyntaxWarning(void* console, txString path, txInteger line, txString format, c_va_list arguments)
+{
+}
+
+// Parse a script or module read through `getter`, or return NULL if it has a
+// syntax error, which is described in `error` (of `errorSize` bytes, including
+// the NUL). `bufferSize` is the size of the parser's token buffer, or 0 for the
+// machine's default.
+static txScript* fxParseStream(txMachine* the, txGetter getter, void* stream, txSize bufferSize, txString path, txUnsigned flags, char* error, txSize errorSize)
+{
+	txParser _parser;
+	txParser* parser = &_parser;
+	txParserJump jump;
+	txScript* script = C_NULL;
+	txSyntaxReport report = { error, errorSize, path };
+	if (errorSize)
+		error[0] = 0;
+	if (path)
+		flags |= mxDebugFlag;
+	if (bufferSize < the->parserBufferSize)
+		bufferSize = the->parserBufferSize;
+	fxInitializeParser(parser, the, bufferSize, the->parserTableModulo);
+	parser->console = &report;
+	parser->reportError = fxReportSyntaxError;
+	parser->reportWarning = fxIgnoreSyntaxWarning;
+	parser->firstJump = &jump;
+	if (c_setjmp(jump.jmp_buf) == 0) {
+		if (path)
+			parser->path = fxNewParserSymbol(parser, path);
+		fxParserTree(parser, stream, getter, flags, C_NULL);
+		fxParserHoist(parser);
+		fxParserBind(parser);
+		script = fxParserCode(parser);
+		if (parser->errorCount) {
+			fxDeleteScript(script);
+			script = C_NULL;
+		}
+	}
+	fxTerminateParser(parser);
+	// A parser that gives up (e.g. out of memory) may not have reported why
+	if (!script && errorSize && !error[0])
+		c_snprintf(error, errorSize, "%s: cannot compile", path ? path : "<anonymous>");
+	return script;
+}
+
+// Run a script in the global scope of the program, like indirect eval, and
+// delete it
+static void fxRunProgramScript(txMachine* the, txScript* script, txSlot* result)
+{
+	txSlot* realm = mxProgram.value.reference->next->value.module.realm;
+	fxRunScript(the, script, mxRealmGlobal(realm), C_NULL, mxRealmClosures(realm)->value.reference, C_NULL, mxProgram.value.reference);
+	mxPullSlot(result);
+}
+
+void* fxCompileScript(txMachine* the, txString source, txSize size, txString path, txBoolean module, txSize* out_size, char* error, txSize errorSize)
+{
+	txStringCStream stream;
+	txScript* script;
+	txU1* buffer = C_NULL;
+	stream.buffer = source;
+	stream.offset = 0;
+	stream.size = size;
+	script = fxParseStream(the, fxStringCGetter, &stream, 0, path, module ? 0 : mxProgramFlag | mxEvalFlag, error, errorSize);
+	if (!script)
+		return C_NULL;
+
+	// Host function builders only come from the @ syntax, which isn't enabled
+	if (!script->hostsBuffer) {
+		*out_size = COMPILED_HEADER_SIZE + script->symbolsSize + script->codeSize;
+		buffer = c_malloc(*out_size);
+	}
+	if (buffer) {
+		txU1* p = buffer;
+		txU4 symbolsSize = script->symbolsSize;
+		txU4 codeSize = script->codeSize;
+		c_memcpy(p, module ? COMPILED_MODULE_SIGNATURE : COMPILED_SCRIPT_SIGNATURE, COMPILED_SIGNATURE_LENGTH);
+		p += COMPILED_SIGNATURE_LENGTH;
+		c_memcpy(p, script->version, 4);
+		p += 4;
+		c_memcpy(p, &symbolsSize, 4);
+		p += 4;
+		c_memcpy(p, &codeSize, 4);
+		p += 4;
+		c_memcpy(p, script->symbolsBuffer, symbolsSize);
+		p += symbolsSize;
+		c_memcpy(p, script->codeBuffer, codeSize);
+	}
+	fxDeleteScript(script);
+	return buffer;
+}
+
+txScript* fxReadCompiledScript(void* buffer, txSize size, txBoolean module)
+{
+	txU1* p = buffer;
+	txU4 symbolsSize, codeSize;
+	txScript* script;
+	if (size < (txSize)COMPILED_HEADER_SIZE)
+		return C_NULL;
+	if (c_memcmp(p, module ? COMPILED_MODULE_SIGNATURE : COMPILED_SCRIPT_SIGNATURE, COMPILED_SIGNATURE_LENGTH))
+		return C_NULL;
+	p += COMPILED_SIGNATURE_LENGTH;
+	if ((p[0] != XS_MAJOR_VERSION) || (p[1] != XS_MINOR_VERSION) || (p[2] != XS_PATCH_VERSION))
+		return C_NULL;
+	p += 4;
+	c_memcpy(&symbolsSize, p, 4);
+	p += 4;
+	c_memcpy(&codeSize, p, 4);
+	p += 4;
+	if ((symbolsSize > (txU4)size) || (codeSize > (txU4)size) || (COMPILED_HEADER_SIZE + symbolsSize + codeSize != (txU4)size))
+		return C_NULL;
+
+	// The script owns its buffers, since whoever runs it deletes it
+	script = c_calloc(1, sizeof(txScript));
+	if (!script)
+		return C_NULL;
+	script->symbolsBuffer = c_malloc(symbolsSize);
+	script->codeBuffer = c_malloc(codeSize);
+	if (!script->symbolsBuffer || !script->codeBuffer) {
+		fxDeleteScript(script);
+		return C_NULL;
+	}
+	c_memcpy(script->symbolsBuffer, p, symbolsSize);
+	script->symbolsSize = symbolsSize;
+	p += symbolsSize;
+	c_memcpy(script->codeBuffer, p, codeSize);
+	script->codeSize = codeSize;
+	c_memcpy(script->version, (txU1*)buffer + COMPILED_SIGNATURE_LENGTH, 4);
+	return script;
+}
+
+txBoolean fxRunCompiledScript(txMachine* the, void* buffer, txSize size, txSlot* result)
+{
+	txScript* script = fxReadCompiledScript(buffer, size, 0);
+	if (!script)
+		return 0;
+	fxRunProgramScript(the, script, result);
+	return 1;
+}
+
+txBoolean fxEvaluateStream(txMachine* the, txGetter getter, void* stream, txSize bufferSize, txString path, txBoolean* aborted, txSlot* result, char* error, txSize errorSize)
+{
+	txScript* script = fxParseStream(the, getter, stream, bufferSize, path, mxProgramFlag | mxEvalFlag, error, errorSize);
+	if (!script)
+		return 0;
+	// The part of the source read before the getter failed may parse on its own
+	if (*aborted) {
+		fxDeleteScript(script);
+		return 1;
+	}
+	fxRunProgramScript(the, script, result);
+	return 1;
+}
+
+#define DESCRIBE_STACK_MAX_DEPTH 64
+
+// Append `text` to the stack description, without the separators used by
+// collapsed stacks
+static void fxAppendStackText(txString buffer, txSize size, txSize* length, txString text)
+{
+	char c;
+	while ((c = *text++) && (*length < size)) {
+		buffer[(*length)++] = ((c == ';') || (c == '\n')) ? ' ' : c;
+	}
+}
+
+txSize fxDescribeStack(txMachine* the, txString buffer, txSize size)
+{
+	txSlot* frames[DESCRIBE_STACK_MAX_DEPTH];
+	txInteger count = 0;
+	txSlot* frame = the->frame;
+	txSize length = 0;
+	char name[128];
+	char location[C_PATH_MAX + 16];
+	while (frame && (count < DESCRIBE_STACK_MAX_DEPTH)) {
+		// Skip the frames of host entries, which have no function
+		if (mxFrameFunction(frame)->kind != XS_UNDEFINED_KIND)
+			frames[count++] = frame;
+		frame = frame->next;
+	}
+	if (frame)
+		fxAppendStackText(buffer, size, &length, "(truncated)");
+	while (count > 0) {
+		frame = frames[--count];
+		if (length && (length < size))
+			buffer[length++] = ';';
+		name[0] = 0;
+		fxBufferFrameName(the, name, sizeof(name), frame, "");
+		fxAppendStackText(buffer, size, &length, name[0] ? name : "(anonymous)");
+		if (!(frame->flag & XS_C_FLAG)) {
+			txSlot* environment = mxFrameToEnvironment(frame);
+			if (environment->ID != XS_NO_ID) {
+				c_snprintf(location, sizeof(location), " (%s:%d)", fxGetKeyName(the, environment->ID), (int)environment->value.environment.line);
+				fxAppendStackText(buffer, size, &length, location);
+			}
+		}
+	}
+	return length;
+}
+
+// The kinds of value that fxDescribeHeap breaks the heap down by. "closures"
+// are the environments holding variables captured by functions, and
+// "asyncFrames" the saved stacks of generators and suspended async functions.
+enum {
+	HEAP_OBJECTS,
+	HEAP_FUNCTIONS,
+	HEAP_CLOSURES,
+	HEAP_ARRAYS,
+	HEAP_STRINGS,
+	HEAP_ASYNC_FRAMES,
+	HEAP_PROMISES,
+	HEAP_KEYS,
+	HEAP_OTHER,
+	HEAP_KIND_COUNT
+};
+
+static const char* const gxHeapKindNames[HEAP_KIND_COUNT] = {
+	"objects", "functions", "closures", "arrays", "strings", "asyncFrames", "promises", "keys", "other"
+};
+
+#define HEAP_LARGEST_COUNT 10
+#define HEAP_RETAINER_COUNT 4
+#define HEAP_KEY_MAX 64
+
+typedef struct {
+	txInteger kind;
+	// The retaining property or variable, or XS_NO_ID for an internal slot
+	txID id;
+	// The index if retained by an array item, or -1
+	txInteger index;
+} txHeapRetainer;
+
+typedef struct {
+	txSlot* instance;
+	txInteger kind;
+	txSize bytes;
+	txInteger retainerCount;
+	txHeapRetainer retainers[HEAP_RETAINER_COUNT];
+} txHeapObject;
+
+typedef struct {
+	txSize count[HEAP_KIND_COUNT];
+	txSize bytes[HEAP_KIND_COUNT];
+	txHeapObject largest[HEAP_LARGEST_COUNT];
+	txInteger largestCount;
+} txHeapSummary;
+
+// Set in the size of a chunk that has been counted. This is the bit that the
+// collector marks chunks with, so it's clear outside of a collection.
+#define HEAP_COUNTED_CHUNK 0x80000000
+
+static txChunk* fxDataChunk(void* data)
+{
+	return (txChunk*)(((txByte*)data) - sizeof(txChunk));
+}
+
+// The size of a chunk, including its header
+static txSize fxChunkBytes(void* data)
+{
+	return data ? (txSize)((fxDataChunk(data)->size & ~HEAP_COUNTED_CHUNK) + sizeof(txChunk)) : 0;
+}
+
+static txInteger fxInstanceHeapKind(txSlot* instance)
+{
+	txSlot* property = instance->next;
+	if (!property)
+		return HEAP_OBJECTS;
+	if (property->kind == XS_CLOSURE_KIND)
+		return HEAP_CLOSURES;
+	if (!(property->flag & XS_INTERNAL_FLAG))
+		return HEAP_OBJECTS;
+	switch (property->kind) {
+	case XS_CODE_KIND:
+	case XS_CODE_X_KIND:
+	case XS_CALLBACK_KIND:
+	case XS_CALLBACK_X_KIND:
+		return HEAP_FUNCTIONS;
+	case XS_ARRAY_KIND:
+		return HEAP_ARRAYS;
+	case XS_STACK_KIND:
+		return HEAP_ASYNC_FRAMES;
+	case XS_PROMISE_KIND:
+		return HEAP_PROMISES;
+	default:
+		return HEAP_OBJECTS;
+	}
+}
+
+// Count what a slot of an instance owns besides itself, returning the bytes
+// that belong to the instance. Strings are counted as strings wherever they
+// are, and a string shared by several slots is counted once.
+static txSize fxSummarizeValue(txMachine* the, txHeapSummary* summary, txSlot* slot)
+{
+	switch (slot->kind) {
+	case XS_STRING_KIND: {
+		txChunk* chunk = fxDataChunk(slot->value.string);
+		if (chunk->size & HEAP_COUNTED_CHUNK)
+			return 0;
+		summary->count[HEAP_STRINGS]++;
+		summary->bytes[HEAP_STRINGS] += fxChunkBytes(slot->value.string);
+		chunk->size |= HEAP_COUNTED_CHUNK;
+		return 0;
+	}
+	case XS_STRING_X_KIND:
+		summary->count[HEAP_STRINGS]++;
+		return 0;
+	case XS_ARRAY_KIND: {
+		txSize bytes = fxChunkBytes(slot->value.array.address);
+		if (slot->value.array.address) {
+			txSlot* item = slot->value.array.address;
+			txSlot* limit = item + fxGetIndexSize(the, slot);
+			while (item < limit)
+				bytes += fxSummarizeValue(the, summary, item++);
+		}
+		return bytes;
+	}
+	case XS_STACK_KIND:
+		return fxChunkBytes(slot->value.stack.address);
+	case XS_CODE_KIND:
+		return fxChunkBytes(slot->value.code.address);
+	case XS_ARRAY_BUFFER_KIND:
+		return fxChunkBytes(slot->value.arrayBuffer.address);
+	case XS_BIGINT_KIND:
+		return fxChunkBytes(slot->value.bigint.data);
+	case XS_CLOSURE_KIND: {
+		// The slot holding a captured variable, which may be shared by the
+		// environments of several functions
+		txSlot* holder = slot->value.closure;
+		if (!holder || (holder->flag & XS_MARK_FLAG))
+			return 0;
+		holder->flag |= XS_MARK_FLAG;
+		return sizeof(txSlot) + fxSummarizeValue(the, summary, holder);
+	}
+	default:
+		return 0;
+	}
+}
+
+// Clear the marks that fxSummarizeValue left on the strings of a slot
+static void fxUnmarkStrings(txMachine* the, txSlot* slot)
+{
+	if (slot->kind == XS_STRING_KIND)
+		fxDataChunk(slot->value.string)->size &= ~HEAP_COUNTED_CHUNK;
+	else if ((slot->kind == XS_ARRAY_KIND) && slot->value.array.address) {
+		txSlot* item = slot->value.array.address;
+		txSlot* limit = item + fxGetIndexSize(the, slot);
+		while (item < limit)
+			fxUnmarkStrings(the, item++);
+	}
+}
+
+static void fxRankHeapObject(txHeapSummary* summary, txSlot* instance, txInteger kind, txSize bytes)
+{
+	txInteger i = summary->largestCount;
+	if (i == HEAP_LARGEST_COUNT) {
+		if (bytes <= summary->largest[i - 1].bytes)
+			return;
+		i--;
+	}
+	else
+		summary->largestCount++;
+	while ((i > 0) && (summary->largest[i - 1].bytes < bytes)) {
+		summary->largest[i] = summary->largest[i - 1];
+		i--;
+	}
+	c_memset(&summary->largest[i], 0, sizeof(txHeapObject));
+	summary->largest[i].instance = instance;
+	summary->largest[i].kind = kind;
+	summary->largest[i].bytes = bytes;
+}
+
+static void fxAddHeapRetainer(txHeapSummary* summary, txSlot* slot, txInteger kind, txID id, txInteger index)
+{
+	txInteger i;
+	if (slot->kind != XS_REFERENCE_KIND)
+		return;
+	for (i = 0; i < summary->largestCount; i++) {
+		txHeapObject* object = &summary->largest[i];
+		if (object->instance == slot->value.reference) {
+			if (object->retainerCount < HEAP_RETAINER_COUNT) {
+				txHeapRetainer* retainer = &object->retainers[object->retainerCount];
+				retainer->kind = kind;
+				retainer->id = id;
+				retainer->index = index;
+			}
+			object->retainerCount++;
+		}
+	}
+}
+
+// Find what refers to the largest objects through properties, array items and
+// captured variables
+static void fxFindHeapRetainers(txMachine* the, txHeapSummary* summary, txSlot* instance)
+{
+	txInteger kind = fxInstanceHeapKind(instance);
+	txSlot* property = instance->next;
+	while (property) {
+		if (property->kind == XS_ARRAY_KIND) {
+			if (property->value.array.address) {
+				txSlot* item = property->value.array.address;
+				txSlot* limit = item + fxGetIndexSize(the, property);
+				while (item < limit) {
+					fxAddHeapRetainer(summary, item, kind, XS_NO_ID, (txInteger)*((txIndex*)item));
+					item++;
+				}
+			}
+		}
+		else if (property->kind == XS_CLOSURE_KIND) {
+			if (property->value.closure)
+				fxAddHeapRetainer(summary, property->value.closure, kind, property->ID, -1);
+		}
+		else
+			fxAddHeapRetainer(summary, property, kind, (property->flag & XS_INTERNAL_FLAG) ? XS_NO_ID : property->ID, -1);
+		property = property->next;
+	}
+}
+
+static void fxSummarizeHeap(txMachine* the, txHeapSummary* summary)
+{
+	txSlot* heap;
+	txSlot* slot;
+	txSlot* limit;
+	c_memset(summary, 0, sizeof(txHeapSummary));
+	fxCollectGarbage(the);
+	// Marks tell free slots, and those already counted, from the rest. They're
+	// all clear between collections.
+	for (slot = the->freeHeap; slot; slot = slot->next)
+		slot->flag |= XS_MARK_FLAG;
+	// Instances, with their properties and what those own
+	for (heap = the->firstHeap; heap; heap = heap->next) {
+		limit = heap->value.reference;
+		for (slot = heap + 1; slot < limit; slot++) {
+			if ((slot->kind == XS_INSTANCE_KIND) && !(slot->flag & XS_MARK_FLAG)) {
+				txInteger kind = fxInstanceHeapKind(slot);
+				txSize bytes = sizeof(txSlot);
+				txSlot* property = slot->next;
+				while (property) {
+					property->flag |= XS_MARK_FLAG;
+					bytes += sizeof(txSlot) + fxSummarizeValue(the, summary, property);
+					property = property->next;
+				}
+				summary->count[kind]++;
+				summary->bytes[kind] += bytes;
+				fxRankHeapObject(summary, slot, kind, bytes);
+			}
+		}
+	}
+	// Everything else: keys, strings on their own, and engine bookkeeping
+	for (heap = the->firstHeap; heap; heap = heap->next) {
+		limit = heap->value.reference;
+		for (slot = heap + 1; slot < limit; slot++) {
+			if ((slot->kind == XS_INSTANCE_KIND) || (slot->flag & XS_MARK_FLAG))
+				continue;
+			switch (slot->kind) {
+			case XS_KEY_KIND:
+				summary->count[HEAP_KEYS]++;
+				summary->bytes[HEAP_KEYS] += sizeof(txSlot) + fxChunkBytes(slot->value.key.string);
+				break;
+			case XS_KEY_X_KIND:
+				summary->count[HEAP_KEYS]++;
+				summary->bytes[HEAP_KEYS] += sizeof(txSlot);
+				break;
+			case XS_STRING_KIND:
+			case XS_STRING_X_KIND:
+				summary->bytes[HEAP_STRINGS] += sizeof(txSlot);
+				fxSummarizeValue(the, summary, slot);
+				break;
+			default:
+				summary->count[HEAP_OTHER]++;
+				summary->bytes[HEAP_OTHER] += sizeof(txSlot);
+				break;
+			}
+		}
+	}
+	for (heap = the->firstHeap; heap; heap = heap->next) {
+		limit = heap->value.reference;
+		for (slot = heap + 1; slot < limit; slot++) {
+			if ((slot->kind == XS_INSTANCE_KIND) && !(slot->flag & XS_MARK_FLAG))
+				fxFindHeapRetainers(the, summary, slot);
+		}
+	}
+	// The collector leaves free slots undefined, so they have no strings
+	for (heap = the->firstHeap; heap; heap = heap->next) {
+		limit = heap->value.reference;
+		for (slot = heap + 1; slot < limit; slot++) {
+			slot->flag &= ~XS_MARK_FLAG;
+			fxUnmarkStrings(the, slot);
+		}
+	}
+}
+
+static void fxAppendText(txString buffer, txSize size, txSize* length, txString text)
+{
+	char c;
+	while ((c = *text++) && (*length < size))
+		buffer[(*length)++] = c;
+}
+
+// Append a key name as a JSON string, truncated to HEAP_KEY_MAX bytes
+static void fxAppendKeyName(txString buffer, txSize size, txSize* length, txString name)
+{
+	txInteger count = 0;
+	char c;
+	fxAppendText(buffer, size, length, "\"");
+	while ((c = *name++) && (count++ < HEAP_KEY_MAX) && (*length + 2 < size)) {
+		if ((c == '"') || (c == '\\'))
+			buffer[(*length)++] = '\\';
+		buffer[(*length)++] = ((unsigned char)c < 0x20) ? ' ' : c;
+	}
+	fxAppendText(buffer, size, length, "\"");
+}
+
+txSize fxDescribeHeap(txMachine* the, txString buffer, txSize size)
+{
+	txHeapSummary summary;
+	txSize length = 0;
+	char text[96];
+	txInteger i, j;
+	fxSummarizeHeap(the, &summary);
+	fxAppendText(buffer, size, &length, "{\"kinds\":{");
+	for (i = 0; i < HEAP_KIND_COUNT; i++) {
+		c_snprintf(text, sizeof(text), "%s\"%s\":{\"count\":%d,\"bytes\":%d}", i ? "," : "", gxHeapKindNames[i], (int)summary.count[i], (int)summary.bytes[i]);
+		fxAppendText(buffer, size, &length, text);
+	}
+	fxAppendText(buffer, size, &length, "},\"largest\":[");
+	for (i = 0; i < summary.largestCount; i++) {
+		txHeapObject* object = &summary.largest[i];
+		c_snprintf(text, sizeof(text), "%s{\"kind\":\"%s\",\"bytes\":%d,\"retainerCount\":%d,\"retainers\":[", i ? "," : "", gxHeapKindNames[object->kind], (int)object->bytes, (int)object->retainerCount);
+		fxAppendText(buffer, size, &length, text);
+		for (j = 0; (j < object->retainerCount) && (j < HEAP_RETAINER_COUNT); j++) {
+			txHeapRetainer* retainer = &object->retainers[j];
+			c_snprintf(text, sizeof(text), "%s{\"kind\":\"%s\"", j ? "," : "", gxHeapKindNames[retainer->kind]);
+			fxAppendText(buffer, size, &length, text);
+			if (retainer->index >= 0) {
+				c_snprintf(text, sizeof(text), ",\"index\":%d", (int)retainer->index);
+				fxAppendText(buffer, size, &length, text);
+			}
+			else if (retainer->id != XS_NO_ID) {
+				txString name = fxGetKeyName(the, retainer->id);
+				fxAppendText(buffer, size, &length, ",\"key\":");
+				fxAppendKeyName(buffer, size, &length, name ? name : "(symbol)");
+			}
+			fxAppendText(buffer, size, &length, "}");
+		}
+		fxAppendText(buffer, size, &length, "]}");
+	}
+	fxAppendText(buffer, size, &length, "]}");
+	return length;
+}
@@ -29,6 +29,16 @@ extern void fxEndMetering(xsMachine* the);
 
 mxImport void fxRunLoop(xsMachine* the);
 
+// Like xsRunLoop, but stops between generations of promise jobs once the meter
+// reaches `budget` (unless it's 0). Returns 1 if it stopped with jobs left.
+#define xsRunLoopUntil(_THE, _BUDGET) \
+	fxRunLoopUntil(_THE, _BUDGET)
+#define xsHasPendingJobs(_THE) \
+	fxHasPendingJobs(_THE)
+
+xsBooleanValue fxRunLoopUntil(xsMachine* the, xsUnsignedValue budget);
+xsBooleanValue fxHasPendingJobs(xsMachine* the);
+
 #define xsGetCurrentMeter(_THE) \
 	fxGetCurrentMeter(_THE)
 #define xsSetCurrentMeter(_THE, _VALUE) \
@@ -67,3 +77,64 @@ struct sxSnapshot {
 extern xsMachine* fxReadSnapshot(txSnapshot* snapshot, char* theName, void* theContext);
 extern int fxWriteSnapshot(xsMachine* the, txSnapshot* snapshot);
 
+
+// The address of the instance that an object reference points to, for
+// comparing objects by identity. NULL if the slot isn't an object.
+#define xsToInstance(_SLOT) \
+	fxToInstance(the, &(_SLOT))
+
+void* fxToInstance(xsMachine* the, xsSlot* slot);
+
+// The status passed to fxAbort by the last abort (e.g.
+// XS_NOT_ENOUGH_MEMORY_EXIT), or 0
+#define xsGetAbortStatus(_THE) \
+	fxGetAbortStatus(_THE)
+#define xsSetAbortStatus(_THE, _VALUE) \
+	fxSetAbortStatus(_THE, _VALUE)
+
+int fxGetAbortStatus(xsMachine* the);
+void fxSetAbortStatus(xsMachine* the, int status);
+
+// Limit the memory the machine can allocate for slots and chunks, or 0 for the
+// default limit. Allocating past the limit aborts with
+// XS_NOT_ENOUGH_MEMORY_EXIT.
+void fxSetAllocationLimit(xsMachine* the, size_t limit);
+
+#define MEMORY_STATS_COUNT 9
+
+// Fill `stats` with: slots in use, slots allocated, chunk bytes in use, chunk
+// bytes allocated, keys in use, garbage collections (0xFFFFFFFF unless XS is
+// built with mxInstrument), the bytes counted against the allocation limit,
+// and the bytes of the machine's arena, now and at most
+void fxGetMemoryStats(xsMachine* the, uint32_t* stats);
+
+// Compile a script (with the same semantics as indirect eval) or a module
+// without running it. Returns the serialized bytecode in a new allocation which
+// the caller must free, or NULL if the source has a syntax error. The parser's
+// first error is then put in `error` (of `errorSize` bytes) as "path:line:
+// message".
+void* fxCompileScript(xsMachine* the, char* source, xsSize size, char* path, xsBooleanValue module, xsSize* out_size, char* error, xsSize errorSize);
+
+// Run bytecode from fxCompileScript, putting the completion value in `result`.
+// Returns 0 if the bytecode is invalid or from a different version of XS.
+xsBooleanValue fxRunCompiledScript(xsMachine* the, void* buffer, xsSize size, xsSlot* result);
+
+// Parse a script read through `getter` (which returns the next byte of UTF-8
+// source, or EOF) and run it, with the same semantics as indirect eval. The
+// source is never held in memory as a whole. `bufferSize` is the size of the
+// parser's token buffer, which limits the largest string literal or template,
+// or 0 for the machine's parserBufferSize. The getter sets `*aborted` if it
+// fails to read the source, and then nothing runs. Returns 0 if the source has
+// a syntax error, described in `error` as for fxCompileScript.
+xsBooleanValue fxEvaluateStream(xsMachine* the, xsIntegerValue (*getter)(void*), void* stream, xsSize bufferSize, char* path, xsBooleanValue* aborted, xsSlot* result, char* error, xsSize errorSize);
+
+// Describe the JavaScript call stack in `buffer` as "outer;...;inner", where
+// each frame is its function name followed by " (path:line)" if known. Returns
+// the length, which is at most `size`. Not NUL-terminated.
+xsSize fxDescribeStack(xsMachine* the, char* buffer, xsSize size);
+
+// Collect garbage, then describe the heap as JSON in `buffer`: the number and
+// bytes of values of each kind, and the largest objects with some of what
+// refers to them. Returns the length, which is at most `size`. Not
+// NUL-terminated.
+xsSize fxDescribeHeap(xsMachine* the, char* buffer, xsSize size);
@@ -1,90 +1,615 @@
 #include "xs_sandbox.h"
 #include "xs.h"
 #include "wedge.h"
+#include "xs_sandbox_delta.h"
+#include "xs_sandbox_compress.h"
+#include "xs_sandbox_message.h"
 
+#include <math.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
 
+// Set by `make ASYNCIFY=1` for the build that can suspend a call partway
+// through guest code (see interruptCall)
+#ifndef SANDBOX_ASYNCIFY
+#define SANDBOX_ASYNCIFY 0
+#endif
+
 #define INITIAL_SNAPSHOT_CAPACITY 32 * 1024
+#define DEFAULT_SNAPSHOT_CHUNK_SIZE 64 * 1024
+// Samples are dropped once a profile reaches this size
+#define MAX_PROFILE_SIZE (64 * 1024 * 1024)
+#define MAX_SAMPLE_SIZE 4096
+// I/O buffers that grow past this are released after the call that needed
+// them, so that one large message doesn't pin memory for the life of the
+// sandbox
+#define IO_BUFFER_RETAIN (1024 * 1024)
+// Source for evaluateStream is read from the host in chunks of this size
+#define SOURCE_CHUNK_SIZE (64 * 1024)
+#define MAX_SOURCE_PATH 1024
+// Room for the parser's first error, after the path and line
+#define MAX_SYNTAX_ERROR (MAX_SOURCE_PATH + 256)
+// Room for the JSON of fxDescribeHeap, whose key names are truncated
+#define HEAP_SUMMARY_SIZE (16 * 1024)
 
-static uint32_t meteringLimit = 0;
-static uint32_t meteringInterval = 0;
-static uint32_t lastMeterValue = 0;
-static const int parserBufferSize = 1024 * 1024;
-static const char SNAPSHOT_SIGNATURE[] = "xs-sandbox-1";
+// Bumped whenever snapshotCallbacks or the globals that the host relies on
+// change, since a snapshot refers to host functions by their index in it
+static const char SNAPSHOT_SIGNATURE[] = "xs-sandbox-4";
 static char* MACHINE_NAME = "xs-sandbox";
+// Property of the function behind sendMessageAsync holding the calls that the
+// host hasn't settled, keyed by ID, each as [resolve, reject]. It also holds
+// the next ID as `nextId`. Keeping this in the heap means pending calls
+// survive snapshots. See populateGlobals.
+#define PENDING_HOST_CALLS "pending"
+// Global holding the clock of a deterministic sandbox until its prelude takes
+// it (see installClock)
+#define VIRTUAL_CLOCK "__virtualClock"
+
+// Used when the host doesn't specify the sizing of a new machine. This is the
+// host's "default" preset.
+static const TsMachineSizing defaultSizing = {
+  .initialChunkSize = 256 * 1024,
+  .incrementalChunkSize = 256 * 1024,
+  .initialHeapCount = 32 * 1024,
+  .incrementalHeapCount = 8 * 1024,
+  .stackCount = 4 * 1024,
+  .initialKeyCount = 4 * 1024,
+  .incrementalKeyCount = 4 * 1024,
+  .nameModulo = 1993,
+  .symbolModulo = 127,
+  .parserBufferSize = 1024 * 1024,
+  .parserTableModulo = 1993,
+};
 
 typedef struct TsSnapshotStream {
   uint8_t* data;
   size_t offset;
   size_t capacity;
+  // When streaming to the host, the handle of the sandbox being snapshotted
+  int handle;
 } TsSnapshotStream;
 
-static xsMachine* machine;
-static bool active = false;
+// State for each machine hosted in this WASM instance. The host refers to a
+// sandbox by its handle, which is an index into `sandboxes`.
+typedef struct TsSandbox {
+  int handle;
+  xsMachine* machine;
+  bool active;
+  uint32_t meteringLimit;
+  uint32_t meteringInterval;
+  uint32_t lastMeterValue;
+  // Bytes of slots and chunks the machine can allocate, or 0 for the default
+  uint32_t memoryLimit;
+  // The meter value after which the call is suspended (or 0 to run it to the
+  // end): partway through guest code if it can be (see interruptCall), or else
+  // between generations of promise jobs. The meter value at which the current
+  // slice ends, and whether the last call stopped with jobs left.
+  uint32_t timeSlice;
+  uint32_t sliceEnd;
+  bool suspended;
+  // Whether the current call can be suspended partway through guest code, and
+  // whether the host cancelled it while it was, so that it stops when resumed
+  bool interruptible;
+  bool cancelled;
+  // Set while the host calls sendMessageAsync to settle one of its calls,
+  // which the guest can't do (see host_sendMessageAsync)
+  bool settling;
+  // While profiling, the meter interval between samples, and the samples so
+  // far, one per line: the meter value, a space, then the stack as described
+  // by fxDescribeStack
+  bool profiling;
+  uint32_t profileInterval;
+  uint32_t lastSampleMeterValue;
+  uint32_t profileDropped;
+  TsMessageBuffer profile;
+  // While collecting stats, the time spent in each phase of the current (or
+  // last) outermost call, and the phase being timed
+  bool collectingStats;
+  CallPhase phase;
+  double phaseStart;
+  double phaseTime[PHASE_COUNT];
+  uint32_t hostCallbacks;
+  uint32_t gcCountAtStart;
+  // MESSAGE_FORMAT_JSON or MESSAGE_FORMAT_BINARY
+  int messageFormat;
+  // Reused by successive calls from the host: the payload of the call, its
+  // output, the guest's messages to the host, and the host's replies. Calls
+  // made while the sandbox is active get their own payload and output, since
+  // the outer call's are still in use.
+  TsMessageBuffer input;
+  TsMessageBuffer output;
+  TsMessageBuffer message;
+  TsMessageBuffer reply;
+  // Where the host finds the output of the last call: its address, its length,
+  // 1 if the host must free it, and the ErrorCode of the call
+  uint32_t ioResult[4];
+  // For deterministic sandboxes, the time the host gives the guest for the
+  // current call, in milliseconds since the epoch, or NaN for the real time
+  double clock;
+} TsSandbox;
+
+static TsSandbox** sandboxes = NULL;
+static int sandboxCount = 0;
+// Calls from the host on the C stack that can call back into it. A call can
+// only be suspended partway when it's the only one, since suspending unwinds
+// the C stack up to the host, which can't be done through the host's frames.
+// A suspended call stays counted until it finishes.
+static int entryDepth = 0;
+static bool sharedClusterInitialized = false;
 
 // Function callable by the guest to send a command to the host
 void host_sendMessage(xsMachine* the);
+void host_sendMessageAsync(xsMachine* the);
+void host_capturePromise(xsMachine* the);
+void host_virtualClock(xsMachine* the);
 void host_consoleLog(xsMachine* the);
 void host_consoleWarn(xsMachine* the);
 void host_consoleError(xsMachine* the);
 void host_consoleOutput(xsMachine* the, int level);
 
-extern ErrorCode sendMessage(uint8_t* buffer, size_t size, uint8_t** outputPtrPtr, size_t* outputSizePtr);
-extern void consoleLog(uint8_t* argsAsJson, size_t len, int level);
+extern ErrorCode sendMessage(int handle, uint8_t* buffer, size_t size, uint8_t** outputPtrPtr, size_t* outputSizePtr);
+extern ErrorCode sendMessageAsync(int handle, uint32_t id, uint8_t* buffer, size_t size, uint8_t** outputPtrPtr, size_t* outputSizePtr);
+extern void consoleLog(int handle, uint8_t* argsAsJson, size_t len, int level);
+extern int snapshotOutput(int handle, uint8_t* buffer, size_t size);
+// Fills `buffer` with up to `size` bytes of the source of an evaluateStream
+// call, returning the number of bytes, 0 at the end of the source, or -1 if the
+// host failed to read it
+extern int readSource(int handle, uint8_t* buffer, size_t size);
+// Milliseconds from a monotonic host clock
+extern double hostNow(void);
+#if SANDBOX_ASYNCIFY
+// Unwind the C stack to the host (with Asyncify), returning when the host
+// resumes the call
+extern void suspendGuest(int handle);
+#endif
 
-#define snapshotCallbackCount 2
+#define snapshotCallbackCount 5
 xsCallback snapshotCallbacks[snapshotCallbackCount] = {
   host_sendMessage,
   host_consoleLog,
+  host_sendMessageAsync,
+  host_capturePromise,
+  host_virtualClock,
 };
 
+static TsSandbox* allocateSandbox() {
+  int handle = 0;
+  // Reuse a free slot if there is one
+  while (handle < sandboxCount && sandboxes[handle]) {
+    handle++;
+  }
+  if (handle == sandboxCount) {
+    int newCount = sandboxCount ? sandboxCount * 2 : 8;
+    TsSandbox** newSandboxes = realloc(sandboxes, newCount * sizeof(TsSandbox*));
+    if (newSandboxes == NULL) {
+      return NULL;
+    }
+    memset(newSandboxes + sandboxCount, 0, (newCount - sandboxCount) * sizeof(TsSandbox*));
+    sandboxes = newSandboxes;
+    sandboxCount = newCount;
+  }
+  TsSandbox* sandbox = calloc(1, sizeof(TsSandbox));
+  if (sandbox == NULL) {
+    return NULL;
+  }
+  sandbox->handle = handle;
+  sandbox->clock = NAN;
+  sandboxes[handle] = sandbox;
+  return sandbox;
+}
+
+static void freeSandbox(TsSandbox* sandbox) {
+  sandboxes[sandbox->handle] = NULL;
+  free(sandbox->profile.data);
+  free(sandbox->input.data);
+  free(sandbox->output.data);
+  free(sandbox->message.data);
+  free(sandbox->reply.data);
+  free(sandbox);
+}
+
+// The handle of the sandbox that owns a machine, for units that only have its
+// context
+int getSandboxHandle(void* context) {
+  return ((TsSandbox*)context)->handle;
+}
+
+// The memory limit of the sandbox that owns a machine, or 0 for the default,
+// which applies from when the machine is created
+uint32_t getSandboxMemoryLimit(void* context) {
+  return ((TsSandbox*)context)->memoryLimit;
+}
+
+static TsSandbox* getSandbox(int handle) {
+  if (handle < 0 || handle >= sandboxCount) {
+    return NULL;
+  }
+  return sandboxes[handle];
+}
+
+static void initializeSharedCluster() {
+  // The shared cluster is per WASM instance, not per machine
+  if (!sharedClusterInitialized) {
+    xsInitializeSharedCluster();
+    sharedClusterInitialized = true;
+  }
+}
+
+static void sampleStack(TsSandbox* sandbox, xsUnsignedValue index) {
+  TsMessageBuffer* profile = &sandbox->profile;
+  uint8_t* p = NULL;
+  if (profile->length + MAX_SAMPLE_SIZE <= MAX_PROFILE_SIZE) {
+    p = messageBufferReserve(profile, MAX_SAMPLE_SIZE);
+  }
+  if (p == NULL) {
+    sandbox->profileDropped++;
+    return;
+  }
+  int prefix = snprintf((char*)p, MAX_SAMPLE_SIZE, "%u ", (unsigned)index);
+  xsSize length = fxDescribeStack(sandbox->machine, (char*)p + prefix, MAX_SAMPLE_SIZE - prefix - 1);
+  p[prefix + length] = '\n';
+  profile->length -= MAX_SAMPLE_SIZE - (prefix + length + 1);
+}
+
+// Attribute the time since the last switch to the current phase, and start
+// timing `phase`. Returns the phase that was current. Does nothing unless
+// collecting stats.
+static CallPhase switchPhase(TsSandbox* sandbox, CallPhase phase) {
+  CallPhase previous = sandbox->phase;
+  if (!sandbox->collectingStats) {
+    return previous;
+  }
+  double now = hostNow();
+  if (previous != PHASE_NONE) {
+    sandbox->phaseTime[previous] += now - sandbox->phaseStart;
+  }
+  sandbox->phase = phase;
+  sandbox->phaseStart = now;
+  return previous;
+}
+
+// Start a call into the host from a host function. Reentrant calls that the
+// host makes into the sandbox count as part of the callback rather than being
+// timed themselves. Returns the state to pass to endHostCallback.
+static bool beginHostCallback(TsSandbox* sandbox) {
+  bool collecting = sandbox->collectingStats;
+  switchPhase(sandbox, PHASE_HOST_CALLBACK);
+  sandbox->hostCallbacks++;
+  sandbox->collectingStats = false;
+  return collecting;
+}
+
+// End a host callback, continuing with `phase`
+static void endHostCallback(TsSandbox* sandbox, bool collecting, CallPhase phase) {
+  sandbox->collectingStats = collecting;
+  switchPhase(sandbox, phase);
+}
+
+static uint32_t getGCCount(xsMachine* the) {
+  uint32_t stats[MEMORY_STATS_COUNT];
+  fxGetMemoryStats(the, stats);
+  return stats[5];
+}
+
+#if SANDBOX_ASYNCIFY
+// Suspend the current call partway through guest code, until the host resumes
+// it. A metering check is a safe point for this, since the machine saves its
+// registers around it as it would around a host function. The time suspended
+// isn't counted in any phase of the call.
+static void interruptCall(TsSandbox* sandbox) {
+  CallPhase phase = switchPhase(sandbox, PHASE_NONE);
+  sandbox->ioResult[3] = EC_INTERRUPTED;
+  suspendGuest(sandbox->handle);
+  switchPhase(sandbox, phase);
+}
+#endif
+
 static xsBooleanValue meteringCallback(xsMachine* the, xsUnsignedValue index) {
-  if (!meteringLimit) return 1;
-  lastMeterValue = index;
-  return index < meteringLimit;
+  TsSandbox* sandbox = xsGetContext(the);
+  if (sandbox->profiling && (index - sandbox->lastSampleMeterValue >= sandbox->profileInterval)) {
+    sandbox->lastSampleMeterValue = index;
+    sampleStack(sandbox, index);
+  }
+  if (sandbox->meteringLimit) {
+    sandbox->lastMeterValue = index;
+    if (index >= sandbox->meteringLimit) {
+      return 0;
+    }
+  }
+#if SANDBOX_ASYNCIFY
+  if (sandbox->timeSlice && (index >= sandbox->sliceEnd) && sandbox->interruptible && (entryDepth == 1)) {
+    interruptCall(sandbox);
+    if (sandbox->cancelled) {
+      return 0;
+    }
+    sandbox->sliceEnd = index + sandbox->timeSlice;
+  }
+#endif
+  return 1;
+}
+
+uint32_t getMeteringLimit(int handle) {
+  return getSandbox(handle)->meteringLimit;
+}
+
+void setMeteringLimit(int handle, uint32_t limit) {
+  getSandbox(handle)->meteringLimit = limit;
+}
+
+uint32_t getMeteringInterval(int handle) {
+  return getSandbox(handle)->meteringInterval;
+}
+
+void setMeteringInterval(int handle, uint32_t interval) {
+  getSandbox(handle)->meteringInterval = interval;
+}
+
+// Empty `buffer` and make room for `size` bytes
+static uint8_t* ioReserve(TsMessageBuffer* buffer, size_t size) {
+  buffer->length = 0;
+  // Always allocate, so that the buffer has an address
+  return messageBufferReserve(buffer, size ? size : 1);
+}
+
+static void ioRelease(TsMessageBuffer* buffer) {
+  if (buffer->capacity > IO_BUFFER_RETAIN) {
+    free(buffer->data);
+    memset(buffer, 0, sizeof(*buffer));
+  }
+}
+
+/**
+ * Space for the host to write a payload of `size` bytes to pass to
+ * sandboxInput or sandboxInputBatch. This is the sandbox's input buffer,
+ * except during a call into the sandbox, when it's a new allocation that the
+ * next sandboxInput or sandboxInputBatch frees. Returns NULL if out of memory.
+ */
+uint8_t* reserveInput(int handle, size_t size) {
+  TsSandbox* sandbox = getSandbox(handle);
+  if (sandbox->active) {
+    return malloc(size ? size : 1);
+  }
+  return ioReserve(&sandbox->input, size);
+}
+
+/**
+ * Space for the host to write its reply to the guest's sendMessage or
+ * sendMessageAsync. The guest decodes each reply before it can call the host
+ * again, so the one buffer serves nested calls too.
+ */
+uint8_t* reserveReply(int handle, size_t size) {
+  return ioReserve(&getSandbox(handle)->reply, size);
+}
+
+/**
+ * The address of the sandbox's ioResult, which is where the host finds the
+ * output of each call. The address doesn't change for the life of the sandbox.
+ */
+uint32_t* getIOResult(int handle) {
+  return getSandbox(handle)->ioResult;
+}
+
+uint32_t getTimeSlice(int handle) {
+  return getSandbox(handle)->timeSlice;
+}
+
+void setTimeSlice(int handle, uint32_t slice) {
+  getSandbox(handle)->timeSlice = slice;
+}
+
+uint32_t getSuspended(int handle) {
+  return getSandbox(handle)->suspended;
+}
+
+/**
+ * Whether this build can suspend a call partway through guest code. Without
+ * it, a time slice only suspends the guest between generations of promise
+ * jobs.
+ */
+uint32_t canInterrupt(void) {
+  return SANDBOX_ASYNCIFY;
+}
+
+/**
+ * The number of calls from the host in progress, counting a call that's
+ * suspended partway. The host can only resume such a call when it's the only
+ * one.
+ */
+uint32_t getEntryDepth(void) {
+  return entryDepth;
+}
+
+/**
+ * Make a call that's suspended partway stop as soon as it's resumed, as if it
+ * ran out of meter, e.g. so that the sandbox can be disposed of
+ */
+void cancelCall(int handle) {
+  getSandbox(handle)->cancelled = true;
+}
+
+void setMessageFormat(int handle, int format) {
+  getSandbox(handle)->messageFormat = format;
+}
+
+uint32_t getMemoryLimit(int handle) {
+  return getSandbox(handle)->memoryLimit;
+}
+
+void setMemoryLimit(int handle, uint32_t limit) {
+  TsSandbox* sandbox = getSandbox(handle);
+  sandbox->memoryLimit = limit;
+  fxSetAllocationLimit(sandbox->machine, limit);
+}
+
+/**
+ * Write the sandbox's memory stats to `stats`, which must have room for
+ * MEMORY_STATS_COUNT values. See fxGetMemoryStats for the order.
+ */
+void getMemoryStats(int handle, uint32_t* stats) {
+  fxGetMemoryStats(getSandbox(handle)->machine, stats);
+}
+
+/**
+ * Enable or disable timing the phases of each call into the sandbox. See
+ * getCallStats.
+ */
+void setCollectingStats(int handle, int enabled) {
+  TsSandbox* sandbox = getSandbox(handle);
+  sandbox->collectingStats = enabled;
+  sandbox->phase = PHASE_NONE;
 }
 
-uint32_t getMeteringLimit() {
-  return meteringLimit;
+/**
+ * Write CALL_STATS_COUNT values describing the last outermost call into the
+ * sandbox, if stats were being collected during it. See CallPhase.
+ */
+void getCallStats(int handle, double* stats) {
+  TsSandbox* sandbox = getSandbox(handle);
+  for (int i = 0; i < PHASE_COUNT; i++) {
+    stats[i] = sandbox->phaseTime[i];
+  }
+  stats[PHASE_COUNT] = sandbox->hostCallbacks;
+  uint32_t gcCount = getGCCount(sandbox->machine);
+  stats[PHASE_COUNT + 1] = gcCount == 0xFFFFFFFF ? -1 : (double)(gcCount - sandbox->gcCountAtStart);
 }
 
-void setMeteringLimit(uint32_t limit) {
-  meteringLimit = limit;
+/**
+ * Start sampling the guest's call stack every `interval` meter units
+ */
+void startProfiling(int handle, uint32_t interval) {
+  TsSandbox* sandbox = getSandbox(handle);
+  sandbox->profiling = true;
+  sandbox->profileInterval = interval ? interval : 1;
+  sandbox->lastSampleMeterValue = 0;
+  sandbox->profileDropped = 0;
+  sandbox->profile.length = 0;
 }
 
-uint32_t getMeteringInterval() {
-  return meteringInterval;
+/**
+ * Stop profiling and hand the samples to the caller, who must free them.
+ * Returns the number of samples dropped because the profile was too large.
+ */
+uint32_t stopProfiling(int handle, uint8_t** out_buffer, size_t* out_size) {
+  TsSandbox* sandbox = getSandbox(handle);
+  sandbox->profiling = false;
+  *out_buffer = sandbox->profile.data;
+  *out_size = sandbox->profile.length;
+  memset(&sandbox->profile, 0, sizeof(sandbox->profile));
+  return sandbox->profileDropped;
 }
 
-void setMeteringInterval(uint32_t interval) {
-  meteringInterval = interval;
+/**
+ * Describe the composition of the sandbox's heap as JSON (see fxDescribeHeap),
+ * in a buffer which the caller must free. Collects garbage first.
+ */
+void getHeapSummary(int handle, uint8_t** out_buffer, size_t* out_size) {
+  TsSandbox* sandbox = getSandbox(handle);
+  char* buffer = malloc(HEAP_SUMMARY_SIZE);
+  *out_buffer = (uint8_t*)buffer;
+  *out_size = buffer ? fxDescribeHeap(sandbox->machine, buffer, HEAP_SUMMARY_SIZE) : 0;
 }
 
-uint32_t getActive() {
-  return active;
+uint32_t getActive(int handle) {
+  return getSandbox(handle)->active;
 }
 
-uint32_t getMeteringCount() {
-  if (active) {
-    return xsGetCurrentMeter(machine);
+uint32_t getMeteringCount(int handle) {
+  TsSandbox* sandbox = getSandbox(handle);
+  if (sandbox->active) {
+    return xsGetCurrentMeter(sandbox->machine);
   } else {
-    return lastMeterValue;
+    return sandbox->lastMeterValue;
+  }
+}
+
+// Generated at link time from a hash of the objects, lib.js, the text of the
+// makefile, the build variant, INITIAL_MEMORY and STACK_SIZE, and the compiler
+// version, which between them determine the layout of memory (see the
+// makefile)
+extern const char buildHash[];
+
+/**
+ * Identifies the engine build, which must match for a raw image of memory to
+ * be loaded
+ */
+const char* getBuildHash(void) {
+  return buildHash;
+}
+
+/**
+ * For fork and memory images: the end of the linear memory in use. Everything
+ * the instance and its sandboxes own, including the malloc heap and the break
+ * itself, is below it.
+ */
+size_t getHeapEnd(void) {
+  return (size_t)sbrk(0);
+}
+
+/**
+ * For fork and memory images: grow linear memory to at least `end`, so that
+ * the memory of another instance of the same module can be copied over it.
+ * Returns 0 if out of memory.
+ */
+int reserveHeap(size_t end) {
+  size_t current = (size_t)sbrk(0);
+  if (end > current && sbrk(end - current) == (void*)-1) {
+    return 0;
   }
+  return 1;
+}
+
+/**
+ * Where the host sets the clock of a deterministic sandbox (see TsSandbox)
+ */
+double* getClock(int handle) {
+  return &getSandbox(handle)->clock;
+}
+
+/**
+ * For deterministic sandboxes: define the global function __virtualClock,
+ * which returns the clock set by the host. The deterministic prelude keeps it
+ * for its Date, and deletes the global.
+ */
+void installClock(int handle) {
+  xsMachine* the = getSandbox(handle)->machine;
+  xsBeginHost(the);
+  {
+    xsVars(1);
+    xsVar(0) = xsNewHostFunction(host_virtualClock, 0);
+    xsDefine(xsGlobal, xsID(VIRTUAL_CLOCK), xsVar(0), xsDontEnum);
+  }
+  xsEndHost(the);
 }
 
 void populateGlobals(xsMachine* the) {
-  xsBeginHost(machine);
+  xsBeginHost(the);
 	{
-    xsVars(2);
+    xsVars(3);
 
     // Global sendMessage
     xsVar(0) = xsNewHostFunction(host_sendMessage, 1);
     xsDefine(xsGlobal, xsID("sendMessage"), xsVar(0), xsDontEnum);
 
+    // Global sendMessageAsync. The guest gets a bound copy of the host
+    // function, so it can't reach the function's table of pending calls, or
+    // the Promise constructor it keeps in case the guest replaces the global
+    // one. The table has no prototype, so that the guest can't add calls to it
+    // through Object.prototype.
+    xsVar(0) = xsNewHostFunction(host_sendMessageAsync, 1);
+    xsVar(1) = xsGet(xsGlobal, xsID("Object"));
+    xsVar(1) = xsCall1(xsVar(1), xsID("create"), xsNull);
+    xsVar(2) = xsInteger(1);
+    xsSet(xsVar(1), xsID("nextId"), xsVar(2));
+    xsDefine(xsVar(0), xsID(PENDING_HOST_CALLS), xsVar(1), xsDontEnum);
+    xsVar(1) = xsGet(xsGlobal, xsID("Promise"));
+    xsDefine(xsVar(0), xsID("Promise"), xsVar(1), xsDontEnum);
+    xsVar(0) = xsCall1(xsVar(0), xsID("bind"), xsUndefined);
+    xsDefine(xsGlobal, xsID("sendMessageAsync"), xsVar(0), xsDontEnum | xsDontDelete | xsDontSet);
+
     // Create global console object
     xsVar(0) = xsNewObject();
     xsDefine(xsGlobal, xsID("console"), xsVar(0), xsDontEnum);
@@ -97,7 +622,7 @@ void populateGlobals(xsMachine* the) {
     // and not to support console.error because Error objects don't serialize
     // well (and errors would be a common thing to pass to console.error).
   }
-  xsEndHost(machine);
+  xsEndHost(the);
 }
 
 int snapshotReadChunk(void* stream, void* address, size_t size) {
@@ -136,21 +661,76 @@ int snapshotWriteChunk(void* stream, void* address, size_t size) {
   return 0;
 }
 
-int restoreSnapshot(uint8_t* buffer, size_t size) {
-  TsSnapshotStream stream = {
-    .data = buffer,
-    .offset = 0,
-    .capacity = size,
-  };
+/**
+ * Snapshot writer which forwards the snapshot to the host in chunks of at most
+ * `capacity` bytes rather than accumulating the whole snapshot in memory.
+ */
+int snapshotWriteToHost(void* stream, void* address, size_t size) {
+  TsSnapshotStream* snapshotStream = (TsSnapshotStream*)stream;
+  uint8_t* source = address;
+
+  while (size > 0) {
+    size_t count = snapshotStream->capacity - snapshotStream->offset;
+    if (count > size) {
+      count = size;
+    }
+    memcpy(snapshotStream->data + snapshotStream->offset, source, count);
+    snapshotStream->offset += count;
+    source += count;
+    size -= count;
+
+    if (snapshotStream->offset == snapshotStream->capacity) {
+      if (snapshotOutput(snapshotStream->handle, snapshotStream->data, snapshotStream->offset)) {
+        return 1;
+      }
+      snapshotStream->offset = 0;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Write a snapshot of the machine through `write`. If `base` is provided, the
+ * snapshot is delta-encoded against it on the way through, and if `compress` is
+ * set then the result is compressed.
+ */
+static int writeSnapshot(TsSandbox* sandbox, TsStreamCallback write, void* stream, uint8_t* base, size_t baseSize, int compress) {
+  int result = 0;
+  // The delta is against the uncompressed image
+  uint8_t* decompressedBase = NULL;
+  TsLzEncoder compressor = { 0 };
+  TsDeltaEncoder encoder = { 0 };
+
+  if (base && isCompressed(base, baseSize)) {
+    if (lzDecompressBuffer(base, baseSize, &decompressedBase, &baseSize)) {
+      goto done;
+    }
+    base = decompressedBase;
+  }
+  if (compress) {
+    if (lzEncoderInit(&compressor, write, stream)) {
+      goto done;
+    }
+    write = lzEncoderWrite;
+    stream = &compressor;
+  }
+  if (base) {
+    if (deltaEncoderInit(&encoder, base, baseSize, write, stream)) {
+      goto done;
+    }
+    write = deltaEncoderWrite;
+    stream = &encoder;
+  }
 
   txSnapshot snapshotOpts = {
 		(char*)SNAPSHOT_SIGNATURE,
 		sizeof(SNAPSHOT_SIGNATURE) - 1,
 		snapshotCallbacks,
 		snapshotCallbackCount,
-		snapshotReadChunk,
 		NULL,
-		&stream,
+		write,
+		stream,
 		0,
 		NULL,
 		NULL,
@@ -159,32 +739,87 @@ int restoreSnapshot(uint8_t* buffer, size_t size) {
 		NULL
 	};
 
-  machine = fxReadSnapshot(&snapshotOpts, MACHINE_NAME, NULL);
+  result = fxWriteSnapshot(sandbox->machine, &snapshotOpts);
 
-  if (machine) {
-    return 0;
-  } else {
-    return 1;
+  if (result && base && deltaEncoderFinish(&encoder)) {
+    result = 0;
   }
+  if (result && compress && lzEncoderFinish(&compressor)) {
+    result = 0;
+  }
+
+done:
+  deltaEncoderFree(&encoder);
+  lzEncoderFree(&compressor);
+  free(decompressedBase);
+  return result;
 }
 
-int takeSnapshot(uint8_t** out_buffer, size_t* out_size) {
-  *out_size = 0;
+/**
+ * Restore a machine from a snapshot. The snapshot may be compressed, and if it
+ * is a delta then `base` must be the snapshot it was taken against. The memory
+ * limit (0 for the default) already applies while the heap is read, so a
+ * snapshot larger than the default limit can be restored. Returns the handle
+ * of the new machine, or -1 on failure.
+ */
+int restoreSnapshot(uint8_t* buffer, size_t size, uint8_t* base, size_t baseSize, uint32_t memoryLimit) {
+  initializeSharedCluster();
+
+  TsSandbox* sandbox = allocateSandbox();
+  if (sandbox == NULL) {
+    return -1;
+  }
+  sandbox->memoryLimit = memoryLimit;
+
+  uint8_t* decompressedBase = NULL;
+  TsLzDecoder decompressor = { 0 };
+  TsDeltaDecoder decoder = { 0 };
 
   TsSnapshotStream stream = {
-    .data = malloc(INITIAL_SNAPSHOT_CAPACITY),
+    .data = buffer,
     .offset = 0,
-    .capacity = INITIAL_SNAPSHOT_CAPACITY,
+    .capacity = size,
   };
+  TsStreamCallback read = snapshotReadChunk;
+  void* readStream = &stream;
+  // The start of the uncompressed content, to check whether it's a delta
+  const uint8_t* head = buffer;
+  size_t headSize = size;
+
+  if (isCompressed(buffer, size)) {
+    if (lzDecoderInit(&decompressor, read, readStream)) {
+      goto failed;
+    }
+    read = lzDecoderRead;
+    readStream = &decompressor;
+    head = lzDecoderPeek(&decompressor, &headSize);
+  }
+
+  if (isDelta(head, headSize)) {
+    if (!base) {
+      goto failed;
+    }
+    if (isCompressed(base, baseSize)) {
+      if (lzDecompressBuffer(base, baseSize, &decompressedBase, &baseSize)) {
+        goto failed;
+      }
+      base = decompressedBase;
+    }
+    if (deltaDecoderInit(&decoder, base, baseSize, read, readStream)) {
+      goto failed;
+    }
+    read = deltaDecoderRead;
+    readStream = &decoder;
+  }
 
   txSnapshot snapshotOpts = {
 		(char*)SNAPSHOT_SIGNATURE,
 		sizeof(SNAPSHOT_SIGNATURE) - 1,
 		snapshotCallbacks,
 		snapshotCallbackCount,
+		read,
 		NULL,
-		snapshotWriteChunk,
-		&stream,
+		readStream,
 		0,
 		NULL,
 		NULL,
@@ -193,7 +828,36 @@ int takeSnapshot(uint8_t** out_buffer, size_t* out_size) {
 		NULL
 	};
 
-  int result = fxWriteSnapshot(machine, &snapshotOpts);
+  sandbox->machine = fxReadSnapshot(&snapshotOpts, MACHINE_NAME, sandbox);
+
+failed:
+  lzDecoderFree(&decompressor);
+  free(decompressedBase);
+
+  if (sandbox->machine) {
+    // E.g. if the snapshot was taken while suspended
+    sandbox->suspended = xsHasPendingJobs(sandbox->machine);
+    return sandbox->handle;
+  } else {
+    freeSandbox(sandbox);
+    return -1;
+  }
+}
+
+/**
+ * Take a snapshot into a single buffer, which the caller must free. If `base`
+ * is provided, the result is a delta against it.
+ */
+int takeSnapshot(int handle, uint8_t* base, size_t baseSize, int compress, uint8_t** out_buffer, size_t* out_size) {
+  *out_size = 0;
+
+  TsSnapshotStream stream = {
+    .data = malloc(INITIAL_SNAPSHOT_CAPACITY),
+    .offset = 0,
+    .capacity = INITIAL_SNAPSHOT_CAPACITY,
+  };
+
+  int result = writeSnapshot(getSandbox(handle), snapshotWriteChunk, &stream, base, baseSize, compress);
 
   *out_buffer = stream.data;
   *out_size = stream.offset;
@@ -201,120 +865,438 @@ int takeSnapshot(uint8_t** out_buffer, size_t* out_size) {
   return result;
 }
 
-void initMachine() {
-  xsInitializeSharedCluster();
+/**
+ * Take a snapshot, passing it to the host's `snapshotOutput` in chunks of at
+ * most `chunkSize` bytes as it is written. The extra memory used is just the
+ * one chunk, regardless of the size of the heap.
+ */
+int streamSnapshot(int handle, size_t chunkSize, uint8_t* base, size_t baseSize, int compress) {
+  if (chunkSize == 0) {
+    chunkSize = DEFAULT_SNAPSHOT_CHUNK_SIZE;
+  }
+
+  TsSnapshotStream stream = {
+    .data = malloc(chunkSize),
+    .offset = 0,
+    .capacity = chunkSize,
+    .handle = handle,
+  };
+  if (stream.data == NULL) {
+    return 0;
+  }
+
+  entryDepth++;
+  int result = writeSnapshot(getSandbox(handle), snapshotWriteToHost, &stream, base, baseSize, compress);
+
+  // Flush the last partial chunk
+  if (result && stream.offset > 0) {
+    if (snapshotOutput(handle, stream.data, stream.offset)) {
+      result = 0;
+    }
+  }
+
+  free(stream.data);
+  entryDepth--;
+
+  return result;
+}
+
+/**
+ * Create a new machine, sized according to `sizing` (or the defaults if NULL).
+ * Returns the handle of the new machine, or -1 on failure.
+ */
+int initMachine(const TsMachineSizing* sizing) {
+  initializeSharedCluster();
+
+  TsSandbox* sandbox = allocateSandbox();
+  if (sandbox == NULL) {
+    return -1;
+  }
 
+  if (sizing == NULL) {
+    sizing = &defaultSizing;
+  }
   xsCreation _creation = {
-    256 * 1024,       /* initialChunkSize     */
-    256 * 1024,       /* incrementalChunkSize */
-    32 * 1024,        /* initialHeapCount     */
-    8 * 1024,         /* incrementalHeapCount */
-    4 * 1024,         /* stackCount           */
-    4 * 1024,         /* initialKeyCount      */
-    4 * 1024,         /* incrementalKeyCount  */
-    1993,             /* nameModulo           */
-    127,              /* symbolModulo         */
-    parserBufferSize, /* parserBufferSize     */
-    1993,             /* parserTableModulo    */
+    sizing->initialChunkSize,
+    sizing->incrementalChunkSize,
+    sizing->initialHeapCount,
+    sizing->incrementalHeapCount,
+    sizing->stackCount,
+    sizing->initialKeyCount,
+    sizing->incrementalKeyCount,
+    sizing->nameModulo,
+    sizing->symbolModulo,
+    sizing->parserBufferSize,
+    sizing->parserTableModulo,
   };
   xsCreation* creation = &_creation;
 
-  machine = xsCreateMachine(creation, MACHINE_NAME, NULL);
-  populateGlobals(machine);
+  sandbox->machine = xsCreateMachine(creation, MACHINE_NAME, sandbox);
+  if (sandbox->machine == NULL) {
+    freeSandbox(sandbox);
+    return -1;
+  }
+  populateGlobals(sandbox->machine);
+  return sandbox->handle;
 }
 
 /**
- * Handle input from host when reentering the sandbox
+ * Delete a machine and release its handle
  */
-static ErrorCode sandboxInputReenter(uint8_t* payload, uint32_t** out_buffer, uint32_t* out_size, int action) {
-  *out_buffer = NULL;
-  *out_size = 0;
-  ErrorCode code = EC_OK_UNDEFINED;
+void destroyMachine(int handle) {
+  TsSandbox* sandbox = getSandbox(handle);
+  if (sandbox == NULL || sandbox->active) {
+    return;
+  }
+  xsDeleteMachine(sandbox->machine);
+  freeSandbox(sandbox);
+}
 
-  xsMachine* the = machine;
-  xsVars(3);
+// Serialized in place of an exception that there's no room for
+static const char FALLBACK_EXCEPTION[] = "{\"message\":\"out of memory\"}";
+#define FALLBACK_EXCEPTION_SIZE (sizeof(FALLBACK_EXCEPTION) - 1)
+
+/**
+ * Append the current exception to `output` as a JSON {message, stack, name},
+ * and clear it. If there's no room for it, FALLBACK_EXCEPTION is appended
+ * instead, which always fits if the caller reserved room for it beforehand.
+ * Uses xsVar(0) and xsVar(1) of the calling frame.
+ */
+static void serializeException(xsMachine* the, TsMessageBuffer* output) {
+  // New object to send serialized error
+  xsVar(0) = xsNewObject();
+  if (xsTypeOf(xsException) != xsUndefinedType) {
+    if (xsIsInstanceOf(xsException, xsErrorPrototype)) {
+      // Copy message property
+      xsVar(1) = xsGet(xsException, xsID("message"));
+      xsSet(xsVar(0), xsID("message"), xsVar(1));
+      // Copy stack property
+      xsVar(1) = xsGet(xsException, xsID("stack"));
+      xsSet(xsVar(0), xsID("stack"), xsVar(1));
+      // Copy name property
+      xsVar(1) = xsGet(xsException, xsID("name"));
+      xsSet(xsVar(0), xsID("name"), xsVar(1));
+    } else {
+      // Just do `exception.toString()` to infer a message
+      xsVar(1) = xsCall0(xsException, xsID("toString"));
+      xsSet(xsVar(0), xsID("message"), xsVar(1));
+    }
+  } else {
+    xsVar(1) = xsString("Unknown error");
+    xsSet(xsVar(0), xsID("message"), xsVar(1));
+  }
+  // Serialize error
+  xsVar(1) = xsGet(xsGlobal, xsID("JSON"));
+  xsVar(0) = xsCall1(xsVar(1), xsID("stringify"), xsVar(0));
+  char* message = xsToString(xsVar(0));
+  size_t messageSize = strlen(message);
+  uint8_t* p = messageBufferReserve(output, messageSize);
+  if (p == NULL) {
+    message = (char*)FALLBACK_EXCEPTION;
+    messageSize = FALLBACK_EXCEPTION_SIZE;
+    p = messageBufferReserve(output, messageSize);
+  }
+  if (p) {
+    memcpy(p, message, messageSize);
+  }
+  xsException = xsUndefined;
+}
+
+/**
+ * Settle a call to sendMessageAsync. The payload is the uint32 ID of the call,
+ * a uint8 which is 1 to reject it, then the value to resolve it with (in the
+ * sandbox's message format) or the JSON error to reject it with. Uses xsVar(0)
+ * to xsVar(3) of the calling frame.
+ */
+static void settleHostCall(TsSandbox* sandbox, uint8_t* payload, size_t payloadSize) {
+  xsMachine* the = sandbox->machine;
+  uint32_t id;
+  if (payloadSize < 5) {
+    xsTypeError("invalid settlement");
+  }
+  memcpy(&id, payload, 4);
+  bool rejected = payload[4] != 0;
+  payload += 5;
+  payloadSize -= 5;
+
+  if (sandbox->messageFormat == MESSAGE_FORMAT_BINARY && !rejected) {
+    decodeMessage(the, payload, payloadSize, &xsVar(1));
+  } else {
+    xsVar(0) = xsStringBuffer((char*)payload, payloadSize);
+    xsVar(1) = xsGet(xsGlobal, xsID("JSON"));
+    xsVar(1) = xsCall1(xsVar(1), xsID("parse"), xsVar(0));
+  }
+  if (rejected) {
+    xsVar(1) = xsGet(xsVar(1), xsID("message"));
+    xsVar(1) = xsNew1(xsGlobal, xsID("Error"), xsVar(1));
+  }
+
+  switchPhase(sandbox, PHASE_DISPATCH);
+  // The global can't be replaced by the guest
+  xsVar(0) = xsGet(xsGlobal, xsID("sendMessageAsync"));
+  xsVar(2) = xsUnsigned(id);
+  xsVar(3) = xsBoolean(rejected);
+  sandbox->settling = true;
+  xsCallFunction3(xsVar(0), xsUndefined, xsVar(2), xsVar(3), xsVar(1));
+}
+
+typedef struct TsSourceStream {
+  int handle;
+  uint8_t* data;
+  size_t offset;
+  size_t size;
+  bool done;
+  xsBooleanValue failed;
+} TsSourceStream;
+
+// Parser getter which reads the source from the host a chunk at a time
+static xsIntegerValue readSourceByte(void* p) {
+  TsSourceStream* stream = p;
+  if (stream->offset == stream->size) {
+    if (stream->done) {
+      return EOF;
+    }
+    int size = readSource(stream->handle, stream->data, SOURCE_CHUNK_SIZE);
+    stream->offset = 0;
+    stream->size = size > 0 ? size : 0;
+    if (size <= 0) {
+      stream->done = true;
+      stream->failed = size < 0 ? 1 : 0;
+      return EOF;
+    }
+  }
+  return stream->data[stream->offset++];
+}
+
+/**
+ * Parse and run a script whose source is read from the host with readSource,
+ * so that the source is never in memory as a whole. The payload is the uint32
+ * size of the parser's buffer (0 for the default), then the file name, if any.
+ */
+static void evaluateStream(TsSandbox* sandbox, uint8_t* payload, size_t payloadSize, xsSlot* result) {
+  xsMachine* the = sandbox->machine;
+  uint32_t bufferSize;
+  char path[MAX_SOURCE_PATH];
+  if (payloadSize < 4) {
+    xsTypeError("invalid stream header");
+  }
+  memcpy(&bufferSize, payload, 4);
+  size_t pathSize = payloadSize - 4;
+  if (pathSize >= MAX_SOURCE_PATH) {
+    pathSize = MAX_SOURCE_PATH - 1;
+  }
+  memcpy(path, payload + 4, pathSize);
+  path[pathSize] = 0;
+
+  TsSourceStream stream = { .handle = sandbox->handle };
+  stream.data = malloc(SOURCE_CHUNK_SIZE);
+  if (stream.data == NULL) {
+    xsUnknownError("out of memory");
+  }
+  xsBooleanValue parsed = 0;
+  char error[MAX_SYNTAX_ERROR];
   xsTry {
-    xsVar(0) = xsString(payload);
+    parsed = fxEvaluateStream(the, readSourceByte, &stream, bufferSize, pathSize ? path : NULL, &stream.failed, result, error, sizeof(error));
+  }
+  xsCatch {
+    free(stream.data);
+    xsThrow(xsException);
+  }
+  free(stream.data);
+  // The host reports its own error in place of this one
+  if (stream.failed) {
+    xsUnknownError("cannot read source");
+  }
+  if (!parsed) {
+    xsSyntaxError("%s", error);
+  }
+}
 
-    if (action == 0) {
+/**
+ * Handle one input from the host, appending the result or the serialized
+ * exception to `output`. The action is 0 to evaluate source code, 1 to deliver
+ * a message, 2 to run bytecode from compileScript, 3 to settle a call to
+ * sendMessageAsync (see settleHostCall), or 5 to evaluate source streamed from
+ * the host (see evaluateStream).
+ */
+static ErrorCode sandboxDispatch(TsSandbox* sandbox, uint8_t* payload, size_t payloadSize, int action, TsMessageBuffer* output) {
+  ErrorCode code = EC_OK_UNDEFINED;
+  bool binary = sandbox->messageFormat == MESSAGE_FORMAT_BINARY;
+  size_t start = output->length;
+
+  xsMachine* the = sandbox->machine;
+  xsVars(4);
+  xsTry {
+    switchPhase(sandbox, PHASE_DECODE);
+    if (action == 3) {
+      settleHostCall(sandbox, payload, payloadSize);
+      xsVar(1) = xsUndefined;
+    } else if (action == 0) {
+      xsVar(0) = xsStringBuffer((char*)payload, payloadSize);
+      switchPhase(sandbox, PHASE_DISPATCH);
       xsVar(1) = xsCall1(xsGlobal, xsID("eval"), xsVar(0));
+    } else if (action == 2) {
+      switchPhase(sandbox, PHASE_DISPATCH);
+      if (!fxRunCompiledScript(the, payload, payloadSize, &xsVar(1))) {
+        xsTypeError("invalid compiled script");
+      }
+    } else if (action == 5) {
+      // Parsing is interleaved with reading, so it all counts as dispatch
+      switchPhase(sandbox, PHASE_DISPATCH);
+      evaluateStream(sandbox, payload, payloadSize, &xsVar(1));
     } else {
-      xsVar(1) = xsGet(xsGlobal, xsID("JSON"));
-      xsVar(1) = xsCall1(xsVar(1), xsID("parse"), xsVar(0));
+      if (binary) {
+        decodeMessage(the, payload, payloadSize, &xsVar(1));
+      } else {
+        xsVar(0) = xsStringBuffer((char*)payload, payloadSize);
+        xsVar(1) = xsGet(xsGlobal, xsID("JSON"));
+        xsVar(1) = xsCall1(xsVar(1), xsID("parse"), xsVar(0));
+      }
+      switchPhase(sandbox, PHASE_DISPATCH);
       xsVar(0) = xsGet(xsGlobal, xsID("receiveMessage"));
       if (xsTypeOf(xsVar(0)) != xsUndefinedType) {
         xsVar(1) = xsCall1(xsGlobal, xsID("receiveMessage"), xsVar(1));
       }
     }
 
-    char* result;
-    if (xsTypeOf(xsVar(1)) != xsUndefinedType) {
+    switchPhase(sandbox, PHASE_ENCODE);
+    if (xsTypeOf(xsVar(1)) == xsUndefinedType) {
+      code = EC_OK_UNDEFINED;
+    } else if (binary) {
+      encodeMessage(the, &xsVar(1), output);
+      code = EC_OK_VALUE;
+    } else {
       xsVar(0) = xsGet(xsGlobal, xsID("JSON"));
       xsVar(0) = xsCall1(xsVar(0), xsID("stringify"), xsVar(1));
-      result = xsToString(xsVar(0));
-      *out_buffer = malloc(strlen(result) + 1);
-      strcpy((char*)*out_buffer, result);
-      *out_size = strlen(result);
+      char* result = xsToString(xsVar(0));
+      size_t resultSize = strlen(result);
+      uint8_t* p = messageBufferReserve(output, resultSize);
+      if (p == NULL) {
+        xsUnknownError("out of memory");
+      }
+      memcpy(p, result, resultSize);
       code = EC_OK_VALUE;
-    } else {
-      *out_buffer = NULL;
-      *out_size = 0;
-      code = EC_OK_UNDEFINED;
     }
   }
   xsCatch {
     code = EC_EXCEPTION;
-    xsSetCurrentMeter(machine, 1000000000);
-    // New object to send serialized error
-    xsVar(0) = xsNewObject();
-    if (xsTypeOf(xsException) != xsUndefinedType) {
-      if (xsIsInstanceOf(xsException, xsErrorPrototype)) {
-        // Copy message property
-        xsVar(1) = xsGet(xsException, xsID("message"));
-        xsSet(xsVar(0), xsID("message"), xsVar(1));
-        // Copy stack property
-        xsVar(1) = xsGet(xsException, xsID("stack"));
-        xsSet(xsVar(0), xsID("stack"), xsVar(1));
-        // Copy name property
-        xsVar(1) = xsGet(xsException, xsID("name"));
-        xsSet(xsVar(0), xsID("name"), xsVar(1));
-      } else {
-        // Just do `exception.toString()` to infer a message
-        xsVar(1) = xsCall0(xsException, xsID("toString"));
-        xsSet(xsVar(0), xsID("message"), xsVar(1));
-      }
-    } else {
-      xsVar(1) = xsString("Unknown error");
-      xsSet(xsVar(0), xsID("message"), xsVar(1));
-    }
-    // Serialize error
-    xsVar(1) = xsGet(xsGlobal, xsID("JSON"));
-    xsVar(0) = xsCall1(xsVar(1), xsID("stringify"), xsVar(0));
-    char* message = xsToString(xsVar(0));
-    *out_buffer = malloc(strlen(message) + 1);
-    *out_size = strlen(message);
-    strcpy((char*)*out_buffer, message);
-    xsException = xsUndefined;
+    output->length = start;
+    xsSetCurrentMeter(the, 1000000000);
+    switchPhase(sandbox, PHASE_ENCODE);
+    serializeException(the, output);
   }
   return code;
 }
 
 /**
- * Handle input from host (evaluate or sendMessage)
+ * Deliver each message of a batch to the guest, appending an entry per message
+ * to `output`. The payload is the messages, each prefixed by its uint32
+ * length. Each output entry is a uint8 ErrorCode, then a uint32 length, then
+ * the result or serialized exception.
  */
-ErrorCode sandboxInput(uint8_t* payload, uint32_t** out_buffer, uint32_t* out_size, int action) {
-  if (active) {
-    return sandboxInputReenter(payload, out_buffer, out_size, action);
+static ErrorCode sandboxDispatchBatch(TsSandbox* sandbox, uint8_t* payload, size_t payloadSize, uint32_t count, bool drainEach, TsMessageBuffer* output) {
+  xsMachine* machine = sandbox->machine;
+  size_t offset = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t length;
+    if (payloadSize - offset < 4) {
+      return EC_EXCEPTION;
+    }
+    memcpy(&length, payload + offset, 4);
+    offset += 4;
+    if (payloadSize - offset < length) {
+      return EC_EXCEPTION;
+    }
+
+    // Room for the header, and for the fallback error in case the message
+    // throws something that doesn't fit
+    size_t header = output->length;
+    if (messageBufferReserve(output, 5 + FALLBACK_EXCEPTION_SIZE) == NULL) {
+      return EC_EXCEPTION;
+    }
+    output->length = header + 5;
+    ErrorCode code;
+    // Each message gets its own host frame, since a frame can only declare
+    // its variables once
+    xsBeginHost(machine);
+    {
+      code = sandboxDispatch(sandbox, payload + offset, length, 1, output);
+    }
+    xsEndHost(machine);
+    uint32_t resultSize = output->length - header - 5;
+    output->data[header] = code;
+    memcpy(output->data + header + 1, &resultSize, 4);
+    offset += length;
+
+    // Once the time slice is used up, the jobs are left for a later call
+    if (drainEach) {
+      switchPhase(sandbox, PHASE_RUN_LOOP);
+      xsRunLoopUntil(machine, sandbox->sliceEnd);
+    }
   }
-  active = true;
-  *out_buffer = NULL;
-  *out_size = 0;
+  return EC_OK_VALUE;
+}
+
+/**
+ * Run a single input or a batch in the sandbox. This is the outermost entry
+ * into the machine, so it starts the meter and runs promise jobs at the end.
+ * Reentrant calls (from inside a host function) do neither, since those belong
+ * to the outer call.
+ *
+ * With a time slice, a call that isn't a batch is suspended at the first
+ * metering check past the end of the slice, and the host gets EC_INTERRUPTED
+ * in ioResult until it resumes the call to run another slice. When another
+ * call from the host is in progress, the call can't be suspended partway, so
+ * instead the promise jobs stop once the meter passes the slice, and the
+ * sandbox is left suspended until a later call runs the rest. Action 4 does
+ * nothing but run promise jobs, and returns EC_SUSPENDED if it stopped again
+ * with jobs left.
+ */
+static ErrorCode sandboxEnter(TsSandbox* sandbox, uint8_t* payload, size_t payloadSize, int action, bool batch, uint32_t count, bool drainEach, TsMessageBuffer* output) {
+  if (sandbox->active) {
+    if (action == 4) {
+      return EC_OK_UNDEFINED;
+    }
+    // Jobs belong to the outer call, so they can't be run after each message.
+    // The host doesn't ask for this.
+    if (drainEach) {
+      return EC_EXCEPTION;
+    }
+    return batch
+      ? sandboxDispatchBatch(sandbox, payload, payloadSize, count, false, output)
+      : sandboxDispatch(sandbox, payload, payloadSize, action, output);
+  }
+  xsMachine* machine = sandbox->machine;
+  sandbox->active = true;
   ErrorCode code = EC_OK_UNDEFINED;
-  xsBeginMetering(machine, meteringCallback, meteringInterval);
+  xsSetAbortStatus(machine, 0);
+  // While profiling, the callback also needs to run often enough to sample
+  uint32_t interval = sandbox->meteringInterval;
+  if (sandbox->profiling && sandbox->profileInterval < interval) {
+    interval = sandbox->profileInterval;
+  }
+  sandbox->lastSampleMeterValue = 0;
+  sandbox->suspended = false;
+  sandbox->sliceEnd = sandbox->timeSlice;
+  sandbox->interruptible = SANDBOX_ASYNCIFY && !batch;
+  sandbox->cancelled = false;
+  sandbox->settling = false;
+  if (sandbox->collectingStats) {
+    memset(sandbox->phaseTime, 0, sizeof(sandbox->phaseTime));
+    sandbox->hostCallbacks = 0;
+    sandbox->gcCountAtStart = getGCCount(machine);
+  }
+  xsBeginMetering(machine, meteringCallback, interval);
   {
     xsBeginHost(machine);
     {
-      code = sandboxInputReenter(payload, out_buffer, out_size, action);
+      if (action == 4) {
+        code = EC_OK_UNDEFINED;
+      } else {
+        code = batch
+          ? sandboxDispatchBatch(sandbox, payload, payloadSize, count, drainEach, output)
+          : sandboxDispatch(sandbox, payload, payloadSize, action, output);
+      }
     }
     // Note: the run loop can't throw an exception because the only way to
     // enqueue jobs is as promise continuations, which are specified to just
@@ -322,67 +1304,323 @@ ErrorCode sandboxInput(uint8_t* payload, uint32_t** out_buffer, uint32_t* out_si
     //
     // Note: if the meter expires while in the run loop, it will jump to
     // xsEndMetering and sandboxInput will return EC_METERING_LIMIT_REACHED.
-    xsRunLoop(machine);
+    switchPhase(sandbox, PHASE_RUN_LOOP);
+    sandbox->suspended = xsRunLoopUntil(machine, sandbox->sliceEnd);
+    if (sandbox->suspended && action == 4) {
+      code = EC_SUSPENDED;
+    }
     xsEndHost(machine);
-    lastMeterValue = xsGetCurrentMeter(machine);
+    sandbox->lastMeterValue = xsGetCurrentMeter(machine);
   }
   xsEndMetering(machine);
+  sandbox->interruptible = false;
+  // Also reached if the machine exited early, which attributes the time up to
+  // the exit to the phase it was in
+  switchPhase(sandbox, PHASE_NONE);
 
-  if (meteringLimit && (lastMeterValue >= meteringLimit)) {
+  if (xsGetAbortStatus(machine) == XS_NOT_ENOUGH_MEMORY_EXIT) {
+    // The machine exited to the host when an allocation failed, so any output
+    // is incomplete
+    code = EC_MEMORY_LIMIT_REACHED;
+    xsSetAbortStatus(machine, 0);
+    output->length = 0;
+  } else if (sandbox->cancelled) {
+    // The host has no use for the result
+    code = EC_OK_UNDEFINED;
+    output->length = 0;
+  } else if (sandbox->meteringLimit && (sandbox->lastMeterValue >= sandbox->meteringLimit)) {
     code = EC_METERING_LIMIT_REACHED;
     // It's possible that we already had a return value. E.g. if
-    // sandboxInputReenter populated a return value and then the meter was
+    // sandboxDispatch populated a return value and then the meter was
     // reached in the run loop.
-    if (*out_buffer) {
-      free(*out_buffer);
-      *out_buffer = NULL;
-      *out_size = 0;
-    }
+    output->length = 0;
   }
 
-  active = false;
+  sandbox->active = false;
   return code;
 }
 
+/**
+ * Make a call into the sandbox with a payload from reserveInput, and tell the
+ * host where the output is through ioResult. The output of an outermost call
+ * is in the sandbox's output buffer, which stays valid until the next call.
+ * The output of a nested call is a new allocation for the host to free.
+ */
+static ErrorCode sandboxCall(TsSandbox* sandbox, uint8_t* payload, size_t payloadSize, int action, bool batch, uint32_t count, bool drainEach) {
+  bool nested = sandbox->active;
+  TsMessageBuffer nestedOutput = { 0 };
+  TsMessageBuffer* output = nested ? &nestedOutput : &sandbox->output;
+  if (!nested) {
+    ioRelease(&sandbox->output);
+    sandbox->output.length = 0;
+  }
+  entryDepth++;
+  ErrorCode code = sandboxEnter(sandbox, payload, payloadSize, action, batch, count, drainEach, output);
+  entryDepth--;
+  if (payload != sandbox->input.data) {
+    free(payload);
+  }
+  if (!nested) {
+    ioRelease(&sandbox->input);
+    ioRelease(&sandbox->message);
+    ioRelease(&sandbox->reply);
+  }
+  sandbox->ioResult[0] = (uint32_t)(uintptr_t)output->data;
+  sandbox->ioResult[1] = output->length;
+  sandbox->ioResult[2] = nested;
+  // Also where the host finds the code of a call that was suspended partway,
+  // which returns to the host early without one
+  sandbox->ioResult[3] = code;
+  return code;
+}
+
+/**
+ * Handle input from host (evaluate, sendMessage, run, a settlement, or resume)
+ */
+ErrorCode sandboxInput(int handle, uint8_t* payload, size_t payloadSize, int action) {
+  return sandboxCall(getSandbox(handle), payload, payloadSize, action, false, 0, false);
+}
+
+/**
+ * Deliver `count` messages to the guest's receiveMessage in one call. See
+ * sandboxDispatchBatch for the payload and output layout. Promise jobs are run
+ * once at the end, or also after each message if `drainEach` is set. Returns
+ * EC_OK_VALUE if every message was delivered, whatever their results.
+ */
+ErrorCode sandboxInputBatch(int handle, uint8_t* payload, size_t payloadSize, uint32_t count, int drainEach) {
+  return sandboxCall(getSandbox(handle), payload, payloadSize, 1, true, count, drainEach);
+}
+
+/**
+ * Compile `source` without running it. A script can then be run any number of
+ * times with sandboxInput action 2, and a module (if `module` is set) can be
+ * provided to the host module loader. On success, returns EC_OK_VALUE with the
+ * serialized bytecode in the output buffer. The bytecode doesn't depend on the
+ * sandbox that compiled it, only on the build of XS. Returns EC_EXCEPTION with
+ * the serialized error if the source has a syntax error.
+ */
+ErrorCode compileScript(int handle, uint8_t* source, size_t size, char* filename, int module, uint8_t** out_buffer, size_t* out_size) {
+  TsSandbox* sandbox = getSandbox(handle);
+  xsMachine* the = sandbox->machine;
+  TsMessageBuffer output = { 0 };
+  ErrorCode code = EC_OK_VALUE;
+  xsSetAbortStatus(the, 0);
+  xsBeginHost(the);
+  {
+    xsVars(2);
+    xsTry {
+      xsSize bytecodeSize;
+      char error[MAX_SYNTAX_ERROR];
+      void* bytecode = fxCompileScript(the, (char*)source, size, filename, module, &bytecodeSize, error, sizeof(error));
+      if (bytecode == NULL) {
+        xsSyntaxError("%s", error);
+      }
+      output.data = bytecode;
+      output.length = output.capacity = bytecodeSize;
+    }
+    xsCatch {
+      code = EC_EXCEPTION;
+      serializeException(the, &output);
+    }
+  }
+  xsEndHost(the);
+  if (xsGetAbortStatus(the) == XS_NOT_ENOUGH_MEMORY_EXIT) {
+    code = EC_MEMORY_LIMIT_REACHED;
+    xsSetAbortStatus(the, 0);
+    free(output.data);
+    memset(&output, 0, sizeof(output));
+  }
+  *out_buffer = output.data;
+  *out_size = output.length;
+  return code;
+}
+
+/**
+ * Serialize xsVar(1) for the host into the sandbox's message buffer, according
+ * to its message format. Uses xsVar(0) of the calling frame. If serializing
+ * throws, the phase is switched back to `phase` before rethrowing.
+ *
+ * The host decodes a message before it can call back into the sandbox, so the
+ * one buffer serves nested calls too.
+ */
+static void encodeForHost(xsMachine* the, TsSandbox* sandbox, CallPhase phase) {
+  TsMessageBuffer* output = &sandbox->message;
+  output->length = 0;
+  xsTry {
+    if (sandbox->messageFormat == MESSAGE_FORMAT_BINARY) {
+      encodeMessage(the, &xsVar(1), output);
+    } else {
+      xsVar(0) = xsGet(xsGlobal, xsID("JSON"));
+      xsVar(0) = xsCall1(xsVar(0), xsID("stringify"), xsVar(1));
+      char* message = xsToString(xsVar(0));
+      size_t messageSize = strlen(message);
+      uint8_t* p = messageBufferReserve(output, messageSize);
+      if (p == NULL) {
+        xsUnknownError("out of memory");
+      }
+      memcpy(p, message, messageSize);
+    }
+  }
+  xsCatch {
+    output->length = 0;
+    switchPhase(sandbox, phase);
+    xsThrow(xsException);
+  }
+}
+
+/**
+ * Parse an error from the host (always JSON {message}) into an Error in
+ * xsVar(0). Uses xsVar(1) of the calling frame. An empty error means the host
+ * had no memory for one.
+ */
+static void decodeHostError(xsMachine* the, uint8_t* error, size_t size) {
+  if (size == 0) {
+    xsVar(0) = xsNew1(xsGlobal, xsID("Error"), xsString("out of memory"));
+    return;
+  }
+  xsVar(0) = xsStringBuffer((char*)error, size);
+  xsVar(1) = xsGet(xsGlobal, xsID("JSON"));
+  xsVar(0) = xsCall1(xsVar(1), xsID("parse"), xsVar(0));
+  xsVar(0) = xsGet(xsVar(0), xsID("message"));
+  xsVar(0) = xsNew1(xsGlobal, xsID("Error"), xsVar(0));
+}
+
 void host_sendMessage(xsMachine* the) {
+  TsSandbox* sandbox = xsGetContext(the);
+  bool binary = sandbox->messageFormat == MESSAGE_FORMAT_BINARY;
+  CallPhase phase = switchPhase(sandbox, PHASE_ENCODE);
   xsVars(2);
-  xsVar(0) = xsGet(xsGlobal, xsID("JSON"));
-  xsVar(0) = xsCall1(xsVar(0), xsID("stringify"), xsArg(0));
-  const char* message = xsToString(xsVar(0));
-  size_t messageSize = strlen(message);
+  xsVar(1) = xsArg(0);
+  encodeForHost(the, sandbox, phase);
+  // The reply is in the sandbox's reply buffer (see reserveReply)
   size_t outputSize = 0;
   uint8_t* outputPtr = NULL;
-  ErrorCode code = sendMessage((uint8_t*)message, messageSize, &outputPtr, &outputSize);
+  bool collecting = beginHostCallback(sandbox);
+  ErrorCode code = sendMessage(sandbox->handle, sandbox->message.data, sandbox->message.length, &outputPtr, &outputSize);
+  endHostCallback(sandbox, collecting, PHASE_DECODE);
 
   if (code == EC_OK_UNDEFINED) {
     xsResult = xsUndefined;
+    switchPhase(sandbox, phase);
     return;
   }
 
   xsTry {
-    xsVar(0) = xsString((char*)outputPtr);
-    xsVar(1) = xsGet(xsGlobal, xsID("JSON"));
-    xsVar(0) = xsCall1(xsVar(1), xsID("parse"), xsVar(0));
+    // Errors from the host are always JSON
+    if (code == EC_EXCEPTION) {
+      decodeHostError(the, outputPtr, outputSize);
+    } else if (binary) {
+      decodeMessage(the, outputPtr, outputSize, &xsVar(0));
+    } else {
+      xsVar(0) = xsStringBuffer((char*)outputPtr, outputSize);
+      xsVar(1) = xsGet(xsGlobal, xsID("JSON"));
+      xsVar(0) = xsCall1(xsVar(1), xsID("parse"), xsVar(0));
+    }
+    switchPhase(sandbox, phase);
     if (code == EC_OK_VALUE) {
       xsResult = xsVar(0);
     } else if (code == EC_EXCEPTION) {
-      xsVar(0) = xsGet(xsVar(0), xsID("message"));
-      xsVar(0) = xsNew1(xsGlobal, xsID("Error"), xsVar(0));
       xsThrow(xsVar(0));
     } else {
       // Should not get here
       xsResult = xsUndefined;
     }
-    free(outputPtr);
-    outputPtr = NULL;
   }
   xsCatch {
     // Catch JSON parse error or other exception
-    free(outputPtr);
+    switchPhase(sandbox, phase);
 		xsThrow(xsException);
   }
 }
 
+// Settle a pending call with the ID in xsArg(0), rejecting it if xsArg(1) is
+// true, with the value in xsArg(2)
+static void settlePendingCall(xsMachine* the) {
+  xsVars(2);
+  xsVar(0) = xsGet(xsFunction, xsID(PENDING_HOST_CALLS));
+  if (!xsHasAt(xsVar(0), xsArg(0))) {
+    xsTypeError("no pending host call %u", (unsigned)xsToUnsigned(xsArg(0)));
+  }
+  xsVar(1) = xsGetAt(xsVar(0), xsArg(0));
+  xsDeleteAt(xsVar(0), xsArg(0));
+  xsVar(0) = xsInteger(xsTest(xsArg(1)) ? 1 : 0);
+  xsVar(1) = xsGetAt(xsVar(1), xsVar(0));
+  // Settling only queues the promise jobs, which run in the run loop
+  xsCallFunction1(xsVar(1), xsUndefined, xsArg(2));
+}
+
+/**
+ * Send a message to the host without waiting for its reply. Returns a promise,
+ * which the host settles later with the ID it was given.
+ *
+ * The host settles the call by calling this too, with `sandbox->settling` set
+ * (see settleHostCall). The flag is cleared straight away, so that any guest
+ * code that runs while settling can only send.
+ */
+void host_sendMessageAsync(xsMachine* the) {
+  TsSandbox* sandbox = xsGetContext(the);
+  if (sandbox->settling) {
+    sandbox->settling = false;
+    settlePendingCall(the);
+    return;
+  }
+  CallPhase phase = switchPhase(sandbox, PHASE_ENCODE);
+  xsVars(5);
+  xsVar(1) = xsArg(0);
+  encodeForHost(the, sandbox, phase);
+
+  // Register the call before telling the host, since the host may settle it
+  // straight away
+  xsTry {
+    xsVar(2) = xsGet(xsFunction, xsID(PENDING_HOST_CALLS));
+    xsVar(0) = xsGet(xsVar(2), xsID("nextId"));
+    uint32_t id = xsToUnsigned(xsVar(0));
+    xsVar(0) = xsUnsigned(id + 1);
+    xsSet(xsVar(2), xsID("nextId"), xsVar(0));
+    xsVar(3) = xsNewHostFunction(host_capturePromise, 2);
+    xsResult = xsNew1(xsFunction, xsID("Promise"), xsVar(3));
+    xsVar(1) = xsNewArray(2);
+    xsVar(4) = xsGet(xsVar(3), xsID("resolve"));
+    xsVar(0) = xsInteger(0);
+    xsSetAt(xsVar(1), xsVar(0), xsVar(4));
+    xsVar(3) = xsGet(xsVar(3), xsID("reject"));
+    xsVar(0) = xsInteger(1);
+    xsSetAt(xsVar(1), xsVar(0), xsVar(3));
+    xsVar(0) = xsUnsigned(id);
+    xsSetAt(xsVar(2), xsVar(0), xsVar(1));
+
+    size_t outputSize = 0;
+    uint8_t* outputPtr = NULL;
+    bool collecting = beginHostCallback(sandbox);
+    ErrorCode code = sendMessageAsync(sandbox->handle, id, sandbox->message.data, sandbox->message.length, &outputPtr, &outputSize);
+    endHostCallback(sandbox, collecting, PHASE_DECODE);
+
+    // The host couldn't accept the message, so reject the promise
+    if (code == EC_EXCEPTION) {
+      decodeHostError(the, outputPtr, outputSize);
+      xsVar(1) = xsUnsigned(id);
+      xsDeleteAt(xsVar(2), xsVar(1));
+      xsCallFunction1(xsVar(3), xsUndefined, xsVar(0));
+    }
+    switchPhase(sandbox, phase);
+  }
+  xsCatch {
+    switchPhase(sandbox, phase);
+    xsThrow(xsException);
+  }
+}
+
+// Executor of the promise returned by sendMessageAsync, which keeps its
+// resolving functions on itself
+void host_capturePromise(xsMachine* the) {
+  xsSet(xsFunction, xsID("resolve"), xsArg(0));
+  xsSet(xsFunction, xsID("reject"), xsArg(1));
+}
+
+void host_virtualClock(xsMachine* the) {
+  TsSandbox* sandbox = xsGetContext(the);
+  xsResult = xsNumber(sandbox->clock);
+}
 
 void host_consoleLog(xsMachine* the) {
   host_consoleOutput(the, 0);
@@ -397,6 +1635,8 @@ void host_consoleError(xsMachine* the) {
 }
 
 void host_consoleOutput(xsMachine* the, int level) {
+  TsSandbox* sandbox = xsGetContext(the);
+  CallPhase phase = switchPhase(sandbox, PHASE_ENCODE);
   // Stringify the args into a JSON array
   xsVars(3);
 	xsIntegerValue c = xsToInteger(xsArgc);
@@ -408,12 +1648,12 @@ void host_consoleOutput(xsMachine* the, int level) {
   xsVar(1) = xsGet(xsGlobal, xsID("JSON"));
   xsVar(0) = xsCall1(xsVar(1), xsID("stringify"), xsVar(0));
 
+  // The host only reads the string, and doesn't call back into the machine, so
+  // it can't be moved by the garbage collector in the meantime
   char* str = xsToString(xsVar(0));
   size_t len = strlen(str);
-  char* buffer = malloc(len + 1);
-  strcpy(buffer, str);
-
-  consoleLog((uint8_t*)buffer, len, level);
 
-  free(buffer);
+  bool collecting = beginHostCallback(sandbox);
+  consoleLog(sandbox->handle, (uint8_t*)str, len, level);
+  endHostCallback(sandbox, collecting, phase);
 }
\ No newline at end of file
@@ -9,9 +9,63 @@ typedef enum ErrorCode {
   EC_OK_UNDEFINED = 1, // Ok with return undefined
   EC_EXCEPTION = 2, // Returned exception message (string)
   EC_METERING_LIMIT_REACHED = 3, // Hit metering limit
+  EC_MEMORY_LIMIT_REACHED = 4, // Hit memory limit
+  EC_SUSPENDED = 5, // Stopped at the end of a time slice with promise jobs left
+  EC_INTERRUPTED = 6, // Suspended partway through guest code until resumed
 } ErrorCode;
 
+// Phases of a call into the sandbox, as timed by getCallStats
+typedef enum CallPhase {
+  PHASE_NONE = -1,
+  PHASE_DECODE = 0, // Parsing input from the host, and results of host callbacks
+  PHASE_DISPATCH = 1, // Running guest code (eval, receiveMessage or a compiled script)
+  PHASE_ENCODE = 2, // Serializing results and messages for the host
+  PHASE_RUN_LOOP = 3, // Running promise jobs
+  PHASE_HOST_CALLBACK = 4, // In the host's sendMessage and console functions
+  PHASE_COUNT = 5,
+} CallPhase;
+
+// Number of values written by getCallStats: the milliseconds spent in each
+// phase, the number of host callbacks, and the number of garbage collections
+// (or -1 if unknown)
+#define CALL_STATS_COUNT (PHASE_COUNT + 2)
+
+// The xsCreation parameters of a new machine. The host passes these as an
+// array of int32 in this order (see machine-sizing.mts).
+typedef struct TsMachineSizing {
+  int32_t initialChunkSize;
+  int32_t incrementalChunkSize;
+  int32_t initialHeapCount;
+  int32_t incrementalHeapCount;
+  int32_t stackCount;
+  int32_t initialKeyCount;
+  int32_t incrementalKeyCount;
+  int32_t nameModulo;
+  int32_t symbolModulo;
+  int32_t parserBufferSize;
+  int32_t parserTableModulo;
+} TsMachineSizing;
+
 // Called by host
-void initMachine();
-ErrorCode sandboxInput(uint8_t* payload, uint32_t** out_buffer, uint32_t* out_size, int action);
+int initMachine(const TsMachineSizing* sizing);
+void destroyMachine(int handle);
+int restoreSnapshot(uint8_t* buffer, size_t size, uint8_t* base, size_t baseSize, uint32_t memoryLimit);
+int takeSnapshot(int handle, uint8_t* base, size_t baseSize, int compress, uint8_t** out_buffer, size_t* out_size);
+int streamSnapshot(int handle, size_t chunkSize, uint8_t* base, size_t baseSize, int compress);
+uint8_t* reserveInput(int handle, size_t size);
+uint8_t* reserveReply(int handle, size_t size);
+uint32_t* getIOResult(int handle);
+ErrorCode sandboxInput(int handle, uint8_t* payload, size_t payloadSize, int action);
+ErrorCode sandboxInputBatch(int handle, uint8_t* payload, size_t payloadSize, uint32_t count, int drainEach);
+ErrorCode compileScript(int handle, uint8_t* source, size_t size, char* filename, int module, uint8_t** out_buffer, size_t* out_size);
+uint32_t getTimeSlice(int handle);
+void setTimeSlice(int handle, uint32_t slice);
+uint32_t getSuspended(int handle);
+uint32_t canInterrupt(void);
+uint32_t getEntryDepth(void);
+void cancelCall(int handle);
+void setCollectingStats(int handle, int enabled);
+void getCallStats(int handle, double* stats);
+void startProfiling(int handle, uint32_t interval);
+uint32_t stopProfiling(int handle, uint8_t** out_buffer, size_t* out_size);
 ErrorCode receiveMessage(uint8_t* payload, uint32_t** out_buffer, uint32_t* out_size);
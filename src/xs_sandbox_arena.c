@@ -0,0 +1,169 @@
+#include "xs_sandbox_arena.h"
+
+#include <stdlib.h>
+#include <stdbool.h>
+
+// Headers are padded to this, which keeps every block aligned for slots
+#define ALIGNMENT 16
+// Regions are a multiple of this
+#define REGION_GRANULARITY (64 * 1024)
+// New regions are sized in proportion to the arena, up to this. Bigger blocks
+// get a region of their own.
+#define MAX_REGION_SIZE (4 * 1024 * 1024)
+// Free space smaller than this isn't split off from a block
+#define MIN_SPLIT 256
+
+#define ALIGN(size) (((size) + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1))
+
+typedef struct TsArenaBlock TsArenaBlock;
+
+struct TsArenaBlock {
+  // Bytes including the header
+  size_t size;
+  TsArenaRegion* region;
+  // Only while the block is free
+  TsArenaBlock* nextFree;
+  bool free;
+};
+
+struct TsArenaRegion {
+  TsArenaRegion* next;
+  // Bytes including the header
+  size_t size;
+  size_t usedBytes;
+  // In address order
+  TsArenaBlock* firstFree;
+};
+
+#define BLOCK_HEADER_SIZE ALIGN(sizeof(TsArenaBlock))
+#define REGION_HEADER_SIZE ALIGN(sizeof(TsArenaRegion))
+
+static TsArenaRegion* newRegion(TsArena* arena, size_t blockSize) {
+  size_t size = REGION_HEADER_SIZE + blockSize;
+  // Grow the arena geometrically, so a large heap doesn't need many regions
+  size_t preferred = arena->reservedBytes < MAX_REGION_SIZE ? arena->reservedBytes : MAX_REGION_SIZE;
+  if (size < preferred) {
+    size = preferred;
+  }
+  size = (size + REGION_GRANULARITY - 1) / REGION_GRANULARITY * REGION_GRANULARITY;
+
+  TsArenaRegion* region = malloc(size);
+  if (region == NULL) {
+    return NULL;
+  }
+  region->size = size;
+  region->usedBytes = 0;
+  TsArenaBlock* block = (TsArenaBlock*)((uint8_t*)region + REGION_HEADER_SIZE);
+  block->size = size - REGION_HEADER_SIZE;
+  block->region = region;
+  block->nextFree = NULL;
+  block->free = true;
+  region->firstFree = block;
+
+  region->next = arena->firstRegion;
+  arena->firstRegion = region;
+  arena->reservedBytes += size;
+  if (arena->reservedBytes > arena->peakReservedBytes) {
+    arena->peakReservedBytes = arena->reservedBytes;
+  }
+  return region;
+}
+
+static void freeRegion(TsArena* arena, TsArenaRegion* region) {
+  TsArenaRegion** link = &arena->firstRegion;
+  while (*link != region) {
+    link = &(*link)->next;
+  }
+  *link = region->next;
+  arena->reservedBytes -= region->size;
+  free(region);
+}
+
+// First fit in the region's free list. Returns NULL if nothing fits.
+static TsArenaBlock* takeFreeBlock(TsArenaRegion* region, size_t blockSize) {
+  TsArenaBlock** link = &region->firstFree;
+  while (*link) {
+    TsArenaBlock* block = *link;
+    if (block->size >= blockSize) {
+      if (block->size - blockSize >= BLOCK_HEADER_SIZE + MIN_SPLIT) {
+        // Split off the end as a new free block, in place of this one
+        TsArenaBlock* rest = (TsArenaBlock*)((uint8_t*)block + blockSize);
+        rest->size = block->size - blockSize;
+        rest->region = region;
+        rest->nextFree = block->nextFree;
+        rest->free = true;
+        block->size = blockSize;
+        *link = rest;
+      } else {
+        *link = block->nextFree;
+      }
+      block->free = false;
+      block->nextFree = NULL;
+      region->usedBytes += block->size;
+      return block;
+    }
+    link = &block->nextFree;
+  }
+  return NULL;
+}
+
+void* arenaAllocate(TsArena* arena, size_t size) {
+  if (size > SIZE_MAX - BLOCK_HEADER_SIZE - REGION_HEADER_SIZE - REGION_GRANULARITY) {
+    return NULL;
+  }
+  size_t blockSize = BLOCK_HEADER_SIZE + ALIGN(size);
+  TsArenaBlock* block = NULL;
+  for (TsArenaRegion* region = arena->firstRegion; region && !block; region = region->next) {
+    block = takeFreeBlock(region, blockSize);
+  }
+  if (!block) {
+    TsArenaRegion* region = newRegion(arena, blockSize);
+    if (region == NULL) {
+      return NULL;
+    }
+    block = takeFreeBlock(region, blockSize);
+  }
+  arena->usedBytes += block->size;
+  return (uint8_t*)block + BLOCK_HEADER_SIZE;
+}
+
+void arenaFree(TsArena* arena, void* data) {
+  if (data == NULL) {
+    return;
+  }
+  TsArenaBlock* block = (TsArenaBlock*)((uint8_t*)data - BLOCK_HEADER_SIZE);
+  TsArenaRegion* region = block->region;
+  arena->usedBytes -= block->size;
+  region->usedBytes -= block->size;
+  if (region->usedBytes == 0) {
+    freeRegion(arena, region);
+    return;
+  }
+
+  // Insert in address order, merging with the free neighbours
+  TsArenaBlock* previous = NULL;
+  TsArenaBlock* next = region->firstFree;
+  while (next && next < block) {
+    previous = next;
+    next = next->nextFree;
+  }
+  block->free = true;
+  block->nextFree = next;
+  if (next && (uint8_t*)block + block->size == (uint8_t*)next) {
+    block->size += next->size;
+    block->nextFree = next->nextFree;
+  }
+  if (previous && (uint8_t*)previous + previous->size == (uint8_t*)block) {
+    previous->size += block->size;
+    previous->nextFree = block->nextFree;
+  } else if (previous) {
+    previous->nextFree = block;
+  } else {
+    region->firstFree = block;
+  }
+}
+
+size_t arenaBlockSize(void* data) {
+  TsArenaBlock* block = (TsArenaBlock*)((uint8_t*)data - BLOCK_HEADER_SIZE);
+  return block->size - BLOCK_HEADER_SIZE;
+}
@@ -0,0 +1,39 @@
+/*
+Arena allocator for the slot and chunk heaps of a machine.
+
+XS grows its heaps in large blocks. Allocated directly with malloc, those blocks
+are interleaved with short-lived allocations (message buffers, parser buffers,
+snapshot buffers) and the holes they leave behind, and since WASM memory never
+shrinks, the fragmentation raises the high-water mark for good. Instead, each
+machine takes its heap blocks from its own arena: a list of large regions
+obtained from malloc, each divided into blocks with an address-ordered free
+list. Neighbouring free blocks are merged, and a region is given back to malloc
+as soon as none of its blocks are in use, so deleting a machine returns all of
+its regions.
+*/
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct TsArenaRegion TsArenaRegion;
+
+typedef struct TsArena {
+  TsArenaRegion* firstRegion;
+  // Bytes obtained from malloc for regions, now and at most
+  size_t reservedBytes;
+  size_t peakReservedBytes;
+  // Bytes of blocks in use, including their headers
+  size_t usedBytes;
+} TsArena;
+
+// Allocate `size` bytes, 16-byte aligned relative to the region. Returns NULL
+// if out of memory.
+void* arenaAllocate(TsArena* arena, size_t size);
+
+// Free a block from arenaAllocate. NULL is ignored.
+void arenaFree(TsArena* arena, void* data);
+
+// The usable size of a block from arenaAllocate, which may be more than was
+// asked for
+size_t arenaBlockSize(void* data);
@@ -0,0 +1,380 @@
+#include "xs_sandbox_compress.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define HASH_LOG 12
+#define MIN_MATCH 4
+// The LZ4 format requires the last 5 bytes of a block to be literals, and the
+// last match to start at least 12 bytes before the end.
+#define LAST_LITERALS 5
+#define MATCH_LIMIT 12
+#define MAX_OFFSET 65535
+
+const char COMPRESSED_SIGNATURE[] = "xs-sandbox-lz-1";
+const size_t COMPRESSED_SIGNATURE_LENGTH = sizeof(COMPRESSED_SIGNATURE) - 1;
+
+static uint32_t read32(const uint8_t* p) {
+  uint32_t value;
+  memcpy(&value, p, 4);
+  return value;
+}
+
+static uint32_t hash4(uint32_t sequence) {
+  return (sequence * 2654435761u) >> (32 - HASH_LOG);
+}
+
+static void writeUint32(uint8_t* p, uint32_t value) {
+  p[0] = value;
+  p[1] = value >> 8;
+  p[2] = value >> 16;
+  p[3] = value >> 24;
+}
+
+static uint32_t readUint32(const uint8_t* p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Write the extra bytes of a length that doesn't fit in its 4-bit token field
+static uint8_t* writeLength(uint8_t* op, size_t length) {
+  while (length >= 255) {
+    *op++ = 255;
+    length -= 255;
+  }
+  *op++ = (uint8_t)length;
+  return op;
+}
+
+/**
+ * Compress one block. Returns the compressed size, or 0 if it doesn't fit in
+ * `capacity` (in which case the block should be stored uncompressed).
+ */
+static size_t compressBlock(const uint8_t* src, size_t srcSize, uint8_t* dst, size_t capacity, uint32_t* table) {
+  const uint8_t* ip = src;
+  const uint8_t* anchor = src;
+  const uint8_t* end = src + srcSize;
+  uint8_t* op = dst;
+  uint8_t* opEnd = dst + capacity;
+
+  memset(table, 0, sizeof(uint32_t) << HASH_LOG);
+
+  if (srcSize > MATCH_LIMIT) {
+    const uint8_t* matchLimit = end - MATCH_LIMIT;
+    while (ip < matchLimit) {
+      uint32_t sequence = read32(ip);
+      uint32_t* entry = &table[hash4(sequence)];
+      const uint8_t* ref = src + *entry;
+      *entry = ip - src;
+
+      if (ref >= ip || ip - ref > MAX_OFFSET || read32(ref) != sequence) {
+        ip++;
+        continue;
+      }
+
+      // Extend the match backwards into the pending literals, and forwards
+      while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+        ip--;
+        ref--;
+      }
+      const uint8_t* matchEnd = ip + MIN_MATCH;
+      const uint8_t* refEnd = ref + MIN_MATCH;
+      while (matchEnd < end - LAST_LITERALS && *matchEnd == *refEnd) {
+        matchEnd++;
+        refEnd++;
+      }
+
+      size_t literalLength = ip - anchor;
+      size_t matchLength = matchEnd - ip - MIN_MATCH;
+      size_t worstCase = 1 + literalLength / 255 + 1 + literalLength + 2 + matchLength / 255 + 1;
+      if ((size_t)(opEnd - op) < worstCase) {
+        return 0;
+      }
+
+      uint8_t* token = op++;
+      *token = (literalLength < 15 ? literalLength : 15) << 4;
+      if (literalLength >= 15) {
+        op = writeLength(op, literalLength - 15);
+      }
+      memcpy(op, anchor, literalLength);
+      op += literalLength;
+
+      size_t offset = ip - ref;
+      *op++ = offset & 0xFF;
+      *op++ = offset >> 8;
+
+      *token |= matchLength < 15 ? matchLength : 15;
+      if (matchLength >= 15) {
+        op = writeLength(op, matchLength - 15);
+      }
+
+      ip = matchEnd;
+      anchor = ip;
+    }
+  }
+
+  // Trailing literals
+  size_t literalLength = end - anchor;
+  if ((size_t)(opEnd - op) < 1 + literalLength / 255 + 1 + literalLength) {
+    return 0;
+  }
+  uint8_t* token = op++;
+  *token = (literalLength < 15 ? literalLength : 15) << 4;
+  if (literalLength >= 15) {
+    op = writeLength(op, literalLength - 15);
+  }
+  memcpy(op, anchor, literalLength);
+  op += literalLength;
+
+  return op - dst;
+}
+
+// Returns 0 on success, or non-zero if the block is corrupt
+static int decompressBlock(const uint8_t* src, size_t srcSize, uint8_t* dst, size_t dstSize) {
+  const uint8_t* ip = src;
+  const uint8_t* ipEnd = src + srcSize;
+  uint8_t* op = dst;
+  uint8_t* opEnd = dst + dstSize;
+
+  while (ip < ipEnd) {
+    uint8_t token = *ip++;
+
+    size_t literalLength = token >> 4;
+    if (literalLength == 15) {
+      uint8_t byte;
+      do {
+        if (ip >= ipEnd) return 1;
+        byte = *ip++;
+        literalLength += byte;
+      } while (byte == 255);
+    }
+    if (literalLength > (size_t)(ipEnd - ip) || literalLength > (size_t)(opEnd - op)) return 1;
+    memcpy(op, ip, literalLength);
+    op += literalLength;
+    ip += literalLength;
+
+    // The last sequence has no match
+    if (ip == ipEnd) break;
+
+    if (ipEnd - ip < 2) return 1;
+    size_t offset = ip[0] | (ip[1] << 8);
+    ip += 2;
+    if (offset == 0 || offset > (size_t)(op - dst)) return 1;
+
+    size_t matchLength = token & 15;
+    if (matchLength == 15) {
+      uint8_t byte;
+      do {
+        if (ip >= ipEnd) return 1;
+        byte = *ip++;
+        matchLength += byte;
+      } while (byte == 255);
+    }
+    matchLength += MIN_MATCH;
+    if (matchLength > (size_t)(opEnd - op)) return 1;
+
+    // Byte-by-byte because the match may overlap the output
+    const uint8_t* ref = op - offset;
+    while (matchLength--) {
+      *op++ = *ref++;
+    }
+  }
+
+  return op == opEnd ? 0 : 1;
+}
+
+// Block header: uncompressed size, then stored size (equal to the uncompressed
+// size if the block is stored uncompressed). An uncompressed size of 0 ends the
+// stream.
+static int flushBlock(TsLzEncoder* encoder) {
+  uint8_t header[8];
+  size_t rawSize = encoder->inputLength;
+  // Compressed blocks must be smaller than the raw size, since a block of that
+  // size is read as stored
+  size_t storedSize = compressBlock(encoder->input, rawSize, encoder->output, rawSize - 1, encoder->table);
+  const uint8_t* stored = encoder->output;
+  if (storedSize == 0) {
+    storedSize = rawSize;
+    stored = encoder->input;
+  }
+  writeUint32(header, rawSize);
+  writeUint32(header + 4, storedSize);
+  if (encoder->write(encoder->stream, header, 8)) return 1;
+  if (encoder->write(encoder->stream, (void*)stored, storedSize)) return 1;
+  encoder->inputLength = 0;
+  return 0;
+}
+
+int lzEncoderInit(TsLzEncoder* encoder, TsStreamCallback write, void* stream) {
+  memset(encoder, 0, sizeof(*encoder));
+  encoder->write = write;
+  encoder->stream = stream;
+  encoder->input = malloc(LZ_BLOCK_SIZE);
+  encoder->output = malloc(LZ_BLOCK_SIZE);
+  encoder->table = malloc(sizeof(uint32_t) << HASH_LOG);
+  if (!encoder->input || !encoder->output || !encoder->table) {
+    return 1;
+  }
+  return write(stream, (void*)COMPRESSED_SIGNATURE, COMPRESSED_SIGNATURE_LENGTH);
+}
+
+int lzEncoderWrite(void* stream, void* address, size_t size) {
+  TsLzEncoder* encoder = stream;
+  const uint8_t* p = address;
+
+  while (size > 0) {
+    size_t count = LZ_BLOCK_SIZE - encoder->inputLength;
+    if (count > size) {
+      count = size;
+    }
+    memcpy(encoder->input + encoder->inputLength, p, count);
+    encoder->inputLength += count;
+    p += count;
+    size -= count;
+
+    if (encoder->inputLength == LZ_BLOCK_SIZE) {
+      if (flushBlock(encoder)) return 1;
+    }
+  }
+
+  return 0;
+}
+
+int lzEncoderFinish(TsLzEncoder* encoder) {
+  if (encoder->inputLength > 0) {
+    if (flushBlock(encoder)) return 1;
+  }
+  uint8_t end[8] = { 0 };
+  return encoder->write(encoder->stream, end, 8);
+}
+
+void lzEncoderFree(TsLzEncoder* encoder) {
+  free(encoder->input);
+  free(encoder->output);
+  free(encoder->table);
+  encoder->input = NULL;
+  encoder->output = NULL;
+  encoder->table = NULL;
+}
+
+bool isCompressed(const uint8_t* buffer, size_t size) {
+  return size >= COMPRESSED_SIGNATURE_LENGTH && memcmp(buffer, COMPRESSED_SIGNATURE, COMPRESSED_SIGNATURE_LENGTH) == 0;
+}
+
+static int readBlock(TsLzDecoder* decoder) {
+  uint8_t header[8];
+  if (decoder->read(decoder->stream, header, 8)) return 1;
+  size_t rawSize = readUint32(header);
+  size_t storedSize = readUint32(header + 4);
+
+  decoder->blockLength = 0;
+  decoder->blockOffset = 0;
+  if (rawSize == 0) {
+    decoder->ended = true;
+    return 0;
+  }
+  if (rawSize > LZ_BLOCK_SIZE || storedSize > rawSize) return 1;
+
+  if (storedSize == rawSize) {
+    if (decoder->read(decoder->stream, decoder->block, rawSize)) return 1;
+  } else {
+    if (decoder->read(decoder->stream, decoder->input, storedSize)) return 1;
+    if (decompressBlock(decoder->input, storedSize, decoder->block, rawSize)) return 1;
+  }
+  decoder->blockLength = rawSize;
+  return 0;
+}
+
+int lzDecoderInit(TsLzDecoder* decoder, TsStreamCallback read, void* stream) {
+  memset(decoder, 0, sizeof(*decoder));
+  decoder->read = read;
+  decoder->stream = stream;
+  decoder->block = malloc(LZ_BLOCK_SIZE);
+  decoder->input = malloc(LZ_BLOCK_SIZE);
+  if (!decoder->block || !decoder->input) {
+    return 1;
+  }
+
+  char signature[sizeof(COMPRESSED_SIGNATURE)];
+  if (read(stream, signature, COMPRESSED_SIGNATURE_LENGTH)) return 1;
+  if (memcmp(signature, COMPRESSED_SIGNATURE, COMPRESSED_SIGNATURE_LENGTH) != 0) return 1;
+  return readBlock(decoder);
+}
+
+int lzDecoderRead(void* stream, void* address, size_t size) {
+  TsLzDecoder* decoder = stream;
+  uint8_t* p = address;
+
+  while (size > 0) {
+    if (decoder->blockOffset == decoder->blockLength) {
+      if (decoder->ended) return 1;
+      if (readBlock(decoder)) return 1;
+      continue;
+    }
+    size_t count = decoder->blockLength - decoder->blockOffset;
+    if (count > size) {
+      count = size;
+    }
+    memcpy(p, decoder->block + decoder->blockOffset, count);
+    decoder->blockOffset += count;
+    p += count;
+    size -= count;
+  }
+
+  return 0;
+}
+
+const uint8_t* lzDecoderPeek(TsLzDecoder* decoder, size_t* size) {
+  *size = decoder->blockLength - decoder->blockOffset;
+  return decoder->block + decoder->blockOffset;
+}
+
+void lzDecoderFree(TsLzDecoder* decoder) {
+  free(decoder->block);
+  free(decoder->input);
+  decoder->block = NULL;
+  decoder->input = NULL;
+}
+
+int lzDecompressBuffer(const uint8_t* buffer, size_t size, uint8_t** out_buffer, size_t* out_size) {
+  *out_buffer = NULL;
+  *out_size = 0;
+  if (!isCompressed(buffer, size)) return 1;
+
+  // First pass to find the total size
+  size_t total = 0;
+  size_t offset = COMPRESSED_SIGNATURE_LENGTH;
+  for (;;) {
+    if (size - offset < 8) return 1;
+    size_t rawSize = readUint32(buffer + offset);
+    size_t storedSize = readUint32(buffer + offset + 4);
+    offset += 8;
+    if (rawSize == 0) break;
+    if (rawSize > LZ_BLOCK_SIZE || storedSize > rawSize || storedSize > size - offset) return 1;
+    total += rawSize;
+    offset += storedSize;
+  }
+
+  uint8_t* output = malloc(total ? total : 1);
+  if (!output) return 1;
+
+  size_t outputOffset = 0;
+  offset = COMPRESSED_SIGNATURE_LENGTH;
+  for (;;) {
+    size_t rawSize = readUint32(buffer + offset);
+    size_t storedSize = readUint32(buffer + offset + 4);
+    offset += 8;
+    if (rawSize == 0) break;
+    if (storedSize == rawSize) {
+      memcpy(output + outputOffset, buffer + offset, rawSize);
+    } else if (decompressBlock(buffer + offset, storedSize, output + outputOffset, rawSize)) {
+      free(output);
+      return 1;
+    }
+    outputOffset += rawSize;
+    offset += storedSize;
+  }
+
+  *out_buffer = output;
+  *out_size = total;
+  return 0;
+}
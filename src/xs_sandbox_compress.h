@@ -0,0 +1,59 @@
+/*
+Compression of snapshots with a small LZ77 codec (the LZ4 block format).
+
+A compressed snapshot is framed as the COMPRESSED_SIGNATURE followed by blocks
+of at most LZ_BLOCK_SIZE uncompressed bytes, each compressed independently, so
+the encoder and decoder only ever hold one block in memory. Like the delta
+encoder, they sit between the XS snapshot reader/writer and the underlying
+stream.
+*/
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "xs_sandbox_stream.h"
+
+#define LZ_BLOCK_SIZE (64 * 1024)
+
+extern const char COMPRESSED_SIGNATURE[];
+extern const size_t COMPRESSED_SIGNATURE_LENGTH;
+
+typedef struct TsLzEncoder {
+  uint8_t* input;
+  size_t inputLength;
+  uint8_t* output;
+  uint32_t* table;
+  TsStreamCallback write;
+  void* stream;
+} TsLzEncoder;
+
+typedef struct TsLzDecoder {
+  uint8_t* block;
+  size_t blockLength;
+  size_t blockOffset;
+  uint8_t* input;
+  bool ended;
+  TsStreamCallback read;
+  void* stream;
+} TsLzDecoder;
+
+// Returns 0 on success
+int lzEncoderInit(TsLzEncoder* encoder, TsStreamCallback write, void* stream);
+int lzEncoderWrite(void* encoder, void* address, size_t size);
+int lzEncoderFinish(TsLzEncoder* encoder);
+void lzEncoderFree(TsLzEncoder* encoder);
+
+bool isCompressed(const uint8_t* buffer, size_t size);
+
+// Returns 0 on success. The first block is decoded immediately, so that
+// `lzDecoderPeek` can be used to inspect the start of the content.
+int lzDecoderInit(TsLzDecoder* decoder, TsStreamCallback read, void* stream);
+int lzDecoderRead(void* decoder, void* address, size_t size);
+const uint8_t* lzDecoderPeek(TsLzDecoder* decoder, size_t* size);
+void lzDecoderFree(TsLzDecoder* decoder);
+
+// Decompress a whole buffer at once, into a new allocation which the caller
+// must free. Returns 0 on success.
+int lzDecompressBuffer(const uint8_t* buffer, size_t size, uint8_t** out_buffer, size_t* out_size);
@@ -0,0 +1,290 @@
+#include "xs_sandbox_delta.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Match granularity. A multiple of the 16-byte slot size.
+#define BLOCK 64
+// Longest literal run before it's flushed to the output
+#define MAX_LITERAL (64 * 1024)
+#define HASH_MULTIPLIER 0x01000193u
+
+#define OP_END 0
+#define OP_LITERAL 1
+#define OP_COPY 2
+
+const char DELTA_SIGNATURE[] = "xs-sandbox-delta-1";
+const size_t DELTA_SIGNATURE_LENGTH = sizeof(DELTA_SIGNATURE) - 1;
+
+// HASH_MULTIPLIER ^ (BLOCK - 1), for removing the oldest byte from the window
+static uint32_t hashWindowPower() {
+  uint32_t power = 1;
+  for (int i = 0; i < BLOCK - 1; i++) {
+    power *= HASH_MULTIPLIER;
+  }
+  return power;
+}
+
+static uint32_t hashBlock(const uint8_t* p) {
+  uint32_t hash = 0;
+  for (int i = 0; i < BLOCK; i++) {
+    hash = hash * HASH_MULTIPLIER + p[i];
+  }
+  return hash;
+}
+
+// FNV-1a, to check that a delta is applied to the same base it was encoded
+// against
+static uint32_t checksum(const uint8_t* p, size_t size) {
+  uint32_t hash = 0x811c9dc5u;
+  for (size_t i = 0; i < size; i++) {
+    hash = (hash ^ p[i]) * 0x01000193u;
+  }
+  return hash;
+}
+
+static int writeUint32(TsDeltaEncoder* encoder, uint32_t value) {
+  uint8_t bytes[4] = { value, value >> 8, value >> 16, value >> 24 };
+  return encoder->write(encoder->stream, bytes, 4);
+}
+
+static int readUint32(TsDeltaDecoder* decoder, uint32_t* value) {
+  uint8_t bytes[4];
+  if (decoder->read(decoder->stream, bytes, 4)) {
+    return 1;
+  }
+  *value = bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+  return 0;
+}
+
+static int writeOp(TsDeltaEncoder* encoder, int op, size_t a, size_t b) {
+  // Op byte followed by up to two LEB128 operands
+  uint8_t bytes[1 + 10 + 10];
+  size_t length = 0;
+  bytes[length++] = op;
+  size_t operands[2] = { a, b };
+  int operandCount = op == OP_COPY ? 2 : op == OP_LITERAL ? 1 : 0;
+  for (int i = 0; i < operandCount; i++) {
+    size_t value = operands[i];
+    do {
+      uint8_t byte = value & 0x7F;
+      value >>= 7;
+      bytes[length++] = value ? (byte | 0x80) : byte;
+    } while (value);
+  }
+  return encoder->write(encoder->stream, bytes, length);
+}
+
+static int readVarint(TsDeltaDecoder* decoder, size_t* value) {
+  *value = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    uint8_t byte;
+    if (decoder->read(decoder->stream, &byte, 1)) {
+      return 1;
+    }
+    *value |= (size_t)(byte & 0x7F) << shift;
+    if (!(byte & 0x80)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static int emitLiteral(TsDeltaEncoder* encoder, size_t length) {
+  if (length == 0) {
+    return 0;
+  }
+  if (writeOp(encoder, OP_LITERAL, length, 0)) {
+    return 1;
+  }
+  if (encoder->write(encoder->stream, encoder->pending, length)) {
+    return 1;
+  }
+  memmove(encoder->pending, encoder->pending + length, encoder->pendingLength - length);
+  encoder->pendingLength -= length;
+  return 0;
+}
+
+static int emitMatch(TsDeltaEncoder* encoder) {
+  if (encoder->matchLength == 0) {
+    return 0;
+  }
+  size_t offset = encoder->matchOffset - encoder->matchLength;
+  encoder->matchLength = 0;
+  return writeOp(encoder, OP_COPY, offset, encoder->matchOffset - offset);
+}
+
+int deltaEncoderInit(TsDeltaEncoder* encoder, const uint8_t* base, size_t baseSize, TsStreamCallback write, void* stream) {
+  memset(encoder, 0, sizeof(*encoder));
+  encoder->base = base;
+  encoder->baseSize = baseSize;
+  encoder->write = write;
+  encoder->stream = stream;
+
+  size_t blockCount = baseSize / BLOCK;
+  uint32_t tableSize = 16;
+  while (tableSize < blockCount * 2) {
+    tableSize *= 2;
+  }
+  encoder->tableMask = tableSize - 1;
+  encoder->table = calloc(tableSize, sizeof(uint32_t));
+  encoder->pending = malloc(MAX_LITERAL + BLOCK);
+  if (encoder->table == NULL || encoder->pending == NULL) {
+    deltaEncoderFree(encoder);
+    return 1;
+  }
+
+  for (size_t block = 0; block < blockCount; block++) {
+    uint32_t index = hashBlock(base + block * BLOCK) & encoder->tableMask;
+    // Keep the first occurrence of repeated blocks
+    while (encoder->table[index]) {
+      if (memcmp(base + (encoder->table[index] - 1) * BLOCK, base + block * BLOCK, BLOCK) == 0) {
+        break;
+      }
+      index = (index + 1) & encoder->tableMask;
+    }
+    if (!encoder->table[index]) {
+      encoder->table[index] = block + 1;
+    }
+  }
+
+  if (write(stream, (void*)DELTA_SIGNATURE, DELTA_SIGNATURE_LENGTH)) return 1;
+  if (writeUint32(encoder, baseSize)) return 1;
+  if (writeUint32(encoder, checksum(base, baseSize))) return 1;
+  return 0;
+}
+
+static const uint8_t* findBlock(TsDeltaEncoder* encoder, const uint8_t* window, uint32_t hash) {
+  uint32_t index = hash & encoder->tableMask;
+  while (encoder->table[index]) {
+    const uint8_t* candidate = encoder->base + (encoder->table[index] - 1) * BLOCK;
+    if (memcmp(candidate, window, BLOCK) == 0) {
+      return candidate;
+    }
+    index = (index + 1) & encoder->tableMask;
+  }
+  return NULL;
+}
+
+int deltaEncoderWrite(void* stream, void* address, size_t size) {
+  TsDeltaEncoder* encoder = stream;
+  const uint8_t* p = address;
+  static uint32_t power = 0;
+  if (!power) {
+    power = hashWindowPower();
+  }
+
+  for (size_t i = 0; i < size; i++) {
+    uint8_t byte = p[i];
+
+    // Extend the current copy run for as long as the input follows the base
+    if (encoder->matchLength) {
+      if (encoder->matchOffset < encoder->baseSize && encoder->base[encoder->matchOffset] == byte) {
+        encoder->matchOffset++;
+        encoder->matchLength++;
+        continue;
+      }
+      if (emitMatch(encoder)) return 1;
+      encoder->hash = 0;
+    }
+
+    encoder->pending[encoder->pendingLength++] = byte;
+    if (encoder->pendingLength > BLOCK) {
+      uint8_t oldest = encoder->pending[encoder->pendingLength - 1 - BLOCK];
+      encoder->hash = (encoder->hash - oldest * power) * HASH_MULTIPLIER + byte;
+    } else {
+      encoder->hash = encoder->hash * HASH_MULTIPLIER + byte;
+    }
+
+    if (encoder->pendingLength >= BLOCK) {
+      const uint8_t* window = encoder->pending + encoder->pendingLength - BLOCK;
+      const uint8_t* match = findBlock(encoder, window, encoder->hash);
+      if (match) {
+        if (emitLiteral(encoder, encoder->pendingLength - BLOCK)) return 1;
+        encoder->pendingLength = 0;
+        encoder->matchOffset = (match - encoder->base) + BLOCK;
+        encoder->matchLength = BLOCK;
+      } else if (encoder->pendingLength == MAX_LITERAL + BLOCK) {
+        // Flush everything but the hash window
+        if (emitLiteral(encoder, MAX_LITERAL)) return 1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+int deltaEncoderFinish(TsDeltaEncoder* encoder) {
+  if (emitMatch(encoder)) return 1;
+  if (emitLiteral(encoder, encoder->pendingLength)) return 1;
+  return writeOp(encoder, OP_END, 0, 0);
+}
+
+void deltaEncoderFree(TsDeltaEncoder* encoder) {
+  free(encoder->table);
+  free(encoder->pending);
+  encoder->table = NULL;
+  encoder->pending = NULL;
+}
+
+bool isDelta(const uint8_t* buffer, size_t size) {
+  return size >= DELTA_SIGNATURE_LENGTH && memcmp(buffer, DELTA_SIGNATURE, DELTA_SIGNATURE_LENGTH) == 0;
+}
+
+int deltaDecoderInit(TsDeltaDecoder* decoder, const uint8_t* base, size_t baseSize, TsStreamCallback read, void* stream) {
+  memset(decoder, 0, sizeof(*decoder));
+  decoder->base = base;
+  decoder->baseSize = baseSize;
+  decoder->read = read;
+  decoder->stream = stream;
+  decoder->op = OP_END;
+
+  char signature[sizeof(DELTA_SIGNATURE)];
+  uint32_t expectedSize;
+  uint32_t expectedChecksum;
+  if (read(stream, signature, DELTA_SIGNATURE_LENGTH)) return 1;
+  if (memcmp(signature, DELTA_SIGNATURE, DELTA_SIGNATURE_LENGTH) != 0) return 1;
+  if (readUint32(decoder, &expectedSize)) return 1;
+  if (readUint32(decoder, &expectedChecksum)) return 1;
+  if (expectedSize != baseSize || expectedChecksum != checksum(base, baseSize)) return 1;
+  return 0;
+}
+
+int deltaDecoderRead(void* stream, void* address, size_t size) {
+  TsDeltaDecoder* decoder = stream;
+  uint8_t* p = address;
+
+  while (size > 0) {
+    if (decoder->remaining == 0) {
+      uint8_t op;
+      if (decoder->read(decoder->stream, &op, 1)) return 1;
+      if (op == OP_LITERAL) {
+        if (readVarint(decoder, &decoder->remaining)) return 1;
+      } else if (op == OP_COPY) {
+        if (readVarint(decoder, &decoder->copyOffset)) return 1;
+        if (readVarint(decoder, &decoder->remaining)) return 1;
+        if (decoder->copyOffset > decoder->baseSize || decoder->remaining > decoder->baseSize - decoder->copyOffset) {
+          return 1;
+        }
+      } else {
+        // End of delta (or corrupt) while XS still expects more
+        return 1;
+      }
+      decoder->op = op;
+      continue;
+    }
+
+    size_t count = decoder->remaining < size ? decoder->remaining : size;
+    if (decoder->op == OP_LITERAL) {
+      if (decoder->read(decoder->stream, p, count)) return 1;
+    } else {
+      memcpy(p, decoder->base + decoder->copyOffset, count);
+      decoder->copyOffset += count;
+    }
+    decoder->remaining -= count;
+    p += count;
+    size -= count;
+  }
+
+  return 0;
+}
@@ -0,0 +1,61 @@
+/*
+Delta encoding of snapshots relative to a base snapshot.
+
+The encoder and decoder sit between the XS snapshot reader/writer and the
+underlying stream, so neither side needs the full (undelta'd) snapshot in
+memory. The delta is a sequence of operations which either copy a range of the
+base snapshot or insert literal bytes. Matches are found on BLOCK-aligned
+positions in the base (a multiple of the slot size, since the bulk of a
+snapshot is slots) using a rolling hash over the new snapshot, so regions which
+have shifted relative to the base are still found.
+*/
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "xs_sandbox_stream.h"
+
+extern const char DELTA_SIGNATURE[];
+extern const size_t DELTA_SIGNATURE_LENGTH;
+
+typedef struct TsDeltaEncoder {
+  const uint8_t* base;
+  size_t baseSize;
+  // Open-addressed table of (block index + 1), keyed by block hash
+  uint32_t* table;
+  uint32_t tableMask;
+  // Bytes not yet emitted. The last BLOCK bytes are the rolling hash window.
+  uint8_t* pending;
+  size_t pendingLength;
+  uint32_t hash;
+  // The current copy run, if matchLength > 0
+  size_t matchOffset;
+  size_t matchLength;
+  TsStreamCallback write;
+  void* stream;
+} TsDeltaEncoder;
+
+typedef struct TsDeltaDecoder {
+  const uint8_t* base;
+  size_t baseSize;
+  int op;
+  size_t remaining;
+  size_t copyOffset;
+  TsStreamCallback read;
+  void* stream;
+} TsDeltaDecoder;
+
+// Returns 0 on success
+int deltaEncoderInit(TsDeltaEncoder* encoder, const uint8_t* base, size_t baseSize, TsStreamCallback write, void* stream);
+int deltaEncoderWrite(void* encoder, void* address, size_t size);
+int deltaEncoderFinish(TsDeltaEncoder* encoder);
+void deltaEncoderFree(TsDeltaEncoder* encoder);
+
+bool isDelta(const uint8_t* buffer, size_t size);
+
+// Returns 0 on success, or non-zero if the delta is corrupt or was encoded
+// against a different base.
+int deltaDecoderInit(TsDeltaDecoder* decoder, const uint8_t* base, size_t baseSize, TsStreamCallback read, void* stream);
+int deltaDecoderRead(void* decoder, void* address, size_t size);
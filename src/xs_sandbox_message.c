@@ -0,0 +1,718 @@
+#include "xs_sandbox_message.h"
+#include "wedge.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+
+#define TAG_UNDEFINED 0
+#define TAG_NULL 1
+#define TAG_FALSE 2
+#define TAG_TRUE 3
+#define TAG_INT32 4
+#define TAG_FLOAT64 5
+#define TAG_STRING 6
+#define TAG_BIGINT 7
+#define TAG_ARRAY 8
+#define TAG_OBJECT 9
+#define TAG_DATE 10
+#define TAG_MAP 11
+#define TAG_SET 12
+#define TAG_ARRAY_BUFFER 13
+#define TAG_TYPED_ARRAY 14
+#define TAG_ERROR 15
+#define TAG_REFERENCE 16
+
+// Indexed by the kind byte of TAG_TYPED_ARRAY
+static char* typedArrayNames[] = {
+  "Int8Array",
+  "Uint8Array",
+  "Uint8ClampedArray",
+  "Int16Array",
+  "Uint16Array",
+  "Int32Array",
+  "Uint32Array",
+  "Float32Array",
+  "Float64Array",
+  "BigInt64Array",
+  "BigUint64Array",
+  "DataView",
+};
+#define TYPED_ARRAY_KIND_COUNT (int)(sizeof(typedArrayNames) / sizeof(typedArrayNames[0]))
+
+// Errors with these names are decoded with their own constructor. Others are
+// decoded as an Error with a `name` property.
+static char* errorNames[] = {
+  "Error",
+  "EvalError",
+  "RangeError",
+  "ReferenceError",
+  "SyntaxError",
+  "TypeError",
+  "URIError",
+};
+#define ERROR_NAME_COUNT (int)(sizeof(errorNames) / sizeof(errorNames[0]))
+
+typedef struct TsSeenObject {
+  void* instance;
+  uint32_t index;
+} TsSeenObject;
+
+typedef struct TsEncoder {
+  TsMessageBuffer* buffer;
+  // Objects encoded so far, indexed by reference number. This also keeps them
+  // alive so their addresses in `table` can't be reused mid-encode.
+  xsSlot* objects;
+  uint32_t objectCount;
+  // Open-addressed table of the objects, keyed by instance address
+  TsSeenObject* table;
+  uint32_t tableMask;
+} TsEncoder;
+
+typedef struct TsDecoder {
+  const uint8_t* data;
+  size_t size;
+  size_t offset;
+  // Objects decoded so far, indexed by reference number
+  xsSlot* objects;
+  uint32_t objectCount;
+} TsDecoder;
+
+static void encodeValue(xsMachine* the, TsEncoder* encoder, xsSlot* value);
+static void decodeValue(xsMachine* the, TsDecoder* decoder, xsSlot* result);
+
+// The codec recurses, so it can't use xsVars (which only works once per host
+// frame). Instead it reserves slots on the machine stack directly, which keeps
+// their values reachable by the GC.
+static xsSlot* pushSlot(xsMachine* the) {
+  xsOverflow(-1);
+  fxPush(xsUndefined);
+  return the->stack;
+}
+
+static void popSlots(xsMachine* the, int count) {
+  the->stack += count;
+}
+
+uint8_t* messageBufferReserve(TsMessageBuffer* buffer, size_t size) {
+  if (buffer->length + size > buffer->capacity) {
+    size_t capacity = buffer->capacity ? buffer->capacity * 2 : 256;
+    while (capacity < buffer->length + size) {
+      capacity *= 2;
+    }
+    uint8_t* data = realloc(buffer->data, capacity);
+    if (data == NULL) {
+      return NULL;
+    }
+    buffer->data = data;
+    buffer->capacity = capacity;
+  }
+  uint8_t* p = buffer->data + buffer->length;
+  buffer->length += size;
+  return p;
+}
+
+static uint8_t* reserve(xsMachine* the, TsMessageBuffer* buffer, size_t size) {
+  uint8_t* p = messageBufferReserve(buffer, size);
+  if (p == NULL) {
+    xsUnknownError("out of memory");
+  }
+  return p;
+}
+
+static void writeByte(xsMachine* the, TsMessageBuffer* buffer, uint8_t byte) {
+  *reserve(the, buffer, 1) = byte;
+}
+
+static void writeVarint(xsMachine* the, TsMessageBuffer* buffer, size_t value) {
+  do {
+    uint8_t byte = value & 0x7F;
+    value >>= 7;
+    writeByte(the, buffer, value ? (byte | 0x80) : byte);
+  } while (value);
+}
+
+// WASM is little-endian, which is what the format uses
+static void writeUint32(xsMachine* the, TsMessageBuffer* buffer, uint32_t value) {
+  memcpy(reserve(the, buffer, 4), &value, 4);
+}
+
+static void writeFloat64(xsMachine* the, TsMessageBuffer* buffer, double value) {
+  memcpy(reserve(the, buffer, 8), &value, 8);
+}
+
+static void writeBytes(xsMachine* the, TsMessageBuffer* buffer, const void* data, size_t size) {
+  writeVarint(the, buffer, size);
+  memcpy(reserve(the, buffer, size), data, size);
+}
+
+// XS keeps strings in its own variant of UTF-8: NUL is C0 80, so that strings
+// can be NUL-terminated, and each surrogate is encoded on its own, so that a
+// pair can take two 3-byte sequences. The message format uses WTF-8 instead,
+// which is UTF-8 that also allows lone surrogates.
+static bool isHighSurrogate(const uint8_t* p) {
+  return p[0] == 0xED && (p[1] & 0xF0) == 0xA0;
+}
+
+static bool isLowSurrogate(const uint8_t* p) {
+  return p[0] == 0xED && (p[1] & 0xF0) == 0xB0;
+}
+
+// Convert the character at `p` in an XS string to WTF-8, writing it to `out`
+// unless it's NULL. Returns the number of bytes read, and sets `*size` to the
+// number written.
+static size_t toWTF8(const uint8_t* p, uint8_t* out, size_t* size) {
+  if (p[0] == 0xC0 && p[1] == 0x80) {
+    if (out) out[0] = 0;
+    *size = 1;
+    return 2;
+  }
+  if (isHighSurrogate(p) && isLowSurrogate(p + 3)) {
+    uint32_t high = ((p[1] & 0x0F) << 6) | (p[2] & 0x3F);
+    uint32_t low = ((p[4] & 0x0F) << 6) | (p[5] & 0x3F);
+    uint32_t c = 0x10000 + (high << 10) + low;
+    if (out) {
+      out[0] = 0xF0 | (c >> 18);
+      out[1] = 0x80 | ((c >> 12) & 0x3F);
+      out[2] = 0x80 | ((c >> 6) & 0x3F);
+      out[3] = 0x80 | (c & 0x3F);
+    }
+    *size = 4;
+    return 6;
+  }
+  if (out) out[0] = p[0];
+  *size = 1;
+  return 1;
+}
+
+// Note: the string must be copied before anything else is allocated in the
+// machine, since the GC can move it.
+static void writeString(xsMachine* the, TsMessageBuffer* buffer, const char* string) {
+  const uint8_t* p = (const uint8_t*)string;
+  size_t length = 0;
+  for (size_t i = 0; p[i];) {
+    size_t size;
+    i += toWTF8(p + i, NULL, &size);
+    length += size;
+  }
+  writeVarint(the, buffer, length);
+  uint8_t* out = reserve(the, buffer, length);
+  for (size_t i = 0; p[i];) {
+    size_t size;
+    i += toWTF8(p + i, out, &size);
+    out += size;
+  }
+}
+
+static void writeNumber(xsMachine* the, TsMessageBuffer* buffer, double value) {
+  if (value >= INT32_MIN && value <= INT32_MAX && value == (int32_t)value && !(value == 0 && signbit(value))) {
+    writeByte(the, buffer, TAG_INT32);
+    writeUint32(the, buffer, (uint32_t)(int32_t)value);
+  } else {
+    writeByte(the, buffer, TAG_FLOAT64);
+    writeFloat64(the, buffer, value);
+  }
+}
+
+static uint32_t hashInstance(void* instance) {
+  return (uint32_t)(((uintptr_t)instance >> 4) * 2654435761u);
+}
+
+static bool findObject(TsEncoder* encoder, void* instance, uint32_t* index) {
+  if (!encoder->table) {
+    return false;
+  }
+  uint32_t i = hashInstance(instance) & encoder->tableMask;
+  while (encoder->table[i].instance) {
+    if (encoder->table[i].instance == instance) {
+      *index = encoder->table[i].index;
+      return true;
+    }
+    i = (i + 1) & encoder->tableMask;
+  }
+  return false;
+}
+
+static void insertObject(TsSeenObject* table, uint32_t mask, void* instance, uint32_t index) {
+  uint32_t i = hashInstance(instance) & mask;
+  while (table[i].instance) {
+    i = (i + 1) & mask;
+  }
+  table[i].instance = instance;
+  table[i].index = index;
+}
+
+static void addObject(xsMachine* the, TsEncoder* encoder, void* instance, xsSlot* value) {
+  // Keep the table at most half full
+  uint32_t tableSize = encoder->table ? encoder->tableMask + 1 : 0;
+  if ((encoder->objectCount + 1) * 2 > tableSize) {
+    uint32_t newSize = tableSize ? tableSize * 2 : 64;
+    TsSeenObject* newTable = calloc(newSize, sizeof(TsSeenObject));
+    if (newTable == NULL) {
+      xsUnknownError("out of memory");
+    }
+    for (uint32_t i = 0; i < tableSize; i++) {
+      if (encoder->table[i].instance) {
+        insertObject(newTable, newSize - 1, encoder->table[i].instance, encoder->table[i].index);
+      }
+    }
+    free(encoder->table);
+    encoder->table = newTable;
+    encoder->tableMask = newSize - 1;
+  }
+  insertObject(encoder->table, encoder->tableMask, instance, encoder->objectCount);
+  xsSetAt(*encoder->objects, xsInteger(encoder->objectCount), *value);
+  encoder->objectCount++;
+}
+
+static int typedArrayKind(const char* name) {
+  for (int kind = 0; kind < TYPED_ARRAY_KIND_COUNT; kind++) {
+    if (strcmp(name, typedArrayNames[kind]) == 0) {
+      return kind;
+    }
+  }
+  return -1;
+}
+
+static void encodeObject(xsMachine* the, TsEncoder* encoder, xsSlot* value) {
+  TsMessageBuffer* buffer = encoder->buffer;
+  void* instance = xsToInstance(*value);
+  uint32_t index;
+  if (findObject(encoder, instance, &index)) {
+    writeByte(the, buffer, TAG_REFERENCE);
+    writeVarint(the, buffer, index);
+    return;
+  }
+  // Functions can't be sent, so they're dropped like JSON.stringify does
+  if (xsIsInstanceOf(*value, xsFunctionPrototype)) {
+    writeByte(the, buffer, TAG_UNDEFINED);
+    return;
+  }
+  addObject(the, encoder, instance, value);
+
+  xsSlot* a = pushSlot(the);
+  xsSlot* b = pushSlot(the);
+  xsSlot* c = pushSlot(the);
+
+  if (xsIsInstanceOf(*value, xsArrayPrototype)) {
+    *a = xsGet(*value, xsID("length"));
+    uint32_t length = xsToUnsigned(*a);
+    writeByte(the, buffer, TAG_ARRAY);
+    writeVarint(the, buffer, length);
+    for (uint32_t i = 0; i < length; i++) {
+      *a = xsGetAt(*value, xsInteger(i));
+      encodeValue(the, encoder, a);
+    }
+  } else if (xsIsInstanceOf(*value, xsDatePrototype)) {
+    *a = xsCall0(*value, xsID("getTime"));
+    writeByte(the, buffer, TAG_DATE);
+    writeFloat64(the, buffer, xsToNumber(*a));
+  } else if (xsIsInstanceOf(*value, xsMapPrototype) || xsIsInstanceOf(*value, xsSetPrototype)) {
+    bool isMap = xsIsInstanceOf(*value, xsMapPrototype);
+    xsIdentifier idNext = xsID("next");
+    xsIdentifier idDone = xsID("done");
+    xsIdentifier idValue = xsID("value");
+    *a = xsGet(*value, xsID("size"));
+    uint32_t size = xsToUnsigned(*a);
+    writeByte(the, buffer, isMap ? TAG_MAP : TAG_SET);
+    writeVarint(the, buffer, size);
+    *a = isMap ? xsCall0(*value, xsID("entries")) : xsCall0(*value, xsID("values"));
+    for (uint32_t i = 0; i < size; i++) {
+      *b = xsCall0(*a, idNext);
+      *c = xsGet(*b, idDone);
+      if (xsToBoolean(*c)) {
+        xsTypeError("collection changed while encoding message");
+      }
+      *b = xsGet(*b, idValue);
+      if (isMap) {
+        *c = xsGetAt(*b, xsInteger(0));
+        encodeValue(the, encoder, c);
+        *c = xsGetAt(*b, xsInteger(1));
+        encodeValue(the, encoder, c);
+      } else {
+        encodeValue(the, encoder, b);
+      }
+    }
+  } else if (xsIsInstanceOf(*value, xsArrayBufferPrototype)) {
+    writeByte(the, buffer, TAG_ARRAY_BUFFER);
+    writeBytes(the, buffer, xsToArrayBuffer(*value), xsGetArrayBufferLength(*value));
+  } else if (xsIsInstanceOf(*value, xsTypedArrayPrototype) || xsIsInstanceOf(*value, xsDataViewPrototype)) {
+    // "[object Uint8Array]", etc.
+    *a = xsGet(xsObjectPrototype, xsID("toString"));
+    *a = xsCallFunction0(*a, *value);
+    const char* tag = xsToString(*a);
+    size_t tagLength = strlen(tag);
+    int kind = -1;
+    if (tagLength > 9) {
+      char name[32];
+      size_t nameLength = tagLength - 9;
+      if (nameLength < sizeof(name)) {
+        memcpy(name, tag + 8, nameLength);
+        name[nameLength] = 0;
+        kind = typedArrayKind(name);
+      }
+    }
+    if (kind < 0) {
+      xsTypeError("unsupported typed array");
+    }
+    *a = xsGet(*value, xsID("buffer"));
+    *b = xsGet(*value, xsID("byteOffset"));
+    size_t offset = xsToUnsigned(*b);
+    *b = xsGet(*value, xsID("byteLength"));
+    size_t length = xsToUnsigned(*b);
+    if (offset + length > (size_t)xsGetArrayBufferLength(*a)) {
+      xsTypeError("typed array out of bounds");
+    }
+    writeByte(the, buffer, TAG_TYPED_ARRAY);
+    writeByte(the, buffer, kind);
+    writeBytes(the, buffer, (uint8_t*)xsToArrayBuffer(*a) + offset, length);
+  } else if (xsIsInstanceOf(*value, xsErrorPrototype)) {
+    *a = xsGet(*value, xsID("name"));
+    writeByte(the, buffer, TAG_ERROR);
+    writeString(the, buffer, xsToString(*a));
+    *a = xsGet(*value, xsID("message"));
+    encodeValue(the, encoder, a);
+    *a = xsGet(*value, xsID("stack"));
+    encodeValue(the, encoder, a);
+  } else {
+    // Plain object, or anything else that's treated like one: own enumerable
+    // string-keyed properties
+    *a = xsGet(xsGlobal, xsID("Object"));
+    *a = xsCall1(*a, xsID("keys"), *value);
+    *b = xsGet(*a, xsID("length"));
+    uint32_t count = xsToUnsigned(*b);
+    writeByte(the, buffer, TAG_OBJECT);
+    writeVarint(the, buffer, count);
+    for (uint32_t i = 0; i < count; i++) {
+      *b = xsGetAt(*a, xsInteger(i));
+      writeString(the, buffer, xsToString(*b));
+      *c = xsGetAt(*value, *b);
+      encodeValue(the, encoder, c);
+    }
+  }
+
+  popSlots(the, 3);
+}
+
+static void encodeValue(xsMachine* the, TsEncoder* encoder, xsSlot* value) {
+  TsMessageBuffer* buffer = encoder->buffer;
+  switch (xsTypeOf(*value)) {
+    case xsUndefinedType:
+      writeByte(the, buffer, TAG_UNDEFINED);
+      break;
+    case xsNullType:
+      writeByte(the, buffer, TAG_NULL);
+      break;
+    case xsBooleanType:
+      writeByte(the, buffer, xsToBoolean(*value) ? TAG_TRUE : TAG_FALSE);
+      break;
+    case xsIntegerType:
+      writeByte(the, buffer, TAG_INT32);
+      writeUint32(the, buffer, (uint32_t)xsToInteger(*value));
+      break;
+    case xsNumberType:
+      writeNumber(the, buffer, xsToNumber(*value));
+      break;
+    case xsStringType:
+    case xsStringXType:
+      writeByte(the, buffer, TAG_STRING);
+      writeString(the, buffer, xsToString(*value));
+      break;
+    case xsBigIntType:
+    case xsBigIntXType: {
+      xsSlot* string = pushSlot(the);
+      *string = xsCall1(xsGlobal, xsID("String"), *value);
+      writeByte(the, buffer, TAG_BIGINT);
+      writeString(the, buffer, xsToString(*string));
+      popSlots(the, 1);
+      break;
+    }
+    case xsReferenceType:
+      encodeObject(the, encoder, value);
+      break;
+    default:
+      // Symbols, which like functions have no equivalent on the other side
+      writeByte(the, buffer, TAG_UNDEFINED);
+      break;
+  }
+}
+
+void encodeMessage(xsMachine* the, xsSlot* value, TsMessageBuffer* buffer) {
+  TsEncoder encoder;
+  memset(&encoder, 0, sizeof(encoder));
+  encoder.buffer = buffer;
+  encoder.objects = pushSlot(the);
+  size_t start = buffer->length;
+  xsTry {
+    *encoder.objects = xsNewArray(0);
+    encodeValue(the, &encoder, value);
+  }
+  xsCatch {
+    free(encoder.table);
+    buffer->length = start;
+    xsThrow(xsException);
+  }
+  free(encoder.table);
+  popSlots(the, 1);
+}
+
+static void corrupt(xsMachine* the) {
+  xsTypeError("corrupt message");
+}
+
+static const uint8_t* readBytes(xsMachine* the, TsDecoder* decoder, size_t size) {
+  if (size > decoder->size - decoder->offset) {
+    corrupt(the);
+  }
+  const uint8_t* p = decoder->data + decoder->offset;
+  decoder->offset += size;
+  return p;
+}
+
+static uint8_t readByte(xsMachine* the, TsDecoder* decoder) {
+  return *readBytes(the, decoder, 1);
+}
+
+static size_t readVarint(xsMachine* the, TsDecoder* decoder) {
+  size_t value = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    uint8_t byte = readByte(the, decoder);
+    value |= (size_t)(byte & 0x7F) << shift;
+    if (!(byte & 0x80)) {
+      return value;
+    }
+  }
+  corrupt(the);
+  return 0;
+}
+
+// The number of elements in a collection. Every element takes at least one
+// byte, so this can't be more than what's left of the message, which stops a
+// corrupt count from allocating a huge array.
+static size_t readCount(xsMachine* the, TsDecoder* decoder) {
+  size_t count = readVarint(the, decoder);
+  if (count > decoder->size - decoder->offset) {
+    corrupt(the);
+  }
+  return count;
+}
+
+// A string from WTF-8, which only differs from the way XS encodes strings in
+// NUL (see toWTF8), since lone surrogates are encoded the same way
+static xsSlot fromWTF8(xsMachine* the, const uint8_t* data, size_t length) {
+  size_t nulCount = 0;
+  for (size_t i = 0; i < length; i++) {
+    if (data[i] == 0) nulCount++;
+  }
+  if (!nulCount) {
+    return xsStringBuffer((char*)data, length);
+  }
+  xsSlot string = xsStringBuffer(NULL, length + nulCount);
+  uint8_t* out = (uint8_t*)xsToString(string);
+  for (size_t i = 0; i < length; i++) {
+    if (data[i] == 0) {
+      *out++ = 0xC0;
+      *out++ = 0x80;
+    } else {
+      *out++ = data[i];
+    }
+  }
+  return string;
+}
+
+static void addDecodedObject(xsMachine* the, TsDecoder* decoder, xsSlot* value) {
+  xsSetAt(*decoder->objects, xsInteger(decoder->objectCount), *value);
+  decoder->objectCount++;
+}
+
+// `obj[key] = value`, except that a "__proto__" key defines an own property
+// rather than setting the prototype (matching JSON.parse)
+static void setProperty(xsMachine* the, xsSlot* object, const uint8_t* key, size_t keyLength, xsSlot* value) {
+  xsSlot* name = pushSlot(the);
+  *name = fromWTF8(the, key, keyLength);
+  if (keyLength == 9 && memcmp(key, "__proto__", 9) == 0) {
+    xsSlot* descriptor = pushSlot(the);
+    xsSlot* constructor = pushSlot(the);
+    *descriptor = xsNewObject();
+    xsSet(*descriptor, xsID("value"), *value);
+    xsSet(*descriptor, xsID("writable"), xsTrue);
+    xsSet(*descriptor, xsID("enumerable"), xsTrue);
+    xsSet(*descriptor, xsID("configurable"), xsTrue);
+    *constructor = xsGet(xsGlobal, xsID("Object"));
+    xsCall3(*constructor, xsID("defineProperty"), *object, *name, *descriptor);
+    popSlots(the, 2);
+  } else {
+    xsSetAt(*object, *name, *value);
+  }
+  popSlots(the, 1);
+}
+
+static void decodeObject(xsMachine* the, TsDecoder* decoder, uint8_t tag, xsSlot* result) {
+  xsSlot* a = pushSlot(the);
+  xsSlot* b = pushSlot(the);
+
+  switch (tag) {
+    case TAG_ARRAY: {
+      size_t length = readCount(the, decoder);
+      *result = xsNewArray(length);
+      addDecodedObject(the, decoder, result);
+      for (size_t i = 0; i < length; i++) {
+        decodeValue(the, decoder, a);
+        xsSetAt(*result, xsInteger(i), *a);
+      }
+      break;
+    }
+    case TAG_OBJECT: {
+      size_t count = readCount(the, decoder);
+      *result = xsNewObject();
+      addDecodedObject(the, decoder, result);
+      for (size_t i = 0; i < count; i++) {
+        size_t keyLength = readVarint(the, decoder);
+        const uint8_t* key = readBytes(the, decoder, keyLength);
+        decodeValue(the, decoder, a);
+        setProperty(the, result, key, keyLength, a);
+      }
+      break;
+    }
+    case TAG_DATE: {
+      double time;
+      memcpy(&time, readBytes(the, decoder, 8), 8);
+      *result = xsNew1(xsGlobal, xsID("Date"), xsNumber(time));
+      addDecodedObject(the, decoder, result);
+      break;
+    }
+    case TAG_MAP:
+    case TAG_SET: {
+      size_t size = readCount(the, decoder);
+      *result = xsNew0(xsGlobal, tag == TAG_MAP ? xsID("Map") : xsID("Set"));
+      addDecodedObject(the, decoder, result);
+      xsIdentifier idSet = xsID("set");
+      xsIdentifier idAdd = xsID("add");
+      for (size_t i = 0; i < size; i++) {
+        decodeValue(the, decoder, a);
+        if (tag == TAG_MAP) {
+          decodeValue(the, decoder, b);
+          xsCall2(*result, idSet, *a, *b);
+        } else {
+          xsCall1(*result, idAdd, *a);
+        }
+      }
+      break;
+    }
+    case TAG_ARRAY_BUFFER: {
+      size_t length = readVarint(the, decoder);
+      const uint8_t* data = readBytes(the, decoder, length);
+      *result = xsArrayBuffer((void*)data, length);
+      addDecodedObject(the, decoder, result);
+      break;
+    }
+    case TAG_TYPED_ARRAY: {
+      uint8_t kind = readByte(the, decoder);
+      if (kind >= TYPED_ARRAY_KIND_COUNT) {
+        corrupt(the);
+      }
+      size_t length = readVarint(the, decoder);
+      const uint8_t* data = readBytes(the, decoder, length);
+      *a = xsArrayBuffer((void*)data, length);
+      *result = xsNew1(xsGlobal, xsID(typedArrayNames[kind]), *a);
+      addDecodedObject(the, decoder, result);
+      break;
+    }
+    case TAG_ERROR: {
+      size_t nameLength = readVarint(the, decoder);
+      const uint8_t* name = readBytes(the, decoder, nameLength);
+      int errorName = -1;
+      for (int i = 0; i < ERROR_NAME_COUNT; i++) {
+        if (strlen(errorNames[i]) == nameLength && memcmp(errorNames[i], name, nameLength) == 0) {
+          errorName = i;
+          break;
+        }
+      }
+      if (errorName >= 0) {
+        *result = xsNew0(xsGlobal, xsID(errorNames[errorName]));
+      } else {
+        *result = xsNew0(xsGlobal, xsID("Error"));
+        *a = fromWTF8(the, name, nameLength);
+        xsSet(*result, xsID("name"), *a);
+      }
+      addDecodedObject(the, decoder, result);
+      decodeValue(the, decoder, a);
+      xsSet(*result, xsID("message"), *a);
+      decodeValue(the, decoder, a);
+      if (xsTypeOf(*a) != xsUndefinedType) {
+        xsSet(*result, xsID("stack"), *a);
+      }
+      break;
+    }
+    default:
+      corrupt(the);
+  }
+
+  popSlots(the, 2);
+}
+
+static void decodeValue(xsMachine* the, TsDecoder* decoder, xsSlot* result) {
+  uint8_t tag = readByte(the, decoder);
+  switch (tag) {
+    case TAG_UNDEFINED:
+      *result = xsUndefined;
+      break;
+    case TAG_NULL:
+      *result = xsNull;
+      break;
+    case TAG_FALSE:
+      *result = xsFalse;
+      break;
+    case TAG_TRUE:
+      *result = xsTrue;
+      break;
+    case TAG_INT32: {
+      uint32_t value;
+      memcpy(&value, readBytes(the, decoder, 4), 4);
+      *result = xsInteger((int32_t)value);
+      break;
+    }
+    case TAG_FLOAT64: {
+      double value;
+      memcpy(&value, readBytes(the, decoder, 8), 8);
+      *result = xsNumber(value);
+      break;
+    }
+    case TAG_STRING:
+    case TAG_BIGINT: {
+      size_t length = readVarint(the, decoder);
+      const uint8_t* data = readBytes(the, decoder, length);
+      *result = fromWTF8(the, data, length);
+      if (tag == TAG_BIGINT) {
+        *result = xsCall1(xsGlobal, xsID("BigInt"), *result);
+      }
+      break;
+    }
+    case TAG_REFERENCE: {
+      size_t index = readVarint(the, decoder);
+      if (index >= decoder->objectCount) {
+        corrupt(the);
+      }
+      *result = xsGetAt(*decoder->objects, xsInteger(index));
+      break;
+    }
+    default:
+      decodeObject(the, decoder, tag, result);
+      break;
+  }
+}
+
+void decodeMessage(xsMachine* the, const uint8_t* data, size_t size, xsSlot* result) {
+  TsDecoder decoder;
+  memset(&decoder, 0, sizeof(decoder));
+  decoder.data = data;
+  decoder.size = size;
+  decoder.objects = pushSlot(the);
+  *decoder.objects = xsNewArray(0);
+  decodeValue(the, &decoder, result);
+  if (decoder.offset != decoder.size) {
+    corrupt(the);
+  }
+  popSlots(the, 1);
+}
@@ -0,0 +1,37 @@
+/*
+Binary encoding of messages passed between the host and the guest.
+
+This is the alternative to JSON used by sandboxes with the binary message
+format. It skips the stringify/parse round trip on both sides of the boundary,
+and it also carries the types that JSON loses: undefined, BigInt, Date, Map, Set,
+ArrayBuffer, typed arrays, Error, and shared or cyclic references. The host
+side of the codec is `message-codec.mts`, which documents the format. The two
+must be kept in sync.
+*/
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "xs.h"
+
+#define MESSAGE_FORMAT_JSON 0
+#define MESSAGE_FORMAT_BINARY 1
+
+typedef struct TsMessageBuffer {
+  uint8_t* data;
+  size_t length;
+  size_t capacity;
+} TsMessageBuffer;
+
+// Append `size` uninitialized bytes to the buffer and return a pointer to
+// them, or NULL if out of memory
+uint8_t* messageBufferReserve(TsMessageBuffer* buffer, size_t size);
+
+// Encode `*value`, appending it to `buffer`. The caller frees `buffer->data`.
+// Throws if the value can't be encoded, in which case the buffer is left as it
+// was.
+void encodeMessage(xsMachine* the, xsSlot* value, TsMessageBuffer* buffer);
+
+// Decode a message into `*result`. Throws if the message is corrupt.
+void decodeMessage(xsMachine* the, const uint8_t* data, size_t size, xsSlot* result);
@@ -97,35 +97,61 @@ void fxAbort(txMachine* the, int status)
 	}
 }
 
+// In xs_sandbox.c
+extern uint32_t getSandboxMemoryLimit(void* context);
+
 void fxCreateMachinePlatform(txMachine* the)
 {
-	size_t MB = 1024 * 1024;
-	the->allocationLimit = 256 * MB;
+	uint32_t limit = getSandboxMemoryLimit(the->context);
+	the->allocationLimit = limit ? limit : DEFAULT_ALLOCATION_LIMIT;
+	the->allocatedSpace = 0;
+	c_memset(&the->arena, 0, sizeof(the->arena));
 }
 
 void fxDeleteMachinePlatform(txMachine* the)
 {
 }
 
+// Slot and chunk blocks come from the machine's arena, away from other
+// allocations, and are counted against its allocation limit
+static void* fxAllocateCounted(txMachine* the, size_t size)
+{
+	void* data;
+	if ((size > the->allocationLimit) || (the->allocatedSpace > the->allocationLimit - size))
+		fxAbort(the, XS_NOT_ENOUGH_MEMORY_EXIT);
+	data = arenaAllocate(&the->arena, size);
+	if (data)
+		the->allocatedSpace += arenaBlockSize(data);
+	return data;
+}
+
+static void fxFreeCounted(txMachine* the, void* data)
+{
+	if (!data)
+		return;
+	the->allocatedSpace -= arenaBlockSize(data);
+	arenaFree(&the->arena, data);
+}
+
 txSlot* fxAllocateSlots(txMachine* the, txSize theCount)
 {
 	// printf("fxAllocateSlots: %i * %lu\n", theCount, sizeof(txSlot));
-	return (txSlot*)c_malloc(theCount * sizeof(txSlot));
+	return (txSlot*)fxAllocateCounted(the, theCount * sizeof(txSlot));
 }
 
 void fxFreeSlots(txMachine* the, void* theSlots)
 {
-	c_free(theSlots);
+	fxFreeCounted(the, theSlots);
 }
 
 void* fxAllocateChunks(txMachine* the, txSize size)
 {
-	return c_malloc(size);
+	return fxAllocateCounted(the, size);
 }
 
 void fxFreeChunks(txMachine* the, void* theChunks)
 {
-  c_free(theChunks);
+	fxFreeCounted(the, theChunks);
 }
 
 // TODO: Unused?
@@ -174,72 +200,136 @@ txScript* fxLoadScript(txMachine* the, txString path, txUnsigned flags)
 	return script;
 }
 
-// TODO: Unused?
+// Results of the host's loadModule
+#define MODULE_NOT_FOUND 0
+#define MODULE_SOURCE 1
+#define MODULE_BYTECODE 2
+#define MODULE_ERROR 3
+
+// Room for the parser's first error, or the message of an error from the host
+#define MODULE_ERROR_SIZE 1024
+
+// Host functions for the module registry. loadModule provides the source or
+// bytecode of a module, or the message of the error the registry threw, in a
+// new allocation which the caller frees.
+// moduleCompiled gives the host the bytecode of a module compiled from source,
+// so it can be reused by other sandboxes.
+extern int loadModule(int handle, const char* specifier, size_t specifierLength, txU1** out_buffer, size_t* out_size);
+extern void moduleCompiled(int handle, const char* specifier, size_t specifierLength, txU1* buffer, size_t size);
+
+// In xs_sandbox.c
+extern int getSandboxHandle(void* context);
+// In wedge.c
+extern void* fxCompileScript(txMachine* the, txString source, txSize size, txString path, txBoolean module, txSize* out_size, char* error, txSize errorSize);
+extern txScript* fxReadCompiledScript(void* buffer, txSize size, txBoolean module);
+
+/**
+ * Load a module from the host's module registry. Modules are only loaded when
+ * first imported. If the host has no module with the ID, the module is left
+ * unresolved and XS reports it as not found. If the registry throws, so does
+ * the import.
+ */
 void fxLoadModule(txMachine* the, txSlot* module, txID moduleID)
 {
-	char path[C_PATH_MAX];
-	char real[C_PATH_MAX];
-	txScript* script;
-#ifdef mxDebug
-	txUnsigned flags = mxDebugFlag;
-#else
-	txUnsigned flags = 0;
-#endif
-	c_strncpy(path, fxGetKeyName(the, moduleID), C_PATH_MAX - 1);
-	path[C_PATH_MAX - 1] = 0;
-	if (c_realpath(path, real)) {
-		script = fxLoadScript(the, real, flags);
-		if (script)
-			fxResolveModule(the, module, moduleID, script, C_NULL, C_NULL);
+	int handle = getSandboxHandle(the->context);
+	txString specifier = fxGetKeyName(the, moduleID);
+	size_t specifierLength = c_strlen(specifier);
+	txU1* buffer = C_NULL;
+	size_t size = 0;
+	txScript* script = C_NULL;
+	char error[MODULE_ERROR_SIZE];
+	int kind = loadModule(handle, specifier, specifierLength, &buffer, &size);
+	if (kind == MODULE_SOURCE) {
+		txSize bytecodeSize;
+		void* bytecode = fxCompileScript(the, (txString)buffer, (txSize)size, specifier, 1, &bytecodeSize, error, sizeof(error));
+		c_free(buffer);
+		if (!bytecode)
+			mxSyntaxError("%s", error);
+		moduleCompiled(handle, specifier, specifierLength, bytecode, bytecodeSize);
+		script = fxReadCompiledScript(bytecode, bytecodeSize, 1);
+		c_free(bytecode);
+		if (!script)
+			fxAbort(the, XS_NOT_ENOUGH_MEMORY_EXIT);
 	}
+	else if (kind == MODULE_BYTECODE) {
+		script = fxReadCompiledScript(buffer, (txSize)size, 1);
+		c_free(buffer);
+		if (!script)
+			mxTypeError("%s: invalid compiled module", specifier);
+	}
+	else if (kind == MODULE_ERROR) {
+		// Without a message, the host had no memory for the module
+		if (!buffer)
+			mxUnknownError("%s: out of memory", specifier);
+		if (size >= sizeof(error))
+			size = sizeof(error) - 1;
+		if (size)
+			c_memcpy(error, buffer, size);
+		error[size] = 0;
+		c_free(buffer);
+		mxUnknownError("%s: %s", specifier, error);
+	}
+	if (script)
+		fxResolveModule(the, module, moduleID, script, C_NULL, C_NULL);
 }
 
-// TODO: Unused?
+/**
+ * Resolve an import specifier to a module ID. Module IDs are the keys of the
+ * host's module registry, which are paths separated by "/". Specifiers starting
+ * with "./" or "../" are relative to the importing module, and any other
+ * specifier is used as is (apart from normalizing "." and ".." segments).
+ */
 txID fxFindModule(txMachine* the, txSlot* realm, txID moduleID, txSlot* slot)
 {
 	char name[C_PATH_MAX];
 	char path[C_PATH_MAX];
-	txInteger dot = 0;
-	txString slash;
+	txString p;
+	txString q;
 	fxToStringBuffer(the, slot, name, sizeof(name));
-	if (name[0] == '.') {
-		if (name[1] == '/') {
-			dot = 1;
-		}
-		else if ((name[1] == '.') && (name[2] == '/')) {
-			dot = 2;
+	path[0] = 0;
+	if ((name[0] == '.') && ((name[1] == '/') || ((name[1] == '.') && (name[2] == '/')))) {
+		// Start from the directory of the importing module. Scripts have no ID,
+		// so their imports are relative to the root.
+		if (moduleID != XS_NO_ID) {
+			c_strncpy(path, fxGetKeyName(the, moduleID), C_PATH_MAX - 1);
+			path[C_PATH_MAX - 1] = 0;
+			p = c_strrchr(path, '/');
+			*(p ? p + 1 : path) = 0;
 		}
 	}
-	if (dot) {
-		if (moduleID == XS_NO_ID)
-			return XS_NO_ID;
-		c_strncpy(path, fxGetKeyName(the, moduleID), C_PATH_MAX - 1);
-		path[C_PATH_MAX - 1] = 0;
-		slash = c_strrchr(path, mxSeparator);
-		if (!slash)
-			return XS_NO_ID;
-		if (dot == 2) {
-			*slash = 0;
-			slash = c_strrchr(path, mxSeparator);
-			if (!slash)
+	if (c_strlen(path) + c_strlen(name) >= C_PATH_MAX)
+		return XS_NO_ID;
+	c_strcat(path, name);
+
+	// Normalize in place. Segments are read at p and written at q, which never
+	// gets ahead of p.
+	p = q = path;
+	while (*p) {
+		txString end = c_strchr(p, '/');
+		size_t length = end ? (size_t)(end - p) : c_strlen(p);
+		if ((length == 0) || ((length == 1) && (p[0] == '.'))) {
+			// Skip empty and "." segments
+		}
+		else if ((length == 2) && (p[0] == '.') && (p[1] == '.')) {
+			// Drop the last segment written
+			if (q == path)
 				return XS_NO_ID;
+			while ((q > path) && (q[-1] != '/'))
+				q--;
+			if (q > path)
+				q--;
 		}
-#if mxWindows
-		{
-			char c;
-			char* s = name;
-			while ((c = *s)) {
-				if (c == '/')
-					*s = '\\';
-				s++;
-			}
+		else {
+			if (q > path)
+				*q++ = '/';
+			c_memmove(q, p, length);
+			q += length;
 		}
-#endif
+		p = end ? end + 1 : p + length;
 	}
-	else
-		slash = path;
-	*slash = 0;
-	c_strcat(path, name + dot);
+	*q = 0;
+	if (q == path)
+		return XS_NO_ID;
 	return fxNewNameC(the, path);
 }
 
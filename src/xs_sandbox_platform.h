@@ -8,6 +8,12 @@
 #define mxExport extern
 #define mxImport extern
 
+#include "xs_sandbox_arena.h"
+
+// The most memory a machine can allocate for slots and chunks, unless the host
+// sets a memory limit
+#define DEFAULT_ALLOCATION_LIMIT (256 * 1024 * 1024)
+
 // Compiling for WASM
 #if WASM_BUILD
 
@@ -48,7 +54,8 @@ typedef int txSocket;
 	void* waiterData; \
 	void* waiterLink; \
 	size_t allocationLimit; \
-	size_t allocatedSpace;
+	size_t allocatedSpace; \
+	TsArena arena;
 
 #define mxUseDefaultBuildKeys 1
 #define mxUseDefaultParseScript 1
@@ -94,7 +101,8 @@ typedef int txSocket;
 	void* waiterData; \
 	void* waiterLink; \
 	size_t allocationLimit; \
-	size_t allocatedSpace;
+	size_t allocatedSpace; \
+	TsArena arena;
 
 #define WIN32_LEAN_AND_MEAN
 #define _WINSOCK_DEPRECATED_NO_WARNINGS
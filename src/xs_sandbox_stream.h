@@ -0,0 +1,8 @@
+#pragma once
+
+#include <stddef.h>
+
+// Same signature as the txSnapshot read/write callbacks, so that stream filters
+// (delta encoding, compression) can be chained between XS and the underlying
+// stream.
+typedef int (*TsStreamCallback)(void* stream, void* address, size_t size);
@@ -0,0 +1,120 @@
+/*
+Round-trip tests of the snapshot compressor, which doesn't depend on XS so it's
+built natively with `make test-native`.
+*/
+
+#include "xs_sandbox_compress.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct Buffer {
+  uint8_t* data;
+  size_t length;
+  size_t capacity;
+  size_t offset;
+} Buffer;
+
+static int bufferWrite(void* stream, void* address, size_t size) {
+  Buffer* buffer = stream;
+  if (buffer->length + size > buffer->capacity) {
+    buffer->capacity = (buffer->length + size) * 2;
+    buffer->data = realloc(buffer->data, buffer->capacity);
+    if (!buffer->data) return 1;
+  }
+  memcpy(buffer->data + buffer->length, address, size);
+  buffer->length += size;
+  return 0;
+}
+
+static int bufferRead(void* stream, void* address, size_t size) {
+  Buffer* buffer = stream;
+  if (size > buffer->length - buffer->offset) return 1;
+  memcpy(address, buffer->data + buffer->offset, size);
+  buffer->offset += size;
+  return 0;
+}
+
+// Compress `input` and decompress it both ways, returning 0 if it comes back
+// the same
+static int roundTrip(const uint8_t* input, size_t size) {
+  Buffer compressed = { 0 };
+  TsLzEncoder encoder;
+  int failed = lzEncoderInit(&encoder, bufferWrite, &compressed)
+    || lzEncoderWrite(&encoder, (void*)input, size)
+    || lzEncoderFinish(&encoder);
+  lzEncoderFree(&encoder);
+
+  uint8_t* output = NULL;
+  size_t outputSize = 0;
+  if (!failed) {
+    failed = lzDecompressBuffer(compressed.data, compressed.length, &output, &outputSize)
+      || outputSize != size
+      || memcmp(output, input, size) != 0;
+  }
+  free(output);
+
+  if (!failed) {
+    TsLzDecoder decoder;
+    output = malloc(size ? size : 1);
+    failed = lzDecoderInit(&decoder, bufferRead, &compressed)
+      || lzDecoderRead(&decoder, output, size)
+      || memcmp(output, input, size) != 0;
+    lzDecoderFree(&decoder);
+    free(output);
+  }
+
+  free(compressed.data);
+  return failed;
+}
+
+static uint32_t randomState = 1;
+
+static uint8_t randomByte(void) {
+  randomState = randomState * 1103515245 + 12345;
+  return randomState >> 16;
+}
+
+int main(void) {
+  int failures = 0;
+  uint8_t* input = malloc(LZ_BLOCK_SIZE * 3);
+
+  // Random bytes with a repeated run of each length up to 64, then more random
+  // bytes. Random bytes don't compress, so some of these compress to exactly
+  // their own size, which must still be stored in a way that reads back.
+  for (size_t prefix = 16; prefix <= 1024; prefix *= 4) {
+    for (size_t run = 0; run <= 64; run++) {
+      for (size_t suffix = 8; suffix <= 32; suffix += 12) {
+        size_t size = 0;
+        for (size_t i = 0; i < prefix; i++) input[size++] = randomByte();
+        for (size_t i = 0; i < run; i++) input[size++] = input[i];
+        for (size_t i = 0; i < suffix; i++) input[size++] = randomByte();
+        if (roundTrip(input, size)) {
+          printf("FAIL: %zu random bytes, repeat of %zu, %zu random bytes\n", prefix, run, suffix);
+          failures++;
+        }
+      }
+    }
+  }
+
+  // Empty, compressible, and incompressible input across several blocks
+  if (roundTrip(input, 0)) {
+    printf("FAIL: empty\n");
+    failures++;
+  }
+  for (size_t i = 0; i < LZ_BLOCK_SIZE * 3; i++) input[i] = (i / 100) & 0xFF;
+  if (roundTrip(input, LZ_BLOCK_SIZE * 3)) {
+    printf("FAIL: compressible\n");
+    failures++;
+  }
+  for (size_t i = 0; i < LZ_BLOCK_SIZE * 3; i++) input[i] = randomByte();
+  if (roundTrip(input, LZ_BLOCK_SIZE * 3 - 7)) {
+    printf("FAIL: incompressible\n");
+    failures++;
+  }
+
+  free(input);
+  printf("%s\n", failures ? "compress tests failed" : "compress tests passed");
+  return failures ? 1 : 0;
+}
@@ -325,4 +325,773 @@ test('meter expired in run loop', async () => {
     () => sandbox.sendMessage(null),
     { message: 'Metering limit reached' }
   );
-});
\ No newline at end of file
+});
+
+test('instantiation failure', async () => {
+  // A module importing a function that the host doesn't provide
+  const module = new WebAssembly.Module(new Uint8Array([
+    0x00, 0x61, 0x73, 0x6D, 0x01, 0x00, 0x00, 0x00,
+    0x01, 0x04, 0x01, 0x60, 0x00, 0x00,
+    0x02, 0x0F, 0x01, 0x03, ...Buffer.from('env'), 0x07, ...Buffer.from('missing'), 0x00, 0x00,
+  ]));
+  await assert.rejects(XSSandbox.createInstance(module), WebAssembly.LinkError);
+});
+
+test('multiple sandboxes in one instance', async () => {
+  const instance = await XSSandbox.createInstance();
+  const sandbox1 = instance.create();
+  const sandbox2 = instance.create();
+  assert.equal(instance.sandboxCount, 2);
+
+  const received1: any[] = [];
+  const received2: any[] = [];
+  sandbox1.receiveMessage = m => received1.push(m);
+  sandbox2.receiveMessage = m => received2.push(m);
+
+  sandbox1.evaluate('var x = 1; sendMessage(x)');
+  sandbox2.evaluate('var x = 2; sendMessage(x)');
+  assert.equal(sandbox1.evaluate('x'), 1);
+  assert.equal(sandbox2.evaluate('x'), 2);
+  assert.deepEqual(received1, [1]);
+  assert.deepEqual(received2, [2]);
+
+  const sandbox3 = instance.restore(sandbox1.snapshot());
+  assert.equal(sandbox3.evaluate('++x'), 2);
+  assert.equal(sandbox1.evaluate('x'), 1);
+
+  sandbox1.dispose();
+  assert.equal(instance.sandboxCount, 2);
+  assert.throws(() => sandbox1.evaluate('x'));
+  assert.equal(sandbox2.evaluate('x'), 2);
+});
+
+test('precompiled module', async () => {
+  const module = await XSSandbox.precompile();
+  assert(module instanceof WebAssembly.Module);
+  // Cached
+  assert.equal(await XSSandbox.precompile(), module);
+
+  const sandbox = await XSSandbox.fromModule(module).create();
+  assert.equal(sandbox.evaluate('1 + 1'), 2);
+});
+
+test('streamed snapshot', async () => {
+  const sandbox1 = await XSSandbox.create();
+  sandbox1.evaluate('var i = 1');
+
+  const chunks: Uint8Array[] = [];
+  sandbox1.snapshot({ sink: chunk => chunks.push(chunk.slice()), chunkSize: 4096 });
+  assert(chunks.length > 1);
+  assert(chunks.every(chunk => chunk.length <= 4096));
+
+  // Same bytes as a buffered snapshot
+  const streamed = new Uint8Array(chunks.reduce((n, chunk) => n + chunk.length, 0));
+  let offset = 0;
+  for (const chunk of chunks) {
+    streamed.set(chunk, offset);
+    offset += chunk.length;
+  }
+  assert.deepEqual(streamed, sandbox1.snapshot());
+
+  const sandbox2 = await XSSandbox.restore(streamed);
+  assert.equal(sandbox2.evaluate('++i'), 2);
+});
+
+test('streamed snapshot sink error', async () => {
+  const sandbox = await XSSandbox.create();
+  assert.throws(
+    () => sandbox.snapshot({ sink: () => { throw new Error('disk full') } }),
+    { message: 'disk full' }
+  );
+});
+
+test('delta snapshot', async () => {
+  const template = await XSSandbox.create();
+  template.evaluate(`
+    var library = [];
+    for (let i = 0; i < 1000; i++) library.push({ i, name: 'item ' + i });
+    var counter = 0;
+  `);
+  const base = template.snapshot();
+
+  const sandbox1 = await XSSandbox.restore(base);
+  sandbox1.evaluate('counter++');
+  const full = sandbox1.snapshot();
+  const delta = sandbox1.snapshot({ base });
+  assert(delta.length < full.length / 4);
+
+  const sandbox2 = await XSSandbox.restore(delta, { base });
+  assert.equal(sandbox2.evaluate('counter'), 1);
+  assert.equal(sandbox2.evaluate('library[999].name'), 'item 999');
+
+  // Restoring a delta without its base fails
+  await assert.rejects(() => XSSandbox.restore(delta));
+  await assert.rejects(() => XSSandbox.restore(delta, { base: full }));
+});
+
+test('compressed snapshot', async () => {
+  const sandbox1 = await XSSandbox.create();
+  sandbox1.evaluate(`var items = []; for (let i = 0; i < 1000; i++) items.push({ i });`);
+  const full = sandbox1.snapshot();
+  const compressed = sandbox1.snapshot({ compress: true });
+  assert(compressed.length < full.length / 2);
+
+  const sandbox2 = await XSSandbox.restore(compressed);
+  assert.equal(sandbox2.evaluate('items.length'), 1000);
+
+  // Compressed delta against a compressed base
+  sandbox2.evaluate('items[0].i = -1');
+  const delta = sandbox2.snapshot({ base: compressed, compress: true });
+  const sandbox3 = await XSSandbox.restore(delta, { base: compressed });
+  assert.equal(sandbox3.evaluate('items[0].i'), -1);
+});
+
+test('sandbox pool', async () => {
+  const template = await XSSandbox.create();
+  template.evaluate('var greeting = "hello"');
+  const pool = await XSSandbox.createPool({
+    template: template.snapshot(),
+    size: 2,
+    refill: 'manual',
+  });
+  assert.equal(pool.stats.ready, 2);
+
+  const sandbox1 = await pool.acquire();
+  const sandbox2 = await pool.acquire();
+  assert.equal(sandbox1.evaluate('greeting'), 'hello');
+  sandbox1.evaluate('greeting = "changed"');
+  assert.equal(sandbox2.evaluate('greeting'), 'hello');
+  assert.equal(pool.tryAcquire(), undefined);
+
+  // Empty pool restores on demand
+  const sandbox3 = await pool.acquire();
+  assert.equal(sandbox3.evaluate('greeting'), 'hello');
+  assert.deepEqual(pool.stats, { hits: 2, misses: 1, ready: 0, restored: 3 });
+
+  // Concurrent refills don't overshoot the size
+  await Promise.all([pool.refill(), pool.refill()]);
+  assert.equal(pool.stats.ready, 2);
+  assert.equal(pool.stats.restored, 5);
+
+  pool.close();
+  assert.throws(() => pool.tryAcquire());
+});
+
+test('binary messages', async () => {
+  const sandbox = await XSSandbox.create({ messageFormat: 'binary' });
+
+  // Types which JSON can't represent, as an evaluate result
+  const value = sandbox.evaluate(`({
+    map: new Map([[1, 'one']]),
+    set: new Set([2n]),
+    date: new Date(0),
+    bytes: new Uint8Array([1, 2, 3]),
+    nothing: undefined,
+  })`);
+  assert(value.map instanceof Map);
+  assert.equal(value.map.get(1), 'one');
+  assert.deepEqual([...value.set], [2n]);
+  assert.equal(value.date.getTime(), 0);
+  assert.deepEqual([...value.bytes], [1, 2, 3]);
+  assert('nothing' in value);
+
+  // Host to guest and back, with a cycle
+  sandbox.evaluate(`globalThis.receiveMessage = message => {
+    if (message.self !== message) throw new Error('cycle lost');
+    message.list.push(message.list.length);
+    return message;
+  }`);
+  const message: any = { list: [1.5, -0, 'hello'] };
+  message.self = message;
+  const result = sandbox.sendMessage(message);
+  assert.equal(result.self, result);
+  assert.deepEqual(result.list, [1.5, -0, 'hello', 3]);
+
+  // Guest to host
+  let received: any;
+  sandbox.receiveMessage = message => {
+    received = message;
+    return new Map([['reply', 42]]);
+  };
+  assert.equal(sandbox.evaluate(`sendMessage(new Set(['a'])).get('reply')`), 42);
+  assert(received instanceof Set);
+  assert(received.has('a'));
+});
+
+test('binary message strings', async () => {
+  const sandbox = await XSSandbox.create({ messageFormat: 'binary' });
+  sandbox.evaluate(`globalThis.receiveMessage = message => {
+    const [key] = Object.keys(message);
+    return { [key]: [...message[key]].map(c => c.codePointAt(0)), echo: message[key] };
+  }`);
+  // NUL, lone surrogates, a pair and a BOM, as values and keys, both ways
+  const text = '\0a\uD800b\uDC00\uD83D\uDE00\uFEFF';
+  const result = sandbox.sendMessage({ [text]: text });
+  assert.deepEqual(result[text], [0, 0x61, 0xD800, 0x62, 0xDC00, 0x1F600, 0xFEFF]);
+  assert.equal(result.echo, text);
+  assert.equal(sandbox.evaluate(`'\\0\\uD800'`), '\0\uD800');
+});
+
+test('batched messages', async () => {
+  const sandbox = await XSSandbox.create();
+  sandbox.evaluate(`
+    var log = [];
+    globalThis.receiveMessage = message => {
+      if (message === 'throw') throw new Error('boom');
+      Promise.resolve().then(() => log.push('job ' + message));
+      log.push(message);
+      return message * 2;
+    }
+  `);
+  const results = sandbox.sendMessages([1, 'throw', 3]);
+  assert.deepEqual(results[0], { status: 'fulfilled', value: 2 });
+  assert.equal(results[1].status, 'rejected');
+  assert.equal((results[1] as any).reason.message, 'boom');
+  assert.deepEqual(results[2], { status: 'fulfilled', value: 6 });
+  // Promise jobs run once, after the last message
+  assert.deepEqual(sandbox.evaluate('log'), [1, 3, 'job 1', 'job 3']);
+
+  sandbox.evaluate('log = []');
+  sandbox.sendMessages([1, 3], { drain: 'each' });
+  assert.deepEqual(sandbox.evaluate('log'), [1, 'job 1', 3, 'job 3']);
+
+  // Jobs can't run partway through another call, so a nested batch can't
+  // drain after each message
+  sandbox.receiveMessage = () => sandbox.sendMessages([1], { drain: 'each' });
+  assert.match(sandbox.evaluate('try { sendMessage(0) } catch (e) { e.message }'), /drain/);
+});
+
+test('compiled scripts', async () => {
+  XSSandbox.clearScriptCache();
+  const source = 'globalThis.count = (globalThis.count ?? 0) + 1; count';
+  const sandbox1 = await XSSandbox.create();
+  const script = sandbox1.compile(source, { filename: 'counter.js' });
+  assert.equal(sandbox1.run(script), 1);
+  assert.equal(sandbox1.run(script), 2);
+
+  // Compiling the same script again, in any sandbox, hits the cache
+  const sandbox2 = await XSSandbox.create();
+  assert.equal(sandbox2.compile(source, { filename: 'counter.js' }), script);
+  assert.deepEqual(XSSandbox.scriptCacheStats(), { hits: 1, misses: 1, size: 1 });
+
+  // Serialized bytecode can be run in another instance
+  const loaded = XSSandbox.CompiledScript.deserialize(script.serialize());
+  assert.equal(sandbox2.run(loaded), 1);
+
+  assert.throws(() => sandbox1.compile('let let = 1'), { name: 'SyntaxError' });
+  // The parser's own report, rather than a generic message
+  assert.throws(() => sandbox1.compile('1;\nlet let = 1', { filename: 'bad.js' }), (e: any) =>
+    e.name === 'SyntaxError' && /^bad\.js:2: /.test(e.message) && !/cannot compile/.test(e.message));
+  assert.throws(() => sandbox1.run(XSSandbox.CompiledScript.deserialize(new Uint8Array(8))), /invalid compiled script/);
+});
+
+test('modules', async () => {
+  const modules = new XSSandbox.ModuleRegistry({
+    'lib/math.js': 'export function square(x) { return x * x }',
+    'app/main.js': 'import { square } from "../lib/math.js"; globalThis.result = square(7);',
+    'broken.js': 'export let let = 1',
+  });
+  const sandbox1 = await XSSandbox.create({ modules });
+  // Nothing is loaded until it's imported
+  assert.deepEqual(modules.stats, { loads: 0, compiles: 0 });
+  sandbox1.evaluate('import("app/main.js")');
+  assert.equal(sandbox1.evaluate('result'), 49);
+  assert.deepEqual(modules.stats, { loads: 2, compiles: 2 });
+
+  // Another sandbox sharing the registry reuses the compiled modules
+  const sandbox2 = await XSSandbox.create({ modules });
+  sandbox2.evaluate('import("./app/main.js")');
+  assert.equal(sandbox2.evaluate('result'), 49);
+  assert.deepEqual(modules.stats, { loads: 4, compiles: 2 });
+
+  // Precompiled modules
+  modules.set('answer.js', sandbox1.compile('export default 42', { module: true }));
+  sandbox1.evaluate('import("answer.js").then(m => globalThis.answer = m.default)');
+  assert.equal(sandbox1.evaluate('answer'), 42);
+
+  sandbox1.evaluate('import("broken.js").catch(e => globalThis.error = `${e.name}: ${e.message}`)');
+  assert.match(sandbox1.evaluate('error'), /^SyntaxError: broken\.js:1: /);
+  sandbox1.evaluate('import("missing.js").catch(e => globalThis.missing = true)');
+  assert.equal(sandbox1.evaluate('missing'), true);
+
+  // IDs are normalized the same way as imports
+  assert.equal(modules.get('app/../lib/./math.js'), 'export function square(x) { return x * x }');
+  assert.equal(modules.has('../lib/math.js'), false);
+  assert.throws(() => modules.set('lib/../../x.js', ''), /Invalid module ID/);
+
+  // An error from the registry is thrown by the import, not taken as not found
+  class FailingRegistry extends XSSandbox.ModuleRegistry {
+    load(id: string) {
+      throw new Error(`Cannot load ${id}`);
+    }
+  }
+  const sandbox3 = await XSSandbox.create({ modules: new FailingRegistry({ 'x.js': '' }) });
+  sandbox3.evaluate('import("x.js").catch(e => globalThis.error = e.message)');
+  assert.equal(sandbox3.evaluate('error'), 'x.js: Cannot load x.js');
+});
+
+test('machine sizing', async () => {
+  const instance = await XSSandbox.createInstance();
+  const tiny = instance.create({ sizing: 'tiny' });
+  assert.equal(tiny.evaluate('[1, 2, 3].map(x => x * 2).join()'), '2,4,6');
+  const large = instance.create({ sizing: 'large' });
+  assert.equal(large.evaluate('new Array(100000).fill(1).length'), 100000);
+  const custom = instance.create({ sizing: { stackCount: 32 * 1024 } });
+  assert.equal(custom.evaluate('function f(n) { return n ? f(n - 1) + 1 : 0 } f(1000)'), 1000);
+  assert.throws(() => instance.create({ sizing: { stackCount: 0 } }), RangeError);
+});
+
+test('memory limit', async () => {
+  const sandbox = await XSSandbox.create();
+  const before = sandbox.memoryStats();
+  assert(before.slotsInUse > 0 && before.slotsInUse <= before.slotsAllocated);
+  assert(before.chunkBytesInUse > 0 && before.chunkBytesInUse <= before.chunkBytesAllocated);
+  assert(before.heapBytes >= before.chunkBytesAllocated);
+  assert(before.wasmMemoryBytes >= before.heapBytes);
+
+  sandbox.evaluate('globalThis.data = new Array(100000).fill(0).map((_, i) => ({ i }))');
+  const after = sandbox.memoryStats();
+  assert(after.heapBytes > before.heapBytes);
+
+  sandbox.memoryLimit = after.heapBytes + 1024 * 1024;
+  assert.equal(sandbox.memoryLimit, after.heapBytes + 1024 * 1024);
+  assert.throws(() => sandbox.evaluate('const a = []; while (true) a.push({})'), /Memory limit reached/);
+
+  // Limits of 2 GB and over
+  sandbox.memoryLimit = 3 * 1024 ** 3;
+  assert.equal(sandbox.memoryLimit, 3 * 1024 ** 3);
+
+  // A restored sandbox has the limit from its options, not the default
+  const snapshot = sandbox.snapshot();
+  const restored = await XSSandbox.restore(snapshot, { memoryLimit: 2 ** 31 });
+  assert.equal(restored.memoryLimit, 2 ** 31);
+  assert.equal((await XSSandbox.restore(snapshot)).memoryLimit, undefined);
+  await assert.rejects(XSSandbox.restore(snapshot, { memoryLimit: 0 }), RangeError);
+});
+
+test('heap arena', async () => {
+  const instance = await XSSandbox.createInstance();
+  const first = instance.create();
+  const stats = first.memoryStats();
+  assert(stats.arenaBytes >= stats.heapBytes);
+  assert(stats.arenaPeakBytes >= stats.arenaBytes);
+  first.dispose();
+
+  // A disposed sandbox's arena is returned whole, so later sandboxes reuse it
+  // rather than growing the instance
+  for (let i = 0; i < 10; i++) {
+    instance.create().dispose();
+  }
+  assert(instance.create().memoryStats().wasmMemoryBytes <= stats.wasmMemoryBytes);
+});
+
+test('profiling', async () => {
+  const sandbox = await XSSandbox.create();
+  sandbox.run(sandbox.compile(`
+    function inner() { let x = 0; for (let i = 0; i < 1000; i++) x += i; return x }
+    function outer() { let total = 0; for (let i = 0; i < 200; i++) total += inner(); return total }
+  `, { filename: 'work.js' }));
+  sandbox.startProfiling({ sampleInterval: 100 });
+  sandbox.evaluate('outer()');
+  const profile = sandbox.stopProfiling();
+
+  assert(profile.samples.length > 0);
+  assert.equal(profile.dropped, 0);
+  const frames = profile.samples.flatMap(sample => sample.stack);
+  const inner = frames.find(frame => frame.functionName === 'inner');
+  assert(inner);
+  assert.equal(inner.url, 'work.js');
+  assert.match(profile.toCollapsed(), /outer \(work\.js:\d+\);inner \(work\.js:\d+\) \d+\n/);
+
+  const cpuProfile = profile.toCpuProfile();
+  assert.equal(cpuProfile.samples.length, profile.samples.length);
+  assert.equal(cpuProfile.timeDeltas.length, profile.samples.length);
+  assert(cpuProfile.nodes.some(node => node.callFrame.functionName === 'outer'));
+
+  // Host time between calls into the sandbox isn't sampled
+  sandbox.startProfiling();
+  const empty = sandbox.stopProfiling();
+  assert.equal(empty.samples.length, 0);
+});
+
+test('call stats', async () => {
+  const sandbox = await XSSandbox.create();
+  assert.equal(sandbox.stats(), undefined);
+  sandbox.receiveMessage = message => message;
+  sandbox.evaluate(`globalThis.receiveMessage = message => {
+    sendMessage(message);
+    Promise.resolve().then(() => sendMessage('later'));
+    return message;
+  }`);
+
+  const timings: any[] = [];
+  sandbox.enableStats(timing => timings.push(timing));
+  assert.equal(sandbox.sendMessage({ a: 1 }).a, 1);
+  sandbox.evaluate('1 + 1');
+
+  assert.equal(timings.length, 2);
+  const [message, evaluation] = timings;
+  assert.equal(message.kind, 'sendMessage');
+  assert.equal(message.hostCallbacks, 2);
+  assert.equal(evaluation.kind, 'evaluate');
+  assert.equal(evaluation.hostCallbacks, 0);
+  for (const timing of timings) {
+    let sum = 0;
+    for (const phase of Object.values(timing.phases) as number[]) {
+      assert(phase >= 0);
+      sum += phase;
+    }
+    assert(sum <= timing.total + 0.01);
+  }
+
+  const stats = sandbox.stats()!;
+  assert.equal(stats.calls, 2);
+  assert.equal(stats.hostCallbacks, 2);
+  assert.equal(stats.time.histogram.reduce((a, b) => a + b), 2);
+  assert.equal(stats.phases.dispatch.histogram.reduce((a, b) => a + b), 2);
+
+  sandbox.disableStats();
+  sandbox.evaluate('1 + 1');
+  assert.equal(timings.length, 2);
+  assert.equal(sandbox.stats(), undefined);
+});
+
+test('async pool', async () => {
+  const pool = await XSSandbox.createAsyncPool({ workers: 2, ringSize: 1024 });
+  try {
+    const sandboxes = await Promise.all([1, 2, 3, 4].map(() => pool.create()));
+    const results = await Promise.all(sandboxes.map((sandbox, i) => sandbox.evaluate(`globalThis.n = ${i}; n * 10`)));
+    assert.deepEqual(results, [0, 10, 20, 30]);
+    assert.equal(pool.stats.workers.reduce((total, worker) => total + worker.sandboxes, 0), 4);
+
+    // The guest waits for the host's asynchronous reply
+    const sandbox = sandboxes[1];
+    sandbox.receiveMessage = async message => message + 1;
+    assert.equal(await sandbox.evaluate('sendMessage(41)'), 42);
+
+    // Larger than the rings
+    const long = 'x'.repeat(10_000);
+    assert.equal(await sandbox.sendMessage(long), undefined);
+    assert.equal((await sandbox.evaluate(`'${long}' + n`)).length, 10_001);
+
+    await assert.rejects(sandbox.evaluate('throw new TypeError("oops")'), /oops/);
+
+    const snapshot = await sandbox.snapshot();
+    const restored = await pool.restore(snapshot);
+    assert.equal(await restored.evaluate('n'), 1);
+    assert.equal(await pool.evaluateOnce('n + 1', { snapshot }), 2);
+    await restored.dispose();
+  } finally {
+    await pool.close();
+  }
+});
+
+test('async pool with one worker', async () => {
+  const pool = await XSSandbox.createAsyncPool({ workers: 1 });
+  try {
+    // The only worker is blocked on the guest's sendMessage while the host
+    // waits for a job that needs a worker
+    const sandbox = await pool.create();
+    sandbox.receiveMessage = async script => pool.evaluateOnce(script);
+    assert.equal(await sandbox.evaluate('sendMessage("6 * 7")'), 42);
+    sandbox.receiveMessage = async () => (await pool.create()).evaluate('1');
+    assert.equal(await sandbox.evaluate('sendMessage()'), 1);
+  } finally {
+    await pool.close();
+  }
+});
+
+test('sendMessageAsync', async () => {
+  const sandbox = await XSSandbox.create();
+  const received: any[] = [];
+  const pending: [any, number][] = [];
+  sandbox.receiveMessage = message => { received.push(message) };
+  sandbox.receiveMessageAsync = (message, id) => { pending.push([message, id]) };
+
+  sandbox.evaluate(`
+    for (const n of [1, 2, 3]) {
+      sendMessageAsync(n).then(
+        result => sendMessage('resolved ' + result),
+        error => sendMessage('rejected ' + error.message));
+    }
+  `);
+  assert.deepEqual(pending.map(([message]) => message), [1, 2, 3]);
+  assert.deepEqual(received, []);
+
+  // Settled out of order, and each runs the promise jobs before returning
+  sandbox.resolve(pending[1][1], 20);
+  assert.deepEqual(received, ['resolved 20']);
+  sandbox.reject(pending[0][1], new Error('oops'));
+  assert.deepEqual(received, ['resolved 20', 'rejected oops']);
+  assert.throws(() => sandbox.resolve(pending[0][1], 10));
+
+  // The last call survives a snapshot
+  const restored = await XSSandbox.restore(sandbox.snapshot());
+  restored.receiveMessage = message => { received.push(message) };
+  restored.resolve(pending[2][1], 30);
+  assert.deepEqual(received, ['resolved 20', 'rejected oops', 'resolved 30']);
+
+  // Rejected straight away without a handler
+  sandbox.receiveMessageAsync = undefined;
+  sandbox.evaluate(`sendMessageAsync(4).catch(error => sendMessage('rejected 4'))`);
+  assert.equal(received[3], 'rejected 4');
+
+  // The guest can't reach the pending calls, or settle them itself
+  sandbox.receiveMessageAsync = (message, id) => { pending.push([message, id]) };
+  sandbox.evaluate(`
+    Object.prototype[1000] = [() => sendMessage('forged'), () => {}];
+    globalThis.Promise = class { constructor() { sendMessage('replaced') } };
+    sendMessageAsync(5).then(result => sendMessage('resolved ' + result));
+    sendMessageAsync(5, true, 'forged');
+  `);
+  assert.equal(sandbox.evaluate(`typeof __pendingHostCalls + Reflect.ownKeys(sendMessageAsync).length`), 'undefined2');
+  assert.throws(() => sandbox.resolve(1000, 0), /no pending host call/);
+  sandbox.resolve(pending[pending.length - 2][1], 50);
+  assert.deepEqual(received.slice(4), ['resolved 50']);
+  restored.dispose();
+  sandbox.dispose();
+});
+
+test('time slicing', async () => {
+  const sandbox = await XSSandbox.create({ timeSlice: 10_000 });
+  // Promise jobs are suspended between generations
+  sandbox.evaluate(`
+    globalThis.count = 0;
+    (async () => {
+      for (let i = 0; i < 10_000; i++) {
+        count++;
+        await null;
+      }
+    })();
+  `);
+  assert.equal(sandbox.suspended, true);
+  assert(sandbox.evaluate('count') < 10_000);
+  while (sandbox.resume());
+  assert.equal(sandbox.evaluate('count'), 10_000);
+
+  // Without the build that can interrupt calls, synchronous code runs to the
+  // end
+  if (!sandbox.instance.canInterrupt) {
+    assert.equal(sandbox.evaluate('let total = 0; for (let i = 0; i < 100_000; i++) total += i; total'), 4_999_950_000);
+    assert.equal(sandbox.suspended, false);
+  }
+  sandbox.dispose();
+
+  // A sandbox left with promise jobs carries them over to a restore
+  const between = await XSSandbox.create({ timeSlice: 1, meteringInterval: 1_000_000_000 });
+  between.evaluate('(async () => { await null; await null; globalThis.done = true })()');
+  assert.equal(between.suspended, true);
+  const restored = await XSSandbox.restore(between.snapshot());
+  assert.equal(restored.suspended, true);
+  restored.timeSlice = undefined;
+  assert.equal(restored.resume(), false);
+  assert.equal(restored.evaluate('done'), true);
+  restored.dispose();
+  between.dispose();
+});
+
+test('time slicing partway through a call', async function (this: Mocha.Context) {
+  const instance = await XSSandbox.createInstance();
+  // Only the build made with `make ASYNCIFY=1` can
+  if (!instance.canInterrupt) {
+    this.skip();
+  }
+  const sandbox = instance.create({ timeSlice: 10_000 });
+  // Synchronous code is suspended partway, and carries on where it stopped
+  assert.equal(sandbox.evaluate(`
+    let total = 0;
+    for (let i = 0; i < 100_000; i++) total += i;
+    total
+  `), undefined);
+  assert.equal(sandbox.suspended, true);
+  assert.throws(() => sandbox.evaluate('1'), /suspended/);
+  let resumes = 0;
+  while (sandbox.resume()) {
+    resumes++;
+  }
+  assert(resumes > 0);
+  assert.equal(sandbox.suspended, false);
+  assert.equal(sandbox.resumedResult, 4_999_950_000);
+
+  // The error of a suspended call is thrown when it finishes
+  sandbox.evaluate('for (let i = 0; i < 100_000; i++); throw new Error("late")');
+  assert.throws(() => { while (sandbox.resume()); }, /late/);
+
+  // A suspended call is abandoned when the sandbox is disposed of
+  sandbox.evaluate('while (true);');
+  assert.equal(sandbox.suspended, true);
+  sandbox.dispose();
+});
+
+test('large and nested payloads', async () => {
+  const sandbox = await XSSandbox.create();
+  const long = 'é'.repeat(2_000_000);
+  // Large results, built in the guest since a literal this long wouldn't fit in
+  // the parser's buffer
+  assert.equal(sandbox.evaluate(`'é'.repeat(${long.length})`), long);
+  assert.equal(sandbox.evaluate(`[${'1,'.repeat(1_000_000)}].length`), 1_000_000);
+  sandbox.evaluate('globalThis.receiveMessage = message => sendMessage(message)');
+  sandbox.receiveMessage = message => message.length;
+  assert.equal(sandbox.sendMessage(long), long.length);
+  assert.equal(sandbox.sendMessage('short'), 5);
+
+  // Large replies to the guest
+  sandbox.receiveMessage = message => message + '!';
+  assert.equal(sandbox.sendMessage(long), long + '!');
+
+  // Calls made from inside another call use their own buffers
+  sandbox.receiveMessage = message => sandbox.evaluate(`'é'.repeat(${message.length}) + '!'`);
+  const results = sandbox.sendMessages(['a', 'b', long]);
+  assert.deepEqual(results.map(result => result.status === 'fulfilled' && result.value.length), [2, 2, long.length + 1]);
+  sandbox.dispose();
+});
+
+test('evaluateStream', async () => {
+  const sandbox = await XSSandbox.create();
+  const bytes = new TextEncoder().encode('"é€😀"');
+  // Characters split across chunks, including a surrogate pair and UTF-8 bytes
+  const chunks = ['var a = 1;\n', 'var b = "\uD83D', '\uDE00";\n', bytes.subarray(0, 2), bytes.subarray(2)];
+  assert.equal(sandbox.evaluateStream(chunks), '"é€😀"');
+  assert.equal(sandbox.evaluate('a + b'), '1😀');
+
+  // A script in many chunks, larger than the chunks read by the engine
+  function* lines() {
+    yield 'let total = 0;\n';
+    for (let i = 0; i < 100_000; i++) {
+      yield `total += ${i};\n`;
+    }
+    yield 'total';
+  }
+  assert.equal(sandbox.evaluateStream(lines()), 4_999_950_000);
+
+  // A string literal larger than the default parser buffer
+  const long = 'x'.repeat(2 * 1024 * 1024);
+  assert.equal(sandbox.evaluateStream(['"', long, '".length'], { parserBufferSize: 3 * 1024 * 1024 }), long.length);
+
+  assert.throws(() => sandbox.evaluateStream(['1 +']), { name: 'SyntaxError', message: /^<anonymous>:1: / });
+  assert.throws(() => sandbox.evaluateStream(['1;\n', '1 +'], { filename: 'stream.js' }), { name: 'SyntaxError', message: /^stream\.js:2: / });
+  function* failing() {
+    yield 'globalThis.ran = true;';
+    throw new Error('Read failed');
+  }
+  assert.throws(() => sandbox.evaluateStream(failing()), { message: 'Read failed' });
+  assert.equal(sandbox.evaluate('globalThis.ran'), undefined);
+  sandbox.dispose();
+});
+
+test('fork', async () => {
+  const sandbox = await XSSandbox.create({ meteringLimit: 1_000_000 });
+  sandbox.evaluate('var x = 1; globalThis.receiveMessage = message => message + x');
+  const fork = sandbox.fork();
+  // The fork has the state at the time of the call
+  sandbox.evaluate('x = 10');
+  const forked = await fork;
+  assert.equal(forked.evaluate('++x'), 2);
+  assert.equal(sandbox.evaluate('x'), 10);
+  assert.equal(forked.sendMessage(1), 3);
+  assert.equal(forked.meteringLimit, 1_000_000);
+
+  // Other sandboxes of the instance aren't carried over
+  const instance = await XSSandbox.createInstance();
+  const first = instance.create();
+  const second = instance.create();
+  first.evaluate('var y = 1');
+  const secondFork = await second.fork();
+  assert.equal(secondFork.instance.sandboxCount, 1);
+  assert.equal(secondFork.evaluate('typeof y'), 'undefined');
+
+  forked.dispose();
+  secondFork.dispose();
+  sandbox.dispose();
+});
+
+test('memory image', async () => {
+  const sandbox = await XSSandbox.create();
+  sandbox.evaluate('var x = 1');
+  const image = sandbox.memoryImage();
+  const snapshot = sandbox.snapshot();
+  sandbox.evaluate('x = 10');
+
+  const restored = await XSSandbox.restore(image);
+  assert.equal(restored.evaluate('++x'), 2);
+  assert.equal(restored.instance.buildHash, sandbox.instance.buildHash);
+
+  // An image can't be loaded into an instance that has other sandboxes
+  const instance = await XSSandbox.createInstance();
+  const other = instance.create();
+  assert.throws(() => instance.restore(image), /no sandboxes/);
+  const fallback = instance.restore(image, { fallback: snapshot });
+  assert.equal(fallback.evaluate('++x'), 2);
+
+  // Nor one from a different build
+  const foreign = image.slice();
+  foreign['xs-sandbox-image-1'.length + 1] ^= 1;
+  assert.throws(() => instance.restore(foreign), /different build/);
+
+  other.dispose();
+  fallback.dispose();
+  restored.dispose();
+  sandbox.dispose();
+});
+
+test('journal and replay', async () => {
+  const sandbox = await XSSandbox.create({ deterministic: true, randomSeed: 42 });
+  sandbox.evaluate(`
+    var log = [];
+    globalThis.receiveMessage = message => {
+      log.push([message, Math.random(), Date.now(), sendMessage('lookup')]);
+      return log.length;
+    }
+  `);
+  const snapshot = sandbox.snapshot();
+  const journal: Uint8Array[] = [];
+  sandbox.journal = record => journal.push(record);
+  let lookups = 0;
+  sandbox.receiveMessage = () => ++lookups;
+  sandbox.sendMessage('a');
+  sandbox.sendMessages(['b', 'c']);
+  sandbox.evaluate('log.push(new Date().getTime())');
+  const expected = sandbox.evaluate('log');
+  assert.equal(expected.length, 4);
+
+  const replayed = await XSSandbox.replay(snapshot, journal);
+  assert.deepEqual(replayed.evaluate('log'), expected);
+  // The answers to the guest's calls came from the journal
+  assert.equal(lookups, 3);
+  replayed.dispose();
+  sandbox.dispose();
+});
+
+test('heap summary', async () => {
+  const sandbox = await XSSandbox.create();
+  const before = sandbox.heapSummary();
+  sandbox.evaluate(`
+    globalThis.cache = [];
+    for (let i = 0; i < 1000; i++) cache.push({ name: 'item ' + i });
+    globalThis.pending = [];
+    for (let i = 0; i < 10; i++) pending.push((async () => { await new Promise(() => {}) })());
+  `);
+  const after = sandbox.heapSummary();
+  assert(after.kinds.objects.count >= before.kinds.objects.count + 1000);
+  assert(after.kinds.strings.bytes > before.kinds.strings.bytes);
+  assert(after.kinds.asyncFrames.count >= before.kinds.asyncFrames.count + 10);
+  assert(after.kinds.promises.count >= before.kinds.promises.count + 10);
+
+  const largest = after.largest[0];
+  assert.equal(largest.kind, 'arrays');
+  assert.deepEqual(largest.retainers, [{ kind: 'objects', key: 'cache' }]);
+
+  // A string referred to from many places is counted once, and counting
+  // leaves nothing behind
+  sandbox.evaluate(`globalThis.copies = new Array(100).fill('x'.repeat(100_000))`);
+  const shared = sandbox.heapSummary();
+  assert(shared.kinds.strings.bytes - after.kinds.strings.bytes < 2 * 100_000);
+  assert.deepEqual(sandbox.heapSummary().kinds, shared.kinds);
+  sandbox.evaluate('delete globalThis.copies');
+
+  const offline = await XSSandbox.analyzeSnapshot(sandbox.snapshot());
+  assert.equal(offline.kinds.asyncFrames.count, after.kinds.asyncFrames.count);
+  assert.equal(offline.largest[0].kind, 'arrays');
+
+  sandbox.dispose();
+});